@@ -0,0 +1,510 @@
+/**
+ * MojoZork; a simple, just-for-fun implementation of Infocom's Z-Machine.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+// This replays scripts through the Z-Machine with all output thrown away,
+//  and reports how fast it went, so we have something to measure interpreter
+//  changes against. Usage:
+//
+//     ./mojozork-bench [--iterations N] [--strings] zork1.dat zork1-script.txt [more scripts...]
+//
+//  With --strings, it also remembers every string the scripts printed, and
+//  then times decoding all of them with abbreviations copied from the pool
+//  initStory() built, against decoding each abbreviation as it comes up.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN 1
+#include <windows.h>
+#endif
+
+#define MOJOZORK_BENCH 1
+#include "mojozork.c"
+
+#define MOJOZORK_BENCH_DEFAULT_ITERATIONS 10
+
+// --strings decodes everything this many times per iteration, since one pass is way too fast to measure.
+#define MOJOZORK_BENCH_STRING_PASSES 100
+
+static uint8 *original_story = NULL;
+static size_t original_story_len = 0;
+static const char *story_fname = NULL;
+
+static char *script = NULL;  // the whole script file, we chop it into lines as we go.
+static char *script_pos = NULL;  // next line to feed to the game.
+static int reading = 0;  // non-zero if the game is waiting on a READ opcode.
+static uint16 read_operands[2];  // text and parse buffer addresses from the last READ.
+
+static uint64_t *latencies = NULL;  // nanoseconds each command took, for all runs of a script.
+static size_t num_latencies = 0;
+static size_t latencies_allocated = 0;
+
+static int bench_strings = 0;  // non-zero if we should record printed strings for benchStrings().
+static uint32 *string_addrs = NULL;  // every string the scripts printed, might have duplicates until benchStrings() sorts them.
+static size_t num_string_addrs = 0;
+static size_t string_addrs_allocated = 0;
+
+static uint64_t now_ns(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&count);
+    return (uint64_t) ((((double) count.QuadPart) / ((double) freq.QuadPart)) * 1000000000.0);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (((uint64_t) ts.tv_sec) * 1000000000ull) + ((uint64_t) ts.tv_nsec);
+#endif
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+static void die_bench(const char *fmt, ...) __attribute__((noreturn));
+#elif defined(_MSC_VER)
+__declspec(noreturn) static void die_bench(const char *fmt, ...);
+#endif
+
+static void die_bench(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "\nERROR: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    if (GState) {
+        fprintf(stderr, " (pc=%X)\n", (unsigned int) GState->logical_pc);
+        fprintf(stderr, " %u instructions run", (unsigned int) GState->instructions_run);
+    }
+    fprintf(stderr, "\n\n");
+    fflush(stderr);
+
+    exit(1);
+}
+
+static void writestr_bench(const char *str, const uintptr slen)
+{
+    // throw it away, we only care how long it took to generate.
+    (void) str;
+    (void) slen;
+}
+
+static void opcode_read_bench(void)
+{
+    uint8 *input = GState->story + GState->operands[0];
+    const uint8 inputlen = *input;
+    if (inputlen < 3) {
+        GState->die("text buffer is too small for reading");  // happens on buffer overflow.
+    }
+
+    const uint8 *parse = GState->story + GState->operands[1];
+    const uint8 parselen = *parse;
+    if (parselen == 0) {
+        GState->die("parse buffer is too small for reading");  // happens on buffer overflow.
+    }
+
+    // the main loop will fill in the input and tokenize it before running again.
+    read_operands[0] = GState->operands[0];
+    read_operands[1] = GState->operands[1];
+    reading = 1;
+    GState->step_completed = 1;
+}
+
+static void recordString(const uint8 *str)
+{
+    if ((str < GState->story) || (str >= (GState->story + GState->story_len))) {
+        return;  // not in Z-Machine memory, don't care.
+    } else if (num_string_addrs >= string_addrs_allocated) {
+        const size_t newlen = string_addrs_allocated ? (string_addrs_allocated * 2) : 1024;
+        void *ptr = realloc(string_addrs, newlen * sizeof (uint32));
+        if (!ptr) {
+            die_bench("Out of memory");
+        }
+        string_addrs = (uint32 *) ptr;
+        string_addrs_allocated = newlen;
+    }
+    string_addrs[num_string_addrs++] = (uint32) (str - GState->story);
+}
+
+static void opcode_print_bench(void)
+{
+    recordString(GState->pc);
+    opcode_print();
+}
+
+static void opcode_print_ret_bench(void)
+{
+    recordString(GState->pc);
+    opcode_print_ret();
+}
+
+static void opcode_print_addr_bench(void)
+{
+    recordString(GState->story + GState->operands[0]);
+    opcode_print_addr();
+}
+
+static void opcode_print_paddr_bench(void)
+{
+    recordString(unpackAddress(GState->operands[0]));
+    opcode_print_paddr();
+}
+
+static void opcode_print_obj_bench(void)
+{
+    const uint8 *ptr = getObjectPtr(GState->operands[0]) + 7;  // skip to properties field.
+    const uint16 addr = READUI16(ptr);
+    recordString(GState->story + addr + 1);
+    opcode_print_obj();
+}
+
+static void initBenchStory(void);
+
+static void opcode_restart_bench(void)
+{
+    initBenchStory();  // the core version would reload from disk and lose our opcode overrides.
+}
+
+static void initBenchStory(void)
+{
+    uint8 *story = (uint8 *) malloc(original_story_len);
+    if (!story) {
+        GState->die("Out of memory");
+    }
+    memcpy(story, original_story, original_story_len);
+    initStory(story_fname, story, (uint32) original_story_len);
+    GState->opcodes[183].fn = opcode_restart_bench;
+    GState->opcodes[228].fn = opcode_read_bench;
+    if (bench_strings) {
+        GState->opcodes[178].fn = opcode_print_bench;
+        GState->opcodes[179].fn = opcode_print_ret_bench;
+        for (int i = 128; i <= 160; i += 16) {  // 1OP opcodes repeat with different operand forms.
+            GState->opcodes[i + 7].fn = opcode_print_addr_bench;
+            GState->opcodes[i + 10].fn = opcode_print_obj_bench;
+            GState->opcodes[i + 13].fn = opcode_print_paddr_bench;
+        }
+    }
+    reading = 0;
+}
+
+// returns NULL when the script is done.
+static const char *nextScriptLine(void)
+{
+    while (script_pos && *script_pos) {
+        char *line = script_pos;
+        char *ptr = strchr(line, '\n');
+        if (ptr) {
+            script_pos = ptr + 1;
+            *ptr = '\0';
+        } else {
+            script_pos = line + strlen(line);
+        }
+
+        ptr = strchr(line, '\r');
+        if (ptr) {
+            *ptr = '\0';
+        }
+
+        if (strncmp(line, "#random ", 8) == 0) {  // same as the standalone interpreter's meta-command.
+            doRandom((sint16) atoi(line + 8));
+            continue;
+        } else if (line[0] == '#') {  // other meta-commands aren't supported here.
+            continue;
+        }
+
+        return line;
+    }
+
+    return NULL;
+}
+
+static void sendInput(const char *line)
+{
+    char *input = (char *) (GState->story + read_operands[0]);
+    const uint8 inputlen = (uint8) *(input++);
+    snprintf(input, inputlen - 1, "%s", line);
+    for (char *ptr = input; *ptr; ptr++) {
+        if ((*ptr >= 'A') && (*ptr <= 'Z')) {
+            *ptr -= 'A' - 'a';  // make it lowercase.
+        }
+    }
+
+    GState->operands[0] = read_operands[0];  // tokenizing needs this.
+    GState->operands[1] = read_operands[1];
+    GState->operand_count = 2;
+    reading = 0;
+    tokenizeUserInput();  // now the Z-Machine will get what it expects from the previous READ instruction.
+}
+
+static void addLatency(const uint64_t ns)
+{
+    if (num_latencies >= latencies_allocated) {
+        const size_t newlen = latencies_allocated ? (latencies_allocated * 2) : 1024;
+        void *ptr = realloc(latencies, newlen * sizeof (uint64_t));
+        if (!ptr) {
+            die_bench("Out of memory");
+        }
+        latencies = (uint64_t *) ptr;
+        latencies_allocated = newlen;
+    }
+    latencies[num_latencies++] = ns;
+}
+
+static int cmpLatency(const void *a, const void *b)
+{
+    const uint64_t x = *((const uint64_t *) a);
+    const uint64_t y = *((const uint64_t *) b);
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static double percentileUsecs(const double pct)
+{
+    if (num_latencies == 0) {
+        return 0.0;
+    }
+    size_t idx = (size_t) ((pct / 100.0) * ((double) num_latencies));
+    if (idx >= num_latencies) {
+        idx = num_latencies - 1;
+    }
+    return ((double) latencies[idx]) / 1000.0;
+}
+
+static char *loadFile(const char *fname, size_t *_len)
+{
+    char *retval = NULL;
+    FILE *io = NULL;
+    long len = 0;
+
+    if ((io = fopen(fname, "rb")) == NULL) {
+        die_bench("Failed to open '%s'", fname);
+    } else if ((fseek(io, 0, SEEK_END) == -1) || ((len = ftell(io)) == -1)) {
+        die_bench("Failed to determine size of '%s'", fname);
+    } else if ((retval = (char *) malloc(len + 1)) == NULL) {
+        die_bench("Out of memory");
+    } else if ((fseek(io, 0, SEEK_SET) == -1) || ((len > 0) && (fread(retval, len, 1, io) != 1))) {
+        die_bench("Failed to read '%s'", fname);
+    }
+    fclose(io);
+
+    retval[len] = '\0';
+    if (_len) {
+        *_len = (size_t) len;
+    }
+    return retval;
+}
+
+static void benchScript(const char *script_fname, const int iterations)
+{
+    size_t script_len = 0;
+    char *script_source = loadFile(script_fname, &script_len);
+    uint64_t total_instructions = 0;
+    uint64_t total_ns = 0;
+    size_t commands_per_run = 0;
+    uint32 decode_hits = 0;
+    uint32 decode_misses = 0;
+    uint32 translations = 0;
+    uint32 translated_instructions = 0;
+    uint64_t superinstructions = 0;
+    uint32 string_hits = 0;
+    uint32 string_misses = 0;
+
+    script = (char *) malloc(script_len + 1);
+    if (!script) {
+        die_bench("Out of memory");
+    }
+
+    num_latencies = 0;
+
+    for (int i = 0; i < iterations; i++) {
+        memcpy(script, script_source, script_len + 1);
+        script_pos = script;
+        random_seed = 0;  // scripts usually start with "#random" to make this deterministic anyhow.
+
+        const uint64_t start_ns = now_ns();
+        const size_t first_latency = num_latencies;
+
+        initBenchStory();
+        GState->step_completed = 0;
+        runZMachine();  // run until the first READ.
+
+        const char *line;
+        while (reading && !GState->quit && ((line = nextScriptLine()) != NULL)) {
+            const uint64_t cmd_start_ns = now_ns();
+            sendInput(line);
+            GState->step_completed = 0;
+            runZMachine();
+            addLatency(now_ns() - cmd_start_ns);
+        }
+
+        total_ns += now_ns() - start_ns;
+        total_instructions += GState->instructions_run;
+        commands_per_run = num_latencies - first_latency;
+        superinstructions += GState->superinstructions_run;
+        #if MOJOZORK_STRING_CACHE
+        string_hits += GState->string_cache_hits;
+        string_misses += GState->string_cache_misses;
+        #endif
+        #if MOJOZORK_DECODE_CACHE
+        decode_hits += GState->decode_cache_hits;
+        decode_misses += GState->decode_cache_misses;
+        if (GState->decode_cache) {  // these are the same every run, since we start over each time.
+            translations = GState->decode_cache->num_translations;
+            translated_instructions = GState->decode_cache->num_instructions;
+        }
+        #endif
+    }
+
+    qsort(latencies, num_latencies, sizeof (uint64_t), cmpLatency);
+
+    const double secs = ((double) total_ns) / 1000000000.0;
+    printf("%s: %d runs, %u commands per run\n", script_fname, iterations, (unsigned int) commands_per_run);
+    printf("  wall time:    %.6f s total, %.6f s per run\n", secs, secs / ((double) iterations));
+    printf("  instructions: %llu total, %llu per run\n", (unsigned long long) total_instructions, (unsigned long long) (total_instructions / iterations));
+    printf("  speed:        %.2f MIPS\n", (secs > 0.0) ? ((((double) total_instructions) / secs) / 1000000.0) : 0.0);
+    printf("  per command:  p50 %.1fus, p90 %.1fus, p99 %.1fus, max %.1fus\n", percentileUsecs(50.0), percentileUsecs(90.0), percentileUsecs(99.0), num_latencies ? (((double) latencies[num_latencies - 1]) / 1000.0) : 0.0);
+    #if MOJOZORK_DECODE_CACHE
+    printf("  decode cache: %u hits, %u misses\n", (unsigned int) decode_hits, (unsigned int) decode_misses);
+    printf("  translations: %u per run, %u instructions\n", (unsigned int) translations, (unsigned int) translated_instructions);
+    #else
+    (void) decode_hits;
+    (void) decode_misses;
+    (void) translations;
+    (void) translated_instructions;
+    #endif
+    #if MOJOZORK_SUPERINSTRUCTIONS
+    printf("  superinstructions: %llu run\n", (unsigned long long) superinstructions);
+    #else
+    (void) superinstructions;
+    #endif
+    #if MOJOZORK_STRING_CACHE
+    printf("  string cache: %u hits, %u misses\n", (unsigned int) string_hits, (unsigned int) string_misses);
+    #else
+    (void) string_hits;
+    (void) string_misses;
+    #endif
+
+    free(script);
+    script = script_pos = NULL;
+    free(script_source);
+}
+
+static int cmpStringAddr(const void *a, const void *b)
+{
+    const uint32 x = *((const uint32 *) a);
+    const uint32 y = *((const uint32 *) b);
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+// returns how many characters were decoded.
+static uint64_t decodeAllStrings(const int passes)
+{
+    static char buf[4096];  // longer strings get truncated, but still decoded.
+    uint64_t retval = 0;
+    for (int i = 0; i < passes; i++) {
+        for (size_t j = 0; j < num_string_addrs; j++) {
+            uintptr decoded_chars = sizeof (buf);
+            decode_zscii(GState->story + string_addrs[j], 0, buf, &decoded_chars);
+            retval += decoded_chars;
+        }
+    }
+    return retval;
+}
+
+static void benchStrings(const int iterations)
+{
+    const int passes = iterations * MOJOZORK_BENCH_STRING_PASSES;
+
+    // get rid of duplicates.
+    size_t num_unique = 0;
+    qsort(string_addrs, num_string_addrs, sizeof (uint32), cmpStringAddr);
+    for (size_t i = 0; i < num_string_addrs; i++) {
+        if ((num_unique == 0) || (string_addrs[num_unique - 1] != string_addrs[i])) {
+            string_addrs[num_unique++] = string_addrs[i];
+        }
+    }
+    num_string_addrs = num_unique;
+
+    printf("strings: %u printed by the scripts, %d passes\n", (unsigned int) num_string_addrs, passes);
+
+    for (int recursive = 0; recursive <= 1; recursive++) {
+        char *abbreviations = GState->abbreviations;
+        if (recursive) {
+            GState->abbreviations = NULL;  // make decode_zscii() do it the hard way.
+        }
+
+        const uint64_t start_ns = now_ns();
+        const uint64_t chars = decodeAllStrings(passes);
+        const double secs = ((double) (now_ns() - start_ns)) / 1000000000.0;
+
+        GState->abbreviations = abbreviations;
+
+        printf("  %-18s %.6f s, %.2f MB/s, %.0f strings/s\n", recursive ? "recursive:" : "abbreviation pool:",
+               secs, (secs > 0.0) ? ((((double) chars) / secs) / (1024.0 * 1024.0)) : 0.0,
+               (secs > 0.0) ? ((((double) num_string_addrs) * ((double) passes)) / secs) : 0.0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static ZMachineState zmachine_state;
+    int iterations = MOJOZORK_BENCH_DEFAULT_ITERATIONS;
+    int argi = 1;
+
+    while (argi < argc) {
+        if (((argi + 1) < argc) && ((strcmp(argv[argi], "--iterations") == 0) || (strcmp(argv[argi], "-n") == 0))) {
+            iterations = atoi(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "--strings") == 0) {
+            bench_strings = 1;
+            argi++;
+        } else {
+            break;
+        }
+    }
+
+    if ((iterations <= 0) || ((argc - argi) < 2)) {
+        fprintf(stderr, "USAGE: %s [--iterations N] [--strings] <story_file> <script> [script...]\n", argv[0]);
+        return 1;
+    }
+
+    GState = &zmachine_state;
+    GState->die = die_bench;
+    GState->writestr = writestr_bench;
+
+    story_fname = argv[argi++];
+    original_story = (uint8 *) loadFile(story_fname, &original_story_len);
+
+    for (; argi < argc; argi++) {
+        benchScript(argv[argi], iterations);
+    }
+
+    if (bench_strings) {
+        benchStrings(iterations);
+    }
+
+    #if MOJOZORK_PROFILING
+    profileReport(stdout);
+    #endif
+
+    unloadStory(GState);
+    free(original_story);
+    free(latencies);
+    free(string_addrs);
+
+    return 0;
+}
+
+// end of mojozork-bench.c ...
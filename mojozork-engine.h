@@ -0,0 +1,573 @@
+/**
+ * MojoZork; a simple, just-for-fun implementation of Infocom's Z-Machine.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+// This is the threaded engine, which replaces runInstruction() when
+//  MOJOZORK_THREADED_ENGINE is enabled. mojozork.c includes it.
+
+#if !MOJOZORK_THREADED_ENGINE
+#error Do not compile this directly, mojozork.c includes it.
+#endif
+
+static void runInstructions(void)
+{
+    #if MOJOZORK_ENGINE_COMPUTED_GOTO
+    static const void *engine_labels[ENGINEOP_MAX] = {
+        #define ENGINE_LABEL(name) [ENGINEOP_##name] = &&engineop_##name
+        ENGINE_LABEL(GENERIC), ENGINE_LABEL(JE), ENGINE_LABEL(JL), ENGINE_LABEL(JG),
+        ENGINE_LABEL(JZ), ENGINE_LABEL(TEST), ENGINE_LABEL(OR), ENGINE_LABEL(AND),
+        ENGINE_LABEL(NOT), ENGINE_LABEL(ADD), ENGINE_LABEL(SUB), ENGINE_LABEL(MUL),
+        ENGINE_LABEL(DIV), ENGINE_LABEL(MOD), ENGINE_LABEL(INC), ENGINE_LABEL(DEC),
+        ENGINE_LABEL(INC_CHK), ENGINE_LABEL(DEC_CHK), ENGINE_LABEL(STORE), ENGINE_LABEL(LOAD),
+        ENGINE_LABEL(LOADW), ENGINE_LABEL(LOADB), ENGINE_LABEL(STOREW), ENGINE_LABEL(STOREB),
+        ENGINE_LABEL(PUSH), ENGINE_LABEL(PULL), ENGINE_LABEL(POP), ENGINE_LABEL(JUMP),
+        ENGINE_LABEL(CALL), ENGINE_LABEL(RET), ENGINE_LABEL(RTRUE), ENGINE_LABEL(RFALSE),
+        ENGINE_LABEL(RET_POPPED), ENGINE_LABEL(NOP), ENGINE_LABEL(TEST_ATTR), ENGINE_LABEL(FUSED_JZ),
+        ENGINE_LABEL(LOADW_JZ), ENGINE_LABEL(LOADW_JE), ENGINE_LABEL(STORE_STORE)
+        #undef ENGINE_LABEL
+    };
+    #define ENGINE_DISPATCH() goto *engine_labels[insn->engine_op];
+    #define ENGINE_CASE(name) engineop_##name:
+    #else
+    #define ENGINE_DISPATCH() switch (insn->engine_op)
+    #define ENGINE_CASE(name) case ENGINEOP_##name:
+    #endif
+
+    // these live in locals (and hopefully registers) until we have to sync up with GState.
+    uint8 *story = GState->story;
+    const uint8 *pc = GState->pc;
+    uint16 *sp = GState->sp;
+    uint16 bp = GState->bp;
+    uint16 *locals = GState->stack + bp;  // the current routine's local variables.
+    uint32 instructions_run = GState->instructions_run;
+    uint16 *operands = GState->operands;
+    ZDecodedInstruction decoded;
+    const ZDecodedInstruction *insn;
+    const ZDecodedInstruction *next_insn = NULL;  // our best guess at what runs next, so we can skip looking it up.
+    const uint8 *start;
+    uint16 retval;
+
+    #if MOJOZORK_DECODE_CACHE
+    // opcode handlers might flush or replace the decode cache, so notice if our guesses went stale.
+    const ZDecodeCache *handler_cache = NULL;
+    uint32 handler_flushes = 0;
+    #define ENGINE_CHECKPOINT_DECODE_CACHE() { handler_cache = GState->decode_cache; handler_flushes = handler_cache ? handler_cache->flushes : 0; }
+    #define ENGINE_CHECK_DECODE_CACHE() { if ((GState->decode_cache != handler_cache) || (handler_cache && (handler_cache->flushes != handler_flushes))) { next_insn = NULL; } }
+    #else
+    #define ENGINE_CHECKPOINT_DECODE_CACHE()
+    #define ENGINE_CHECK_DECODE_CACHE()
+    #endif
+
+    #define ENGINE_SAVE() { GState->pc = pc; GState->sp = sp; GState->bp = bp; GState->instructions_run = instructions_run; }
+    #define ENGINE_LOAD() { story = GState->story; pc = GState->pc; sp = GState->sp; bp = GState->bp; locals = GState->stack + bp; instructions_run = GState->instructions_run; }
+    #define ENGINE_DIE(...) { ENGINE_SAVE(); GState->die(__VA_ARGS__); }
+    #define ENGINE_LOAD_VAR(var, indirect) loadVariableInFrame(variableClass(var), (var), (indirect), &sp, locals, bp)
+    #define ENGINE_STORE_VAR(var, val, indirect) storeVariableInFrame(variableClass(var), (var), (uint16) (val), (indirect), &sp, &locals, bp)
+    #define ENGINE_NEXT() { instructions_run++; goto next_instruction; }
+    #define ENGINE_STORE(val) storeVariableInFrame((ZVarClass) insn->store_class, insn->store, (uint16) (val), 0, &sp, &locals, bp)
+    #define ENGINE_RETURN(val) { retval = (uint16) (val); goto engine_return; }
+    #define ENGINE_BRANCH_FROM(truth, end, on_truth, branch_offset, branch_next) { \
+        pc = (end); \
+        if ((truth) == (on_truth)) {  /* take the branch? */ \
+            const sint16 offset = (branch_offset); \
+            if ((offset == 0) || (offset == 1)) {  /* return false/true from current routine. */ \
+                ENGINE_RETURN(offset); \
+            } \
+            pc = (pc + offset) - 2; \
+            next_insn = (branch_next); \
+        } \
+    }
+    #define ENGINE_BRANCH(truth) ENGINE_BRANCH_FROM(truth, start + insn->len, insn->branch_on_truth, insn->branch_offset, insn->branch_next)
+    #define ENGINE_FUSED_BRANCH(truth) ENGINE_BRANCH_FROM(truth, start + insn->fused_len, insn->fused_branch_on_truth, insn->fused_branch_offset, insn->branch_next)
+    #define ENGINE_CALL_HANDLER(op) { \
+        ENGINE_CHECKPOINT_DECODE_CACHE(); \
+        ENGINE_SAVE(); \
+        (op)->fn(); \
+        GState->instructions_run++; \
+        if (GState->step_completed) { \
+            PROFILE_STOP(); \
+            return;  /* everything is already written back to GState. */ \
+        } \
+        ENGINE_LOAD();  /* the handler might have changed any of this. */ \
+        ENGINE_CHECK_DECODE_CACHE(); \
+    }
+    #define ENGINE_FUSED_NEXT_INSTRUCTION() { instructions_run++; GState->logical_pc = (uint32) (pc - story); }
+
+next_instruction:
+    start = pc;
+    GState->logical_pc = (uint32) (start - story);
+
+    #if MOJOZORK_DECODE_CACHE
+    if (next_insn && (next_insn->logical_pc == GState->logical_pc)) {
+        insn = next_insn;  // we guessed right, no lookup needed.
+    } else if (GState->logical_pc >= GState->header.staticmem_addr) {  // dynamic memory can change, don't cache it.
+        insn = getDecodedInstruction(GState->logical_pc);
+    } else
+    #endif
+    {
+        decodeInstruction(GState->logical_pc, &decoded);
+        insn = &decoded;
+    }
+
+    next_insn = insn->next;  // unless we branch, jump, call or return, this is what runs next.
+
+    // look up variables in order, since reading from the stack pops it.
+    {
+        const uint8 operand_count = insn->operand_count;
+        uint16 operand_classes = insn->operand_classes;
+        for (uint8 i = 0; i < operand_count; i++, operand_classes >>= 2) {
+            const ZVarClass varclass = (ZVarClass) (operand_classes & 0x3);
+            if (varclass == VARCLASS_CONSTANT) {
+                operands[i] = insn->operands[i];
+            } else {
+                operands[i] = loadVariableInFrame(varclass, (uint8) insn->operands[i], 0, &sp, locals, bp);
+            }
+        }
+    }
+
+    pc = start + insn->operands_len;
+
+    #if MOJOZORK_DEBUGGING
+    dbg("pc=%X %sopcode=%u ('%s') [", (unsigned int) GState->logical_pc, insn->extended ? "ext " : "", insn->opcode, instructionOpcode(insn)->name);
+    if (insn->operand_count)
+    {
+        uint8 i;
+        for (i = 0; i < insn->operand_count-1; i++)
+            dbg("%X,", (unsigned int) operands[i]);
+        dbg("%X", (unsigned int) operands[i]);
+    }
+    dbg("]\n");
+    #endif
+
+    PROFILE_INSTRUCTION(insn->opcode, insn->extended, instructionOpcode(insn)->name);
+
+    ENGINE_DISPATCH()
+    {
+        ENGINE_CASE(GENERIC) {
+            const Opcode *op = instructionOpcode(insn);
+            GState->operand_count = insn->operand_count;
+            ENGINE_SAVE();
+            if (!op->name) {
+                GState->die("Unsupported or unknown %sopcode #%u", insn->extended ? "extended " : "", (unsigned int) insn->opcode);
+            } else if (!op->fn) {
+                GState->die("Unimplemented %sopcode #%d ('%s')", insn->extended ? "extended " : "", (unsigned int) insn->opcode, op->name);
+            }
+
+            // don't touch `insn` after this, as the opcode might restart or reload the story.
+            ENGINE_CALL_HANDLER(op);
+            goto next_instruction;
+        }
+
+        ENGINE_CASE(JE) {
+            const uint16 a = operands[0];
+            int truth = 0;
+            for (uint8 i = 1; i < insn->operand_count; i++) {
+                if (a == operands[i]) {
+                    truth = 1;
+                    break;
+                }
+            }
+            ENGINE_BRANCH(truth);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(JL) {
+            ENGINE_BRANCH((((sint16) operands[0]) < ((sint16) operands[1])) ? 1 : 0);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(JG) {
+            ENGINE_BRANCH((((sint16) operands[0]) > ((sint16) operands[1])) ? 1 : 0);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(JZ) {
+            ENGINE_BRANCH((operands[0] == 0) ? 1 : 0);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(TEST) {
+            ENGINE_BRANCH(((operands[0] & operands[1]) == operands[1]) ? 1 : 0);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(OR) {
+            pc++;  // skip store byte.
+            ENGINE_STORE(operands[0] | operands[1]);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(AND) {
+            pc++;  // skip store byte.
+            ENGINE_STORE(operands[0] & operands[1]);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(NOT) {
+            pc++;  // skip store byte.
+            ENGINE_STORE(~operands[0]);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(ADD) {
+            pc++;  // skip store byte.
+            ENGINE_STORE(((sint16) operands[0]) + ((sint16) operands[1]));
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(SUB) {
+            pc++;  // skip store byte.
+            ENGINE_STORE(((sint16) operands[0]) - ((sint16) operands[1]));
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(MUL) {
+            pc++;  // skip store byte.
+            ENGINE_STORE(((sint16) operands[0]) * ((sint16) operands[1]));
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(DIV) {
+            pc++;  // skip store byte.
+            if (operands[1] == 0) {
+                ENGINE_DIE("Division by zero");
+            }
+            const uint16 result = (uint16) (((sint16) operands[0]) / ((sint16) operands[1]));
+            ENGINE_STORE(result);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(MOD) {
+            pc++;  // skip store byte.
+            if (operands[1] == 0) {
+                ENGINE_DIE("Division by zero");
+            }
+            const uint16 result = (uint16) (((sint16) operands[0]) % ((sint16) operands[1]));
+            ENGINE_STORE(result);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(INC) {
+            const uint16 val = (uint16) (((sint16) ENGINE_LOAD_VAR((uint8) operands[0], 1)) + 1);
+            ENGINE_STORE_VAR((uint8) operands[0], val, 1);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(DEC) {
+            const uint16 val = (uint16) (((sint16) ENGINE_LOAD_VAR((uint8) operands[0], 1)) - 1);
+            ENGINE_STORE_VAR((uint8) operands[0], val, 1);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(INC_CHK) {
+            const sint16 val = (sint16) (((sint16) ENGINE_LOAD_VAR((uint8) operands[0], 1)) + 1);
+            ENGINE_STORE_VAR((uint8) operands[0], val, 1);
+            ENGINE_BRANCH((val > ((sint16) operands[1])) ? 1 : 0);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(DEC_CHK) {
+            const sint16 val = (sint16) (((sint16) ENGINE_LOAD_VAR((uint8) operands[0], 1)) - 1);
+            ENGINE_STORE_VAR((uint8) operands[0], val, 1);
+            ENGINE_BRANCH((val < ((sint16) operands[1])) ? 1 : 0);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(STORE) {
+            ENGINE_STORE_VAR((uint8) (operands[0] & 0xFF), operands[1], 1);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(LOAD) {
+            const uint16 val = ENGINE_LOAD_VAR((uint8) (operands[0] & 0xFF), 1);
+            pc++;  // skip store byte.
+            ENGINE_STORE(val);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(LOADW) {
+            pc++;  // skip store byte.
+            const uint16 offset = (operands[0] + (operands[1] * 2));
+            dynamicMemoryRead(offset, 2);
+            const uint8 *src = get_virtualized_mem_ptr(offset);
+            const uint16 value = READUI16(src);
+            ENGINE_STORE(value);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(LOADB) {
+            pc++;  // skip store byte.
+            const uint16 offset = (operands[0] + operands[1]);
+            dynamicMemoryRead(offset, 1);
+            const uint16 value = *get_virtualized_mem_ptr(offset);  // expand out to 16-bit before storing.
+            ENGINE_STORE(value);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(STOREW) {
+            const uint16 offset = (operands[0] + (operands[1] * 2));
+            uint8 *dst = get_virtualized_mem_ptr(offset);
+            const uint16 src = operands[2];
+            WRITEUI16(dst, src);
+            dynamicMemoryWritten(offset, 2);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(STOREB) {
+            const uint16 offset = (operands[0] + operands[1]);
+            *get_virtualized_mem_ptr(offset) = (uint8) operands[2];
+            dynamicMemoryWritten(offset, 1);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(PUSH) {
+            ENGINE_STORE_VAR(0, operands[0], 0);   // top of stack.
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(PULL) {
+            const uint16 val = ENGINE_LOAD_VAR(0, 0);   // top of stack.
+            ENGINE_STORE_VAR((uint8) operands[0], val, 1);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(POP) {
+            ENGINE_LOAD_VAR(0, 0);   // this causes a pop.
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(JUMP) {
+            // this opcode is not a branch instruction, and doesn't follow those rules.
+            pc = (pc + ((sint16) operands[0])) - 2;
+            next_insn = insn->branch_next;
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(CALL) {
+            uint8 args = insn->operand_count;
+            const uint8 storeid = insn->store;
+            pc++;  // skip store byte.
+            if ((args == 0) || (operands[0] == 0)) {  // legal no-op; store 0 to return value and bounce.
+                ENGINE_STORE(0);
+            } else {
+                const uint8 *routine = unpackAddress(operands[0]);
+                GState->logical_pc = (uint32) (routine - story);
+                const uint8 numlocals = *(routine++);
+                if (numlocals > 15) {
+                    ENGINE_DIE("Routine has too many local variables (%u)", numlocals);
+                }
+
+                if (((uint32) ((sp - GState->stack) + 5 + 15)) > GState->stack_size) {
+                    ENGINE_SAVE();  // in case we die.
+                    sp = growStack(sp, 5 + 15);  // room for the frame and locals (all 15, see localInFrame()).
+                }
+
+                *(sp++) = (uint16) storeid;  // save where we should store the call's result.
+
+                // next instruction to run upon return.
+                const uint32 pcoffset = (uint32) (pc - story);
+                *(sp++) = (pcoffset & 0xFFFF);
+                *(sp++) = ((pcoffset >> 16) & 0xFFFF);
+
+                *(sp++) = bp;  // current base pointer before the call.
+                *(sp++) = numlocals;  // number of locals we're allocating.
+
+                bp = (uint16) (sp - GState->stack);
+                locals = sp;
+                PROFILE_CALL(operands[0], bp);
+                next_insn = NULL;  // look up the routine, which translates it if this is the first call.
+
+                sint8 i;
+                if (GState->header.version <= 4) {
+                    for (i = 0; i < numlocals; i++, routine += sizeof (uint16)) {
+                        *(sp++) = *((uint16 *) routine);  // leave it byteswapped when moving to the stack.
+                    }
+                } else {
+                    for (i = 0; i < numlocals; i++) {
+                        *(sp++) = 0;
+                    }
+                }
+
+                args--;  // remove the return address from the count.
+                if (args > numlocals) {  // it's legal to have more args than locals, throw away the extras.
+                    args = numlocals;
+                }
+
+                const uint16 *src = operands + 1;
+                uint8 *dst = (uint8 *) (GState->stack + bp);
+                for (i = 0; i < args; i++) {
+                    WRITEUI16(dst, src[i]);
+                }
+
+                pc = routine;
+            }
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(RET) {
+            ENGINE_RETURN(operands[0]);
+        }
+
+        ENGINE_CASE(RTRUE) {
+            ENGINE_RETURN(1);
+        }
+
+        ENGINE_CASE(RFALSE) {
+            ENGINE_RETURN(0);
+        }
+
+        ENGINE_CASE(RET_POPPED) {
+            const uint16 result = ENGINE_LOAD_VAR(0, 0);   // top of stack.
+            ENGINE_RETURN(result);
+        }
+
+        ENGINE_CASE(NOP) {
+            ENGINE_NEXT();
+        }
+
+        // superinstructions. These are only picked if MOJOZORK_SUPERINSTRUCTIONS is enabled.
+        ENGINE_CASE(TEST_ATTR) {  // test_attr with its branch already decoded.
+            ENGINE_BRANCH(testObjectAttribute(operands[0], operands[1]));
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(FUSED_JZ) {  // an opcode handler that stores a value, followed by jz on that value.
+            GState->superinstructions_run++;
+            const Opcode *op = instructionOpcode(insn);
+            const uint8 storeid = insn->store;
+            const uint8 *jz_start = start + insn->len;
+            const uint8 *jz_end = start + insn->fused_len;
+            const uint8 branch_on_truth = insn->fused_branch_on_truth;
+            const sint16 branch_offset = insn->fused_branch_offset;
+            const ZDecodedInstruction *branch_next = insn->branch_next;
+
+            GState->operand_count = insn->operand_count;
+            ENGINE_CALL_HANDLER(op);
+            if (next_insn == NULL) {
+                branch_next = NULL;  // the handler dumped the decode cache.
+            }
+            if (pc != jz_start) {
+                goto next_instruction;  // handler didn't fall through to the jz? Run normally.
+            }
+
+            GState->logical_pc = (uint32) (pc - story);
+            const uint16 val = ENGINE_LOAD_VAR(storeid, 0);
+            ENGINE_BRANCH_FROM((val == 0) ? 1 : 0, jz_end, branch_on_truth, branch_offset, branch_next);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(LOADW_JZ) {
+            GState->superinstructions_run++;
+            pc++;  // skip store byte.
+            const uint16 offset = (operands[0] + (operands[1] * 2));
+            dynamicMemoryRead(offset, 2);
+            const uint8 *src = get_virtualized_mem_ptr(offset);
+            const uint16 value = READUI16(src);
+            ENGINE_STORE(value);
+
+            ENGINE_FUSED_NEXT_INSTRUCTION();
+            const uint16 val = ENGINE_LOAD_VAR(insn->store, 0);
+            ENGINE_FUSED_BRANCH((val == 0) ? 1 : 0);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(LOADW_JE) {
+            GState->superinstructions_run++;
+            pc++;  // skip store byte.
+            const uint16 offset = (operands[0] + (operands[1] * 2));
+            dynamicMemoryRead(offset, 2);
+            const uint8 *src = get_virtualized_mem_ptr(offset);
+            const uint16 value = READUI16(src);
+            ENGINE_STORE(value);
+
+            ENGINE_FUSED_NEXT_INSTRUCTION();
+            const uint16 a = ENGINE_LOAD_VAR(insn->store, 0);
+            int truth = 0;
+            for (uint8 i = 0; i < insn->fused_operand_count; i++) {
+                if (a == insn->fused_operands[i]) {
+                    truth = 1;
+                    break;
+                }
+            }
+            ENGINE_FUSED_BRANCH(truth);
+            ENGINE_NEXT();
+        }
+
+        ENGINE_CASE(STORE_STORE) {
+            GState->superinstructions_run++;
+            ENGINE_STORE_VAR((uint8) (operands[0] & 0xFF), operands[1], 1);
+
+            for (uint8 i = 0; i < insn->fused_count; i++) {
+                const uint8 variables = (insn->fused_variable_operands >> (i * 2)) & 0x3;
+                uint16 varid = insn->fused_operands[i * 2];
+                uint16 src = insn->fused_operands[(i * 2) + 1];
+                pc = start + insn->fused_offsets[i];
+                ENGINE_FUSED_NEXT_INSTRUCTION();
+                if (variables & 1) {  // look up variables in order, since reading from the stack pops it.
+                    varid = ENGINE_LOAD_VAR((uint8) varid, 0);
+                }
+                if (variables & 2) {
+                    src = ENGINE_LOAD_VAR((uint8) src, 0);
+                }
+                ENGINE_STORE_VAR((uint8) (varid & 0xFF), src, 1);
+            }
+            pc = start + insn->fused_len;
+            ENGINE_NEXT();
+        }
+
+        #if !MOJOZORK_ENGINE_COMPUTED_GOTO
+        default: break;
+        #endif
+    }
+
+    // shouldn't get here, but just in case...
+    ENGINE_DIE("Threaded engine got confused at opcode #%u", (unsigned int) insn->opcode);
+    return;
+
+engine_return:  // this is doReturn(), with everything in locals.
+    {
+        FIXME("newer versions start in a real routine, but still aren't allowed to return from it.");
+        if (bp == 0) {
+            ENGINE_DIE("Stack underflow in return operation");
+        }
+
+        PROFILE_RETURN(bp);
+
+        sp = GState->stack + bp;  // this dumps all the locals and data pushed on the stack during the routine.
+        sp--;  // dump our copy of numlocals
+        bp = *(--sp);  // restore previous frame's base pointer, dump it from the stack.
+        locals = GState->stack + bp;
+
+        sp -= 2;  // point to start of our saved program counter.
+        const uint32 pcoffset = ((uint32) sp[0]) | (((uint32) sp[1]) << 16);
+
+        pc = story + pcoffset;  // next instruction is one following our original call.
+
+        const uint8 storeid = (uint8) *(--sp);  // pop the result storage location.
+        ENGINE_STORE_VAR(storeid, retval, 0);  // and store the routine result.
+        next_insn = NULL;
+        ENGINE_NEXT();
+    }
+
+    #undef ENGINE_DISPATCH
+    #undef ENGINE_CASE
+    #undef ENGINE_SAVE
+    #undef ENGINE_LOAD
+    #undef ENGINE_DIE
+    #undef ENGINE_LOAD_VAR
+    #undef ENGINE_STORE_VAR
+    #undef ENGINE_NEXT
+    #undef ENGINE_STORE
+    #undef ENGINE_RETURN
+    #undef ENGINE_BRANCH
+    #undef ENGINE_BRANCH_FROM
+    #undef ENGINE_FUSED_BRANCH
+    #undef ENGINE_FUSED_NEXT_INSTRUCTION
+    #undef ENGINE_CALL_HANDLER
+    #undef ENGINE_CHECKPOINT_DECODE_CACHE
+    #undef ENGINE_CHECK_DECODE_CACHE
+}
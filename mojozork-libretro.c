@@ -434,9 +434,7 @@ static void step_zmachine(void)
     if (setjmp(jmpbuf) == 0) {  // if non-zero, ZMachine called GState->die() during runInstruction.
         const int initial_quit_state = GState->quit;
         GState->step_completed = initial_quit_state;
-        while (!GState->step_completed) {
-            runInstruction();
-        }
+        runZMachine();
 
         if (GState->quit && (initial_quit_state == 0)) {
             writestr("\n\n*** GAME HAS ENDED ***\n");
@@ -1509,11 +1507,12 @@ static void opcode_save_mojozork_libretro(void)
     free(fullpath);
     int okay = 1;
     okay &= io != NULL;
-    okay &= fwrite("MOJOZORK0\n", 10, 1, io) == 1;
+    okay &= fwrite("MOJOZORK1\n", 10, 1, io) == 1;
+    dynamicMemoryRead(0, GState->header.staticmem_addr);
     okay &= fwrite(GState->story, GState->header.staticmem_addr, 1, io) == 1;
     okay &= fwrite(&addr, sizeof (addr), 1, io) == 1;
     okay &= fwrite(&sp, sizeof (sp), 1, io) == 1;
-    okay &= fwrite(GState->stack, sizeof (GState->stack), 1, io) == 1;
+    okay &= (sp == 0) || (fwrite(GState->stack, sp * sizeof (uint16), 1, io) == 1);
     okay &= fwrite(&GState->bp, sizeof (GState->bp), 1, io) == 1;
     if (io) {
         fclose(io);
@@ -1551,16 +1550,23 @@ static void opcode_restore_mojozork_libretro(void)
     char header[10];
     okay &= io != NULL;
     okay &= fread(header, 10, 1, io) == 1;
-    if (okay && (memcmp(header, "MOJOZORK0\n", 10) != 0)) {
+    const int fixed_stack = !okay || (memcmp(header, "MOJOZORK1\n", 10) != 0);  // older saves have the whole stack.
+    if (okay && fixed_stack && (memcmp(header, "MOJOZORK0\n", 10) != 0)) {
         rewind(io);  // might be an older MojoZork savegame with no identifier...?
     }
     okay &= fread(GState->story, GState->header.staticmem_addr, 1, io) == 1;
+    dynamicMemoryReplaced(GState);
     okay &= fread(&x, sizeof (x), 1, io) == 1;
     GState->logical_pc = x;
     GState->pc = GState->story + x;
     okay &= fread(&x, sizeof (x), 1, io) == 1;
-    GState->sp = GState->stack + x;
-    okay &= fread(GState->stack, sizeof (GState->stack), 1, io) == 1;
+    const uint32 stack_entries = fixed_stack ? MOJOZORK0_SAVE_STACK_SIZE : x;
+    okay &= (x <= stack_entries) && (stack_entries <= MAX_STACK_SIZE);
+    if (okay) {
+        growStack(GState->stack, stack_entries);
+        GState->sp = GState->stack + x;
+        okay &= (stack_entries == 0) || (fread(GState->stack, stack_entries * sizeof (uint16), 1, io) == 1);
+    }
     okay &= fread(&GState->bp, sizeof (GState->bp), 1, io) == 1;
     if (io) {
         fclose(io);
@@ -1627,6 +1633,7 @@ static void restart_game(void)
 
     random_seed = (int) time(NULL);
 
+    unloadStory(&zmachine_state);
     memset(&zmachine_state, '\0', sizeof (zmachine_state));
     GState = &zmachine_state;
     GState->writestr = writestr_mojozork_libretro;
@@ -1779,8 +1786,7 @@ bool retro_load_game(const struct retro_game_info *info)
 void retro_unload_game(void)
 {
     if (GState) {
-        free(GState->story);
-        free(GState->story_filename);
+        unloadStory(GState);
         GState = NULL;
     }
 
@@ -1891,6 +1897,8 @@ bool retro_serialize(void *data_, size_t size)
 
     assert(size >= retro_serialize_size());
 
+    dynamicMemoryRead(0, GState->header.staticmem_addr);  // in case the globals are shadowed.
+
     // !!! FIXME: byteswap
     #define MOJOZORK_SERIALIZE_UINT16(var) *((uint16 *) data) = (uint16) (var); data += sizeof (uint16);
     #define MOJOZORK_SERIALIZE_UINT32(var) *((uint32 *) data) = (uint32) (var); data += sizeof (uint32);
@@ -1949,6 +1957,7 @@ bool retro_unserialize(const void *data_, size_t size)
     GState->status_bar_len = TERMINAL_WIDTH+1;
     GState->sp = GState->stack + logical_sp;
     next_inputbuf = logical_next_inputbuf ? (GState->story + logical_next_inputbuf) : NULL;
+    dynamicMemoryReplaced(GState);
 
     updateStatusBar();
 
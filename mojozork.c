@@ -18,6 +18,143 @@
 
 #define MOJOZORK_DEBUGGING 0
 
+// Instructions in static and high memory can't change, so we can decode them
+//  once and keep the results around, keyed by address, instead of picking
+//  apart the opcode and operand bytes every time they run. Build with
+//  -DMOJOZORK_DECODE_CACHE=0 to decode every instruction from scratch instead.
+#ifndef MOJOZORK_DECODE_CACHE
+#define MOJOZORK_DECODE_CACHE 1
+#endif
+
+// The threaded engine runs decoded instructions with pc/sp/bp in local
+//  variables, handling the simple, hot opcodes inline and only syncing up
+//  GState when it has to call an opcode handler. It uses GCC/Clang's
+//  computed goto if available, or a switch statement otherwise (or if built
+//  with -DMOJOZORK_NO_COMPUTED_GOTO=1). Build with
+//  -DMOJOZORK_THREADED_ENGINE=0 to run everything through runInstruction().
+#ifndef MOJOZORK_THREADED_ENGINE
+#define MOJOZORK_THREADED_ENGINE 1
+#endif
+
+// Build with -DMOJOZORK_PROFILING=1 to count and time every opcode and
+//  routine call, and get a report from profileReport(). This reads the
+//  clock for every instruction, so it's not free; it's off by default.
+#ifndef MOJOZORK_PROFILING
+#define MOJOZORK_PROFILING 0
+#endif
+
+// Checked builds catch things a correct story never does, like reading a
+//  local variable the routine didn't allocate, or popping past the bottom
+//  of the current routine's part of the stack. These cost a little on
+//  almost every variable access, so they're off if NDEBUG is defined (like
+//  CMake's Release builds do). Build with -DMOJOZORK_CHECKED=0 or 1 to
+//  choose for yourself.
+#ifndef MOJOZORK_CHECKED
+#ifdef NDEBUG
+#define MOJOZORK_CHECKED 0
+#else
+#define MOJOZORK_CHECKED 1
+#endif
+#endif
+
+// Superinstructions: when the decode cache sees some common sequences (like
+//  a loadw whose result is immediately tested by jz), it marks the first
+//  instruction to run the whole sequence in one handler of the threaded
+//  engine. Build with -DMOJOZORK_SUPERINSTRUCTIONS=0 to compare against the
+//  unfused engine. This needs the threaded engine and the decode cache, and
+//  is off in profiling builds so each instruction is counted on its own.
+#ifndef MOJOZORK_SUPERINSTRUCTIONS
+#if MOJOZORK_THREADED_ENGINE && MOJOZORK_DECODE_CACHE && !MOJOZORK_PROFILING
+#define MOJOZORK_SUPERINSTRUCTIONS 1
+#else
+#define MOJOZORK_SUPERINSTRUCTIONS 0
+#endif
+#endif
+
+// Decoding a ZSCII string runs a little state machine over every 5-bit
+//  character, expanding abbreviations as it goes. The string cache keeps
+//  the decoded text of everything we've printed, keyed by address, so
+//  printing the same thing again (room descriptions on every LOOK, etc) is
+//  just a copy. Build with -DMOJOZORK_STRING_CACHE=0 to decode every time.
+#ifndef MOJOZORK_STRING_CACHE
+#define MOJOZORK_STRING_CACHE 1
+#endif
+
+// get_prop, put_prop, get_prop_addr and get_next_prop all have to find a
+//  property in an object's property list, which means walking it from the
+//  start. The property index remembers where each object's properties are
+//  the first time we look, so later lookups are just a table read. Build
+//  with -DMOJOZORK_PROPERTY_INDEX=0 to walk the list every time.
+#ifndef MOJOZORK_PROPERTY_INDEX
+#define MOJOZORK_PROPERTY_INDEX 1
+#endif
+
+// The object tree (each object's parent, sibling and child) and attributes
+//  live in 9-byte records in dynamic memory. We keep a copy of them in plain
+//  arrays, so the tree and attribute opcodes and unparentObject()'s sibling
+//  walks don't have to locate each record. The story bytes are still kept up
+//  to date, since savegames and multizorkd's database only know about those.
+//  Build with -DMOJOZORK_OBJECT_TREE=0 to use the records directly.
+#ifndef MOJOZORK_OBJECT_TREE
+#define MOJOZORK_OBJECT_TREE 1
+#endif
+
+// Globals are bigendian in dynamic memory like everything else, but they're
+//  read and written constantly. While runZMachine() is going, we keep them in
+//  a native-endian array instead, and only sync with memory when something
+//  reads or writes that part of memory directly (loadw, storew, saving, etc).
+//  Build with -DMOJOZORK_NATIVE_GLOBALS=0 to use memory directly.
+#ifndef MOJOZORK_NATIVE_GLOBALS
+#define MOJOZORK_NATIVE_GLOBALS 1
+#endif
+
+// decode_zscii() unpacks a run of Z-words into z-chars at once with SSE2 or
+//  NEON if the compiler targets them, and finds the end of the string with a
+//  vector compare. Build with -DMOJOZORK_SIMD=0 to always use plain C.
+#ifndef MOJOZORK_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)) || defined(__ARM_NEON)
+#define MOJOZORK_SIMD 1
+#else
+#define MOJOZORK_SIMD 0
+#endif
+#endif
+
+#if MOJOZORK_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define MOJOZORK_SIMD_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#define MOJOZORK_SIMD_NEON 1
+#include <arm_neon.h>
+#else
+#error MOJOZORK_SIMD needs SSE2 or NEON.
+#endif
+#endif
+
+// Where mmap() is available, story memory can be a private, copy-on-write
+//  mapping (see mapStory()), so the static and high memory, which the
+//  Z-Machine never writes to, is shared with everything else that maps the
+//  same thing, and only the pages of dynamic memory that actually get written
+//  cost anything. Build with -DMOJOZORK_MMAP=0 to never do this.
+#ifndef MOJOZORK_MMAP
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__EMSCRIPTEN__)
+#define MOJOZORK_MMAP 1
+#else
+#define MOJOZORK_MMAP 0
+#endif
+#endif
+
+#if MOJOZORK_MMAP
+#include <sys/mman.h>
+#endif
+
+// multizorkd runs instances on several threads at once, so it defines this
+//  (to _Thread_local) to give each thread its own GState, random seed and
+//  profiling data. Everything else keeps it empty, and these are just globals.
+#ifndef MOJOZORK_THREAD_LOCAL
+#define MOJOZORK_THREAD_LOCAL
+#endif
+
 static inline void dbg(const char *fmt, ...)
 {
 #if MOJOZORK_DEBUGGING
@@ -59,12 +196,217 @@ typedef size_t uintptr;
 
 typedef void (*OpcodeFn)(void);
 
+// flags for Opcode, so we can figure out an instruction's size without running it.
+#define OPFLAG_STORE (1 << 0)  // instruction has a store byte after the operands.
+#define OPFLAG_BRANCH (1 << 1)  // instruction has branch data after the operands (and store byte).
+#define OPFLAG_TEXT (1 << 2)  // instruction has a ZSCII string after the operands.
+
 typedef struct
 {
     const char *name;
     OpcodeFn fn;
+    uint8 flags;
 } Opcode;
 
+// Opcodes the threaded engine handles inline. Anything else (including
+//  opcodes a target has replaced with its own handler) is ENGINEOP_GENERIC,
+//  which calls the opcode's function like runInstruction() does.
+typedef enum
+{
+    ENGINEOP_GENERIC = 0,
+    ENGINEOP_JE,
+    ENGINEOP_JL,
+    ENGINEOP_JG,
+    ENGINEOP_JZ,
+    ENGINEOP_TEST,
+    ENGINEOP_OR,
+    ENGINEOP_AND,
+    ENGINEOP_NOT,
+    ENGINEOP_ADD,
+    ENGINEOP_SUB,
+    ENGINEOP_MUL,
+    ENGINEOP_DIV,
+    ENGINEOP_MOD,
+    ENGINEOP_INC,
+    ENGINEOP_DEC,
+    ENGINEOP_INC_CHK,
+    ENGINEOP_DEC_CHK,
+    ENGINEOP_STORE,
+    ENGINEOP_LOAD,
+    ENGINEOP_LOADW,
+    ENGINEOP_LOADB,
+    ENGINEOP_STOREW,
+    ENGINEOP_STOREB,
+    ENGINEOP_PUSH,
+    ENGINEOP_PULL,
+    ENGINEOP_POP,
+    ENGINEOP_JUMP,
+    ENGINEOP_CALL,
+    ENGINEOP_RET,
+    ENGINEOP_RTRUE,
+    ENGINEOP_RFALSE,
+    ENGINEOP_RET_POPPED,
+    ENGINEOP_NOP,
+    ENGINEOP_TEST_ATTR,  // everything from here on is only used with MOJOZORK_SUPERINSTRUCTIONS.
+    ENGINEOP_FUSED_JZ,  // a handler that stores a value, then jz on that value.
+    ENGINEOP_LOADW_JZ,
+    ENGINEOP_LOADW_JE,  // je with the loadw result and only constants.
+    ENGINEOP_STORE_STORE,  // two or three store instructions in a row.
+    ENGINEOP_MAX
+} EngineOp;
+
+// What kind of variable an operand or store refers to.
+typedef enum
+{
+    VARCLASS_CONSTANT = 0,  // not a variable at all.
+    VARCLASS_STACK,  // variable 0x0
+    VARCLASS_LOCAL,  // variables 0x1 through 0xF
+    VARCLASS_GLOBAL  // variables 0x10 through 0xFF
+} ZVarClass;
+
+// an instruction, picked apart and ready to run.
+typedef struct ZDecodedInstruction
+{
+    uint32 logical_pc;  // where this instruction lives.
+    const struct ZDecodedInstruction *next;  // the instruction we fall through to, if it was translated along with this one.
+    const struct ZDecodedInstruction *branch_next;  // where a taken branch or jump lands, if it was translated along with this one.
+    uint16 operands[8];  // constant operands are ready to go, variable operands hold the variable id.
+    uint16 operand_classes;  // a ZVarClass for each operand, two bits apiece, so the engine knows how to load it.
+    uint8 variable_operands;  // bit is set for each operand that is a variable.
+    uint8 operand_count;
+    uint8 opcode;
+    uint8 extended;
+    uint8 engine_op;  // an EngineOp, for the threaded engine.
+    uint8 operands_len;  // bytes from the start of the instruction to the end of the operands.
+    uint16 len;  // total instruction size in bytes, including store, branch, and string data.
+    uint8 store;  // variable to store result in, if (op->flags & OPFLAG_STORE).
+    uint8 store_class;  // ZVarClass of `store`.
+    uint8 branch_on_truth;  // if (op->flags & OPFLAG_BRANCH), branch when the condition matches this.
+    sint16 branch_offset;  // 0 and 1 mean "return false/true", otherwise offset from the end of the instruction, plus 2.
+
+    // superinstructions: data for the instructions that were fused onto this one.
+    uint8 fused_count;  // number of instructions fused onto this one, zero if not a superinstruction.
+    uint8 fused_operand_count;
+    uint8 fused_variable_operands;  // bit is set for each fused operand that is a variable.
+    uint8 fused_branch_on_truth;
+    sint16 fused_branch_offset;
+    uint8 fused_offsets[2];  // where each fused instruction starts, relative to this one.
+    uint16 fused_len;  // bytes from the start of this instruction to the end of the last fused one.
+    uint16 fused_operands[4];
+} ZDecodedInstruction;
+
+// A routine (or whatever stretch of code we first entered somewhere in the
+//  middle), decoded all at once, following branches and jumps. Instructions
+//  are sorted by address, and know which other instructions in the same
+//  translation they can go to next, so the threaded engine can usually skip
+//  looking anything up between them.
+typedef struct ZTranslation
+{
+    struct ZTranslation *next_translation;  // every translation in a ZDecodeCache, so we can free them.
+    uint32 num_instructions;
+    ZDecodedInstruction instructions[];
+} ZTranslation;
+
+// All the translated code for a story. Since code in static memory can't
+//  change, several ZMachineStates running the same story (with the same
+//  opcode handlers!) can share one of these; see shareDecodeCache().
+typedef struct ZDecodeCache
+{
+    ZDecodedInstruction **table;  // hashtable of translated instructions, keyed by logical_pc.
+    uint32 size;  // always a power of two.
+    uint32 used;
+    ZTranslation *translations;
+    uint32 num_translations;
+    uint32 num_instructions;
+    uint32 flushes;  // bumped whenever everything is thrown away, so the engine knows its pointers are stale.
+    uint32 refcount;
+} ZDecodeCache;
+
+typedef struct ZDictionaryEntry
+{
+    uint64 key;  // the entry's encoded text, two or three Z-words packed together.
+    uint32 addr;  // where the entry lives in Z-Machine memory.
+} ZDictionaryEntry;
+
+// The story's dictionary, sorted so tokenizing can binary search it. Since
+//  it has to be in static memory to be indexed at all, several ZMachineStates
+//  running the same story can share one of these; see shareDictionaryIndex().
+typedef struct ZDictionaryIndex
+{
+    uint32 refcount;
+    uint32 num_entries;
+    ZDictionaryEntry entries[];
+} ZDictionaryIndex;
+
+typedef struct ZDecodedString
+{
+    uint32 addr;
+    uint32 encoded_len;  // bytes of Z-Machine memory the encoded string uses.
+    uint32 decoded_len;
+    const uint8 *encoded;  // copy of the encoded string if it's in dynamic memory, so we notice if it changes. NULL otherwise.
+    char text[];  // NOT null-terminated!
+} ZDecodedString;
+
+// Decoded strings for a story, keyed by address. This assumes the game
+//  doesn't change the abbreviations table (which is usually in dynamic
+//  memory, but nothing ever writes to it), since initStory() decodes all the
+//  abbreviations up front anyhow. Several ZMachineStates running the same
+//  story can share one of these; see shareStringCache().
+typedef struct ZStringCache
+{
+    ZDecodedString **table;  // hashtable of decoded strings, keyed by address.
+    uint32 size;  // always a power of two.
+    uint32 used;
+    uint32 refcount;
+} ZStringCache;
+
+// Where an object's (version 3) properties are. Property 0 is the end of the
+//  list, since that's what a walk looking for it would find.
+typedef struct ZObjectProperties
+{
+    uint16 table_addr;  // the object's property table address when we indexed it, 0 if we haven't yet.
+    uint8 first_propid;  // the first property in the list, which get_next_prop wants.
+    uint8 sizes[32];
+    uint16 offsets[32];  // where each property's data starts, 0 if the object doesn't have it.
+} ZObjectProperties;
+
+// Property tables are in dynamic memory, so unlike the other caches, each
+//  ZMachineState gets its own. Objects are indexed the first time we look
+//  them up. If an object's property table address changes, we notice on the
+//  next lookup, and if the game writes to a byte that decides a table's
+//  layout (the name length or a size byte), we throw out the whole index
+//  and let it fill in again; see propertyTablesWritten().
+typedef struct ZPropertyIndex
+{
+    uint8 layout[0x10000 / 8];  // one bit for every byte of Z-Machine address space, set if it's a layout byte we indexed.
+    ZObjectProperties objects[255];  // version 3 object ids are 1 through 255.
+} ZPropertyIndex;
+
+typedef enum
+{
+    OBJREL_PARENT = 0,
+    OBJREL_SIBLING,
+    OBJREL_CHILD,
+    OBJREL_TOTAL
+} ZObjectRelationship;
+
+// A copy of the object tree and attributes, indexed by object id, for every
+//  object with a record in the story's object table. Version 3 records are
+//  9 bytes with 8-bit ids and 32 attributes, version 4+ records are 14 bytes
+//  with 16-bit ids and 48 attributes; this doesn't care which. Like the
+//  property index, each ZMachineState gets its own, and writes to the records
+//  that don't go through setObjectRelative() update it in
+//  dynamicMemoryWritten().
+typedef struct ZObjectTree
+{
+    uint32 num_objects;
+    uint32 records_addr;  // where object #1's record is in Z-Machine memory.
+    uint32 record_size;
+    uint32 num_attributes;
+    uint16 *relatives[OBJREL_TOTAL];  // relatives[OBJREL_PARENT][objid] is objid's parent, etc. These point past the end of `attributes`.
+    uint64 attributes[];  // the attribute flags, attribute 0 in the top bit, attribute 1 in the next, etc.
+} ZObjectTree;
+
 typedef struct ZHeader
 {
     uint8 version;
@@ -90,6 +432,7 @@ typedef struct ZMachineState
     uint32 instructions_run;
     uint8 *story;
     uintptr story_len;
+    int story_mapped;  // non-zero if `story` came from mapStory() and needs to be munmap()'d instead of free()'d.
     ZHeader header;
     uint32 logical_pc;
     const uint8 *pc;  // program counter
@@ -98,10 +441,19 @@ typedef struct ZMachineState
     uint16 calculated_checksum;
     int quit;
     int step_completed;  // possibly time to break out of the Z-Machine simulation loop.
-    uint16 stack[2048];  // !!! FIXME: make this dynamic?
+    uint16 *stack;  // grows as needed, see growStack().
+    uint8 *globals;  // story + header.globals_addr
+    #if MOJOZORK_NATIVE_GLOBALS
+    uint16 globals_shadow[240];  // native-endian copy of the globals, see shadowGlobals().
+    int globals_shadowed;  // non-zero if globals_shadow is more current than memory.
+    #endif
+    uint32 stack_size;  // in uint16s, not bytes.
     uint16 operands[8];
     uint8 operand_count;
     char alphabet_table[78];
+    char *abbreviations;  // every abbreviation, decoded back to back by initAbbreviations(). NULL if we have to decode them as we go.
+    uint32 abbreviation_offsets[96];  // where each abbreviation starts in `abbreviations`.
+    uint16 abbreviation_lengths[96];
     const char *startup_script;
     char *story_filename;
     int status_bar_enabled;
@@ -119,6 +471,20 @@ typedef struct ZMachineState
     // The extended ones, however, only have one form, so we pack that tight.
     Opcode extended_opcodes[30];
 
+    ZDecodeCache *decode_cache;  // created on demand, might be shared with other states.
+    uint32 decode_cache_hits;
+    uint32 decode_cache_misses;
+    uint32 superinstructions_run;  // how many fused instruction sequences ran.
+
+    ZDictionaryIndex *dictionary_index;  // built by initStory(), might be shared with other states. NULL if we have to search the dictionary directly.
+
+    ZStringCache *string_cache;  // created on demand, might be shared with other states.
+    uint32 string_cache_hits;
+    uint32 string_cache_misses;
+
+    ZPropertyIndex *property_index;  // created on demand, NOT shared with other states, since it mirrors dynamic memory.
+    ZObjectTree *object_tree;  // created on demand, NOT shared with other states, since it mirrors dynamic memory.
+
     void (*split_window)(const uint16 oldval, const uint16 newval);
     void (*set_window)(const uint16 oldval, const uint16 newval);
 
@@ -130,7 +496,7 @@ typedef struct ZMachineState
     #endif
 } ZMachineState;
 
-static ZMachineState *GState = NULL;
+static MOJOZORK_THREAD_LOCAL ZMachineState *GState = NULL;
 
 
 static uint8 *get_virtualized_mem_ptr(const uint16 offset);
@@ -158,44 +524,466 @@ static uint8 *unpackAddress(const uint32 addr)
     return NULL;
 }
 
-static uint8 *varAddress(const uint8 var, const int writing, const int indirect)
+// the stack starts out this big (in uint16s), and doubles when it fills up.
+#define INITIAL_STACK_SIZE 256
+
+// frames store the base pointer as a uint16, so this is as big as the stack can get.
+#define MAX_STACK_SIZE 0xFFFF
+
+// Make sure there's room to push `count` more values at `sp`. If the stack
+//  has to move, this returns where `sp` is in the new one.
+static uint16 *growStack(uint16 *sp, const uint32 count)
 {
-    if (var == 0) { // top of stack
-        // "6.3.4: In the seven opcodes that take indirect variable references (inc, dec, inc_chk, dec_chk, load, store, pull), an indirect reference to the stack pointer does not push or pull the top item of the stack - it is read or written in place."
-        if (indirect) {
-            if (GState->sp == GState->stack) {
-                GState->die("Stack underflow");
-            }
-            return (uint8 *) (GState->sp - 1);
-        } else if (writing) {
-            if ((GState->sp-GState->stack) >= (sizeof (GState->stack) / sizeof (GState->stack[0]))) {
-                GState->die("Stack overflow");
-            }
-            dbg("push stack\n");
-            return (uint8 *) GState->sp++;
-        } else {
-            if (GState->sp == GState->stack) {
-                GState->die("Stack underflow");  // nothing on the stack at all?
-            }
-            const uint16 numlocals = GState->bp ? GState->stack[GState->bp-1] : 0;
-            if ((GState->bp + numlocals) >= (GState->sp-GState->stack))
-                GState->die("Stack underflow");  // no stack data left in this frame.
+    const uint32 used = sp ? ((uint32) (sp - GState->stack)) : 0;
+    const uint32 needed = used + count;
+    if (needed <= GState->stack_size) {
+        return sp;
+    } else if (needed > MAX_STACK_SIZE) {
+        GState->die("Stack overflow");
+    }
+
+    uint32 newsize = GState->stack_size ? GState->stack_size : INITIAL_STACK_SIZE;
+    while (newsize < needed) {
+        newsize *= 2;
+    }
+    if (newsize > MAX_STACK_SIZE) {
+        newsize = MAX_STACK_SIZE;
+    }
+
+    uint16 *ptr = (uint16 *) realloc(GState->stack, newsize * sizeof (uint16));
+    if (!ptr) {
+        GState->die("Out of memory");
+    }
+    memset(ptr + GState->stack_size, '\0', (newsize - GState->stack_size) * sizeof (uint16));
+    GState->stack = ptr;
+    GState->stack_size = newsize;
+    return ptr + used;
+}
+
+// Exchange the current stack with another one, without copying it. The
+//  stack pointer goes in and out as an index, since the stack can move
+//  when it grows. Calling this twice puts everything back where it was.
+//  multizorkd uses this to give each player their own stack.
+static inline void swapStack(uint16 **_stack, uint32 *_stack_size, uint32 *_logical_sp)
+{
+    uint16 *stack = *_stack;
+    const uint32 stack_size = *_stack_size;
+    const uint32 logical_sp = *_logical_sp;
+    *_stack = GState->stack;
+    *_stack_size = GState->stack_size;
+    *_logical_sp = GState->stack ? ((uint32) (GState->sp - GState->stack)) : 0;
+    GState->stack = stack;
+    GState->stack_size = stack_size;
+    GState->sp = stack ? (stack + logical_sp) : NULL;
+}
+
+// multizorkd provides its own version of this, since some globals are different for each player.
+static uint8 *getGlobalPtr(const uint8 globalid);
+#ifndef MULTIZORK
+static inline uint8 *getGlobalPtr(const uint8 globalid)
+{
+    return GState->globals + (globalid * sizeof (uint16));
+}
+#endif
+
+static inline ZVarClass variableClass(const uint8 var)
+{
+    return (var == 0) ? VARCLASS_STACK : ((var <= 0xF) ? VARCLASS_LOCAL : VARCLASS_GLOBAL);
+}
+
+// Variable access, split up by what kind of variable it is, so the threaded
+//  engine can pick one when it decodes an instruction instead of sorting it
+//  out every time. These take the stack pointer, the base pointer, and where
+//  the current routine's locals start (GState->stack + bp) as arguments, so
+//  the engine can keep them in locals. If we have to die, we write the stack
+//  and base pointers back to GState first, so the die() handler sees the
+//  correct state.
+#define FRAMEDIE(...) { GState->sp = *_sp; GState->bp = bp; GState->die(__VA_ARGS__); }
+
+// Pushing might grow the stack, which moves it, so this updates `*_locals`, too.
+static inline uint16 *pushStackInFrame(uint16 **_sp, uint16 **_locals, const uint16 bp)
+{
+    if (((uint32) (*_sp-GState->stack)) >= GState->stack_size) {
+        GState->sp = *_sp;  // in case we die.
+        GState->bp = bp;
+        *_sp = growStack(*_sp, 1);
+        *_locals = GState->stack + bp;
+    }
+    dbg("push stack\n");
+    return (*_sp)++;
+}
+
+static inline uint16 *popStackInFrame(uint16 **_sp, const uint16 bp)
+{
+    const uint16 *stack = GState->stack;
+    if (*_sp == stack) {
+        FRAMEDIE("Stack underflow");  // nothing on the stack at all? (this is always checked, since we'd crash otherwise.)
+    }
+    #if MOJOZORK_CHECKED
+    const uint16 numlocals = bp ? stack[bp-1] : 0;
+    if ((bp + numlocals) >= (*_sp-stack))
+        FRAMEDIE("Stack underflow");  // no stack data left in this frame.
+    #endif
+    dbg("pop stack\n");
+    return --(*_sp);
+}
+
+// "6.3.4: In the seven opcodes that take indirect variable references (inc, dec, inc_chk, dec_chk, load, store, pull), an indirect reference to the stack pointer does not push or pull the top item of the stack - it is read or written in place."
+static inline uint16 *peekStackInFrame(uint16 **_sp, const uint16 bp)
+{
+    if (*_sp == GState->stack) {
+        FRAMEDIE("Stack underflow");
+    }
+    return *_sp - 1;
+}
+
+// opcode_call always leaves room on the stack for 15 locals, so even in
+//  unchecked builds, a bogus local variable can't read past the end of it.
+static inline uint16 *localInFrame(const uint8 var, uint16 **_sp, uint16 *locals, const uint16 bp)
+{
+    #if MOJOZORK_CHECKED
+    const uint16 numlocals = bp ? GState->stack[bp-1] : 0;
+    if (numlocals <= (var-1)) {
+        FRAMEDIE("referenced unallocated local var #%u (%u available)", (unsigned int) (var-1), (unsigned int) numlocals);
+    }
+    #else
+    (void) _sp;
+    (void) bp;
+    #endif
+    return &locals[var-1];
+}
+
+#undef FRAMEDIE
+
+// With MOJOZORK_NATIVE_GLOBALS, this points into GState->globals_shadow
+//  instead of Z-Machine memory, so use READGLOBAL and WRITEGLOBAL on it.
+static inline uint8 *globalAddress(const uint8 var)
+{
+    FIXME("check for overflow, etc");
+    #if MOJOZORK_NATIVE_GLOBALS
+    return (uint8 *) &GState->globals_shadow[var - 0x10];
+    #else
+    return getGlobalPtr(var - 0x10);
+    #endif
+}
+
+#if MOJOZORK_NATIVE_GLOBALS
+#define READGLOBAL(ptr) *((const uint16 *) (ptr))
+#define WRITEGLOBAL(dst, src) { *((uint16 *) (dst)) = (uint16) (src); }
+#else
+#define READGLOBAL(ptr) ((((uint16) (ptr)[0]) << 8) | ((uint16) (ptr)[1]))
+#define WRITEGLOBAL(dst, src) { uint8 *globalptr = (dst); WRITEUI16(globalptr, src); }
+#endif
+
+// Read variable `var` of class `varclass`. Reading from the stack pops it,
+//  unless this is an indirect reference.
+// "6.3.4: In the seven opcodes that take indirect variable references (inc, dec, inc_chk, dec_chk, load, store, pull), an indirect reference to the stack pointer does not push or pull the top item of the stack - it is read or written in place."
+static inline uint16 loadVariableInFrame(const ZVarClass varclass, const uint8 var, const int indirect, uint16 **_sp, uint16 *locals, const uint16 bp)
+{
+    const uint8 *ptr;
+    switch (varclass) {
+        case VARCLASS_GLOBAL: ptr = globalAddress(var); return READGLOBAL(ptr);
+        case VARCLASS_LOCAL: ptr = (const uint8 *) localInFrame(var, _sp, locals, bp); break;
+        default: ptr = (const uint8 *) (indirect ? peekStackInFrame(_sp, bp) : popStackInFrame(_sp, bp)); break;
+    }
+    const uint16 val = READUI16(ptr);
+    return val;
+}
+
+// Write `val` to variable `var` of class `varclass`. Writing to the stack
+//  pushes it, unless this is an indirect reference.
+static inline void storeVariableInFrame(const ZVarClass varclass, const uint8 var, const uint16 val, const int indirect, uint16 **_sp, uint16 **_locals, const uint16 bp)
+{
+    uint8 *ptr;
+    switch (varclass) {
+        case VARCLASS_GLOBAL: ptr = globalAddress(var); WRITEGLOBAL(ptr, val); return;
+        case VARCLASS_LOCAL: ptr = (uint8 *) localInFrame(var, _sp, *_locals, bp); break;
+        default: ptr = (uint8 *) (indirect ? peekStackInFrame(_sp, bp) : pushStackInFrame(_sp, _locals, bp)); break;
+    }
+    WRITEUI16(ptr, val);
+}
+
+static uint16 loadVariable(const uint8 var, const int indirect)
+{
+    return loadVariableInFrame(variableClass(var), var, indirect, &GState->sp, GState->stack + GState->bp, GState->bp);
+}
 
-            dbg("pop stack\n");
-            return (uint8 *) --GState->sp;
+static void storeVariable(const uint8 var, const uint16 val, const int indirect)
+{
+    uint16 *locals = GState->stack + GState->bp;
+    storeVariableInFrame(variableClass(var), var, val, indirect, &GState->sp, &locals, GState->bp);
+}
+
+#if MOJOZORK_NATIVE_GLOBALS
+// Copy globals [first, first+count) between memory and GState->globals_shadow.
+//  These go through getGlobalPtr(), so multizorkd's per-player globals work.
+static void loadGlobalsShadow(const uint32 first, const uint32 count)
+{
+    for (uint32 i = first; i < (first + count); i++) {
+        const uint8 *ptr = getGlobalPtr((uint8) i);
+        GState->globals_shadow[i] = READUI16(ptr);
+    }
+}
+
+static void flushGlobalsShadow(const uint32 first, const uint32 count)
+{
+    for (uint32 i = first; i < (first + count); i++) {
+        uint8 *ptr = getGlobalPtr((uint8) i);
+        const uint16 val = GState->globals_shadow[i];
+        WRITEUI16(ptr, val);
+    }
+}
+
+// Which globals overlap `len` bytes of Z-Machine memory at `addr`? Returns zero if none do.
+static uint32 globalsInRange(const uint32 addr, const uint32 len, uint32 *_first)
+{
+    const uint32 start = GState->header.globals_addr;
+    const uint32 end = start + (240 * sizeof (uint16));
+    if ((len == 0) || (addr >= end) || ((addr + len) <= start)) {
+        return 0;
+    }
+    const uint32 first = (addr > start) ? ((addr - start) / sizeof (uint16)) : 0;
+    const uint32 last = ((((addr + len) < end) ? (addr + len) : end) - start + 1) / sizeof (uint16);
+    *_first = first;
+    return last - first;
+}
+#endif
+
+// runZMachine() calls these on the way in and out.
+static void shadowGlobals(void)
+{
+    #if MOJOZORK_NATIVE_GLOBALS
+    if (!GState->globals_shadowed) {  // if die() longjmp'd out last time, the shadow is still current.
+        loadGlobalsShadow(0, 240);
+        GState->globals_shadowed = 1;
+    }
+    #endif
+}
+
+static void unshadowGlobals(void)
+{
+    #if MOJOZORK_NATIVE_GLOBALS
+    if (GState->globals_shadowed) {
+        flushGlobalsShadow(0, 240);
+        GState->globals_shadowed = 0;
+    }
+    #endif
+}
+
+// Something is about to read `len` bytes at `addr` directly from Z-Machine
+//  memory (loadw, saving the game, etc), so make sure it's current.
+static inline void dynamicMemoryRead(const uint32 addr, const uint32 len)
+{
+    #if MOJOZORK_NATIVE_GLOBALS
+    if (GState->globals_shadowed && ((addr + len) > GState->header.globals_addr)) {
+        uint32 first = 0;
+        const uint32 count = globalsInRange(addr, len, &first);
+        flushGlobalsShadow(first, count);
+    }
+    #else
+    (void) addr;
+    (void) len;
+    #endif
+}
+
+// The current value of a global, whether runZMachine() is going or not.
+static uint16 globalValue(const uint8 globalid)
+{
+    #if MOJOZORK_NATIVE_GLOBALS
+    if (GState->globals_shadowed) {
+        return GState->globals_shadow[globalid];
+    }
+    #endif
+    const uint8 *ptr = getGlobalPtr(globalid);
+    const uint16 val = READUI16(ptr);
+    return val;
+}
+
+#if !MOJOZORK_PROFILING
+#define PROFILE_INSTRUCTION(opcode, extended, name)
+#define PROFILE_CALL(packed_addr, bp)
+#define PROFILE_RETURN(bp)
+#define PROFILE_STOP()
+#else
+#define PROFILE_INSTRUCTION(opcode, extended, name) profileInstruction(opcode, extended, name)
+#define PROFILE_CALL(packed_addr, bp) profileCall(packed_addr, bp)
+#define PROFILE_RETURN(bp) profileReturn(bp)
+#define PROFILE_STOP() profileStop()
+
+typedef struct ZProfileOpcode
+{
+    const char *name;
+    uint16 index;  // opcode number, or 256 + the extended opcode number.
+    uint64 count;
+    uint64 ns;
+} ZProfileOpcode;
+
+typedef struct ZProfileRoutine
+{
+    uint32 packed_addr;  // what opcode_call got. Zero if this slot is unused.
+    uint64 calls;
+    uint64 ns;  // inclusive: time spent in this routine and everything it called.
+} ZProfileRoutine;
+
+typedef struct ZProfileFrame
+{
+    const ZMachineState *state;
+    uint16 bp;
+    uint32 routine;  // index into routines[].
+    uint64 start_ns;
+} ZProfileFrame;
+
+// This is per-thread, not per-ZMachineState, so multizorkd gets one report
+//  for all the instances each of its worker threads runs. Time only
+//  accumulates while instructions are running, so a routine that is waiting
+//  on a READ isn't charged for the time the player spent typing.
+static MOJOZORK_THREAD_LOCAL struct
+{
+    ZProfileOpcode opcodes[256 + 30];  // regular opcodes, then extended ones.
+    ZProfileRoutine routines[4096];
+    ZProfileFrame frames[256];
+    uint32 num_frames;
+    uint32 current;  // index into opcodes[] of the instruction that is running.
+    int running;
+    uint64 last_ns;  // wallclock time when the current instruction started.
+    uint64 clock_ns;  // total time spent running instructions.
+} profile;
+
+static uint64 profileNow(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (((uint64) ts.tv_sec) * 1000000000ull) + ((uint64) ts.tv_nsec);
+}
+
+// charge the time since the last instruction started to that instruction.
+static uint64 profileTick(void)
+{
+    const uint64 now = profileNow();
+    if (profile.running) {
+        const uint64 elapsed = now - profile.last_ns;
+        profile.clock_ns += elapsed;
+        profile.opcodes[profile.current].ns += elapsed;
+    }
+    profile.last_ns = now;
+    return now;
+}
+
+static void profileInstruction(const uint8 opcode, const int extended, const char *name)
+{
+    profileTick();
+    profile.current = extended ? (256 + opcode) : opcode;
+    profile.opcodes[profile.current].name = name;
+    profile.opcodes[profile.current].index = (uint16) profile.current;
+    profile.opcodes[profile.current].count++;
+    profile.running = 1;
+}
+
+static void profileStop(void)
+{
+    profileTick();
+    profile.running = 0;
+}
+
+static void profileCall(const uint32 packed_addr, const uint16 bp)
+{
+    const uint32 mask = (sizeof (profile.routines) / sizeof (profile.routines[0])) - 1;
+    uint32 i = packed_addr & mask;
+    uint32 tries;
+    for (tries = 0; tries <= mask; tries++, i = (i + 1) & mask) {
+        ZProfileRoutine *routine = &profile.routines[i];
+        if (routine->packed_addr == packed_addr) {
+            break;
+        } else if (routine->packed_addr == 0) {
+            routine->packed_addr = packed_addr;
+            break;
         }
-    } else if ((var >= 0x1) && (var <= 0xF)) {  // local var.
-        if (GState->stack[GState->bp-1] <= (var-1)) {
-            GState->die("referenced unallocated local var #%u (%u available)", (unsigned int) (var-1), (unsigned int) GState->stack[GState->bp-1]);
+    }
+
+    if (tries > mask) {
+        return;  // table is full, oh well.
+    }
+
+    profile.routines[i].calls++;
+
+    if (profile.num_frames < (sizeof (profile.frames) / sizeof (profile.frames[0]))) {
+        ZProfileFrame *frame = &profile.frames[profile.num_frames++];
+        frame->state = GState;
+        frame->bp = bp;
+        frame->routine = i;
+        frame->start_ns = profile.clock_ns;
+    }
+}
+
+static void profileReturn(const uint16 bp)
+{
+    // multizorkd swaps stacks between players, and restore/restart throw
+    //  away the whole stack, so look for the frame we're returning from and
+    //  drop anything above it that we lost track of.
+    for (uint32 i = profile.num_frames; i > 0; i--) {
+        const ZProfileFrame *frame = &profile.frames[i-1];
+        if ((frame->state == GState) && (frame->bp == bp)) {
+            profileTick();
+            profile.routines[frame->routine].ns += profile.clock_ns - frame->start_ns;
+            profile.num_frames = i - 1;
+            return;
         }
-        return (uint8 *) &GState->stack[GState->bp + (var-1)];
     }
+}
 
-    // else, global var
-    FIXME("check for overflow, etc");
-    return (GState->story + GState->header.globals_addr) + ((var-0x10) * sizeof (uint16));
+static int cmpProfileOpcode(const void *a, const void *b)
+{
+    const uint64 x = ((const ZProfileOpcode *) a)->ns;
+    const uint64 y = ((const ZProfileOpcode *) b)->ns;
+    return (x > y) ? -1 : ((x < y) ? 1 : 0);  // most expensive first.
+}
+
+static int cmpProfileRoutine(const void *a, const void *b)
+{
+    const uint64 x = ((const ZProfileRoutine *) a)->ns;
+    const uint64 y = ((const ZProfileRoutine *) b)->ns;
+    return (x > y) ? -1 : ((x < y) ? 1 : 0);  // most expensive first.
 }
 
+static void profileReport(FILE *io)
+{
+    static MOJOZORK_THREAD_LOCAL ZProfileOpcode opcodes[sizeof (profile.opcodes) / sizeof (profile.opcodes[0])];
+    static MOJOZORK_THREAD_LOCAL ZProfileRoutine routines[sizeof (profile.routines) / sizeof (profile.routines[0])];
+    const size_t num_opcodes = sizeof (opcodes) / sizeof (opcodes[0]);
+    const size_t num_routines = sizeof (routines) / sizeof (routines[0]);
+    const double total_ns = profile.clock_ns ? (double) profile.clock_ns : 1.0;
+    uint64 total_instructions = 0;
+    size_t i;
+
+    memcpy(opcodes, profile.opcodes, sizeof (opcodes));
+    memcpy(routines, profile.routines, sizeof (routines));
+    for (i = 0; i < num_opcodes; i++) {
+        total_instructions += opcodes[i].count;
+    }
+
+    qsort(opcodes, num_opcodes, sizeof (opcodes[0]), cmpProfileOpcode);
+    qsort(routines, num_routines, sizeof (routines[0]), cmpProfileRoutine);
+
+    fprintf(io, "\n*** Opcode profile: %llu instructions, %.3f ms running.\n", (unsigned long long) total_instructions, ((double) profile.clock_ns) / 1000000.0);
+    fprintf(io, "  %-8s %-16s %12s %12s %10s %7s\n", "opcode", "name", "count", "total ms", "avg ns", "time");
+    for (i = 0; (i < num_opcodes) && opcodes[i].count; i++) {
+        const ZProfileOpcode *op = &opcodes[i];
+        char opstr[16];
+        snprintf(opstr, sizeof (opstr), "%s%u", (op->index >= 256) ? "ext " : "", (unsigned int) ((op->index >= 256) ? (op->index - 256) : op->index));
+        fprintf(io, "  %-8s %-16s %12llu %12.3f %10.1f %6.2f%%\n", opstr, op->name ? op->name : "???", (unsigned long long) op->count, ((double) op->ns) / 1000000.0, ((double) op->ns) / ((double) op->count), (((double) op->ns) / total_ns) * 100.0);
+    }
+
+    fprintf(io, "\n*** Routine profile (inclusive time, top 50):\n");
+    fprintf(io, "  %-10s %12s %12s %10s %7s\n", "routine", "calls", "total ms", "avg ns", "time");
+    for (i = 0; (i < num_routines) && (i < 50) && routines[i].calls; i++) {
+        const ZProfileRoutine *routine = &routines[i];
+        fprintf(io, "  0x%-8X %12llu %12.3f %10.1f %6.2f%%\n", (unsigned int) routine->packed_addr, (unsigned long long) routine->calls, ((double) routine->ns) / 1000000.0, ((double) routine->ns) / ((double) routine->calls), (((double) routine->ns) / total_ns) * 100.0);
+    }
+    fprintf(io, "\n");
+    fflush(io);
+}
+#endif
+
 static void opcode_call(void)
 {
     uint8 args = GState->operand_count;
@@ -203,8 +991,7 @@ static void opcode_call(void)
     const uint8 storeid = *(GState->pc++);
     // no idea if args==0 should be the same as calling addr 0...
     if ((args == 0) || (operands[0] == 0)) {  // legal no-op; store 0 to return value and bounce.
-        uint8 *store = varAddress(storeid, 1, 0);
-        WRITEUI16(store, 0);
+        storeVariable(storeid, 0, 0);
     } else {
         const uint8 *routine = unpackAddress(operands[0]);
         GState->logical_pc = (uint32) (routine - GState->story);
@@ -213,7 +1000,7 @@ static void opcode_call(void)
             GState->die("Routine has too many local variables (%u)", numlocals);
         }
 
-        FIXME("check for stack overflow here");
+        GState->sp = growStack(GState->sp, 5 + 15);  // room for the frame and locals (all 15, see localInFrame()).
 
         *(GState->sp++) = (uint16) storeid;  // save where we should store the call's result.
 
@@ -226,6 +1013,7 @@ static void opcode_call(void)
         *(GState->sp++) = numlocals;  // number of locals we're allocating.
 
         GState->bp = (uint16) (GState->sp-GState->stack);
+        PROFILE_CALL(operands[0], GState->bp);
 
         sint8 i;
         if (GState->header.version <= 4) {
@@ -260,6 +1048,8 @@ static void doReturn(const uint16 val)
     if (GState->bp == 0)
         GState->die("Stack underflow in return operation");
 
+    PROFILE_RETURN(GState->bp);
+
     dbg("popping stack for return\n");
     dbg("returning: initial pc=%X, bp=%u, sp=%u\n", (unsigned int) (GState->pc-GState->story), (unsigned int) GState->bp, (unsigned int) (GState->sp-GState->stack));
 
@@ -275,8 +1065,7 @@ static void doReturn(const uint16 val)
     const uint8 storeid = (uint8) *(--GState->sp);  // pop the result storage location.
 
     dbg("returning: new pc=%X, bp=%u, sp=%u\n", (unsigned int) (GState->pc-GState->story), (unsigned int) GState->bp, (unsigned int) (GState->sp-GState->stack));
-    uint8 *store = varAddress(storeid, 1, 0);  // and store the routine result.
-    WRITEUI16(store, val);
+    storeVariable(storeid, val, 0);  // and store the routine result.
 }
 
 static void opcode_ret(void)
@@ -296,28 +1085,24 @@ static void opcode_rfalse(void)
 
 static void opcode_ret_popped(void)
 {
-    uint8 *ptr = varAddress(0, 0, 0);   // top of stack.
-    const uint16 result = READUI16(ptr);
+    const uint16 result = loadVariable(0, 0);   // top of stack.
     doReturn(result);
 }
 
 static void opcode_push(void)
 {
-    uint8 *store = varAddress(0, 1, 0);   // top of stack.
-    WRITEUI16(store, GState->operands[0]);
+    storeVariable(0, GState->operands[0], 0);   // top of stack.
 }
 
 static void opcode_pull(void)
 {
-    const uint8 *ptr = varAddress(0, 0, 0);   // top of stack.
-    const uint16 val = READUI16(ptr);
-    uint8 *store = varAddress((uint8) GState->operands[0], 1, 1);
-    WRITEUI16(store, val);
+    const uint16 val = loadVariable(0, 0);   // top of stack.
+    storeVariable((uint8) GState->operands[0], val, 1);
 }
 
 static void opcode_pop(void)
 {
-    varAddress(0, 0, 0);   // this causes a pop.
+    loadVariable(0, 0);   // this causes a pop.
 }
 
 static void updateStatusBar(void);
@@ -329,16 +1114,16 @@ static void opcode_show_status(void)
 
 static void opcode_add(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     const sint16 result = ((sint16) GState->operands[0]) + ((sint16) GState->operands[1]);
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
 }
 
 static void opcode_sub(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     const sint16 result = ((sint16) GState->operands[0]) - ((sint16) GState->operands[1]);
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
 }
 
 static void doBranch(int truth)
@@ -410,119 +1195,118 @@ static void opcode_jump(void)
 
 static void opcode_div(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     if (GState->operands[1] == 0) {
         GState->die("Division by zero");
     }
     const uint16 result = (uint16) (((sint16) GState->operands[0]) / ((sint16) GState->operands[1]));
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
 }
 
 static void opcode_mod(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     if (GState->operands[1] == 0) {
         GState->die("Division by zero");
     }
     const uint16 result = (uint16) (((sint16) GState->operands[0]) % ((sint16) GState->operands[1]));
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
 }
 
 static void opcode_mul(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     const uint16 result = (uint16) (((sint16) GState->operands[0]) * ((sint16) GState->operands[1]));
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
 }
 
 static void opcode_or(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     const uint16 result = (GState->operands[0] | GState->operands[1]);
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
 }
 
 static void opcode_and(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     const uint16 result = (GState->operands[0] & GState->operands[1]);
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
 }
 
 static void opcode_not(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     const uint16 result = ~GState->operands[0];
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
 }
 
 static void opcode_inc_chk(void)
 {
-    uint8 *store = varAddress((uint8) GState->operands[0], 0, 1);
-    sint16 val = READUI16(store);
-    store -= sizeof (uint16);
+    sint16 val = (sint16) loadVariable((uint8) GState->operands[0], 1);
     val++;
-    WRITEUI16(store, (uint16) val);
+    storeVariable((uint8) GState->operands[0], (uint16) val, 1);
     doBranch( (((sint16) val) > ((sint16) GState->operands[1])) ? 1 : 0 );
 }
 
 static void opcode_inc(void)
 {
-    uint8 *store = varAddress((uint8) GState->operands[0], 0, 1);
-    sint16 val = (sint16) READUI16(store);
-    store -= sizeof (uint16);
+    sint16 val = (sint16) loadVariable((uint8) GState->operands[0], 1);
     val++;
-    WRITEUI16(store, (uint16) val);
+    storeVariable((uint8) GState->operands[0], (uint16) val, 1);
 }
 
 static void opcode_dec_chk(void)
 {
-    uint8 *store = varAddress((uint8) GState->operands[0], 0, 1);
-    sint16 val = (sint16) READUI16(store);
-    store -= sizeof (uint16);
+    sint16 val = (sint16) loadVariable((uint8) GState->operands[0], 1);
     val--;
-    WRITEUI16(store, (uint16) val);
+    storeVariable((uint8) GState->operands[0], (uint16) val, 1);
     doBranch( (((sint16) val) < ((sint16) GState->operands[1])) ? 1 : 0 );
 }
 
 static void opcode_dec(void)
 {
-    uint8 *store = varAddress((uint8) GState->operands[0], 0, 1);
-    sint16 val = (sint16) READUI16(store);
-    store -= sizeof (uint16);
+    sint16 val = (sint16) loadVariable((uint8) GState->operands[0], 1);
     val--;
-    WRITEUI16(store, (uint16) val);
+    storeVariable((uint8) GState->operands[0], (uint16) val, 1);
 }
 
 static void opcode_load(void)
 {
-    const uint8 *valptr = varAddress((uint8) (GState->operands[0] & 0xFF), 0, 1);
-    const uint16 val = READUI16(valptr);
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
-    WRITEUI16(store, val);
+    const uint16 val = loadVariable((uint8) (GState->operands[0] & 0xFF), 1);
+    storeVariable(*(GState->pc++), val, 0);
 }
 
 static void opcode_loadw(void)
 {
-    uint16 *store = (uint16 *) varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     FIXME("can only read from dynamic or static memory (not highmem).");
     FIXME("how does overflow work here? Do these wrap around?");
     const uint16 offset = (GState->operands[0] + (GState->operands[1] * 2));
-    const uint16 *src = (const uint16 *) get_virtualized_mem_ptr(offset);
-    *store = *src;  // copy from bigendian to bigendian: no byteswap.
+    dynamicMemoryRead(offset, 2);
+    const uint8 *src = get_virtualized_mem_ptr(offset);
+    const uint16 value = READUI16(src);
+    storeVariable(storeid, value, 0);
 }
 
 static void opcode_loadb(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     FIXME("can only read from dynamic or static memory (not highmem).");
     FIXME("how does overflow work here? Do these wrap around?");
     const uint16 offset = (GState->operands[0] + GState->operands[1]);
+    dynamicMemoryRead(offset, 1);
     const uint8 *src = get_virtualized_mem_ptr(offset);
     const uint16 value = *src;  // expand out to 16-bit before storing.
-    WRITEUI16(store, value);
+    storeVariable(storeid, value, 0);
 }
 
+// The property index and object tree copy parts of dynamic memory, so
+//  anything that writes there, other than the object and property opcodes,
+//  has to let them know.
+static void dynamicMemoryWritten(const uint32 addr, const uint32 len);  // the game wrote `len` bytes at `addr`.
+static void dynamicMemoryReplaced(ZMachineState *state);  // all of it might have changed (restore, etc).
+
 static void opcode_storew(void)
 {
     FIXME("can only write to dynamic memory.");
@@ -531,6 +1315,7 @@ static void opcode_storew(void)
     uint8 *dst = get_virtualized_mem_ptr(offset);
     const uint16 src = GState->operands[2];
     WRITEUI16(dst, src);
+    dynamicMemoryWritten(offset, 2);
 }
 
 static void opcode_storeb(void)
@@ -541,13 +1326,12 @@ static void opcode_storeb(void)
     uint8 *dst = get_virtualized_mem_ptr(offset);
     const uint8 src = (uint8) GState->operands[2];
     *dst = src;
+    dynamicMemoryWritten(offset, 1);
 }
 
 static void opcode_store(void)
 {
-    uint8 *store = varAddress((uint8) (GState->operands[0] & 0xFF), 1, 1);
-    const uint16 src = GState->operands[1];
-    WRITEUI16(store, src);
+    storeVariable((uint8) (GState->operands[0] & 0xFF), GState->operands[1], 1);
 }
 
 static uint8 *getObjectPtr(const uint16 objid);
@@ -563,80 +1347,250 @@ static uint8 *getObjectPtr(const uint16 objid)
     }
 
     uint8 *ptr = GState->story + GState->header.objtab_addr;
-    ptr += 31 * sizeof (uint16);  // skip properties defaults table
-    ptr += 9 * (objid-1);  // find object in object table
+    if (GState->header.version <= 3) {
+        ptr += 31 * sizeof (uint16);  // skip properties defaults table
+        ptr += 9 * (objid-1);  // find object in object table
+    } else {
+        ptr += 63 * sizeof (uint16);  // skip properties defaults table
+        ptr += 14 * (objid-1);  // find object in object table
+    }
     return ptr;
 }
 #endif
 
-static void opcode_test_attr(void)
+// Read or write one of an object's relationships straight from its record.
+static uint16 readObjectRecord(const uint8 *objptr, const ZObjectRelationship rel)
 {
-    const uint16 objid = GState->operands[0];
-    const uint16 attrid = GState->operands[1];
-    uint8 *ptr = getObjectPtr(objid);
-
     if (GState->header.version <= 3) {
-        ptr += (attrid / 8);
-        doBranch((*ptr & (0x80 >> (attrid & 7))) ? 1 : 0);
-    } else {
-        GState->die("write me");
+        return objptr[4 + rel];  // parent, sibling, child are bytes 4, 5 and 6.
     }
+    objptr += 6 + (rel * sizeof (uint16));  // parent, sibling, child are words at bytes 6, 8 and 10.
+    return READUI16(objptr);
 }
 
-static void opcode_set_attr(void)
+static void writeObjectRecord(uint8 *objptr, const ZObjectRelationship rel, const uint16 val)
 {
-    const uint16 objid = GState->operands[0];
-    const uint16 attrid = GState->operands[1];
-    uint8 *ptr = getObjectPtr(objid);
-
     if (GState->header.version <= 3) {
-        ptr += (attrid / 8);
-        *ptr |= 0x80 >> (attrid & 7);
+        objptr[4 + rel] = (uint8) val;
     } else {
-        GState->die("write me");
+        objptr += 6 + (rel * sizeof (uint16));
+        WRITEUI16(objptr, val);
     }
 }
 
-static void opcode_clear_attr(void)
+#if MOJOZORK_OBJECT_TREE
+// (re)copy object `objid`'s record from the story into `tree`.
+static void copyObjectRecord(ZObjectTree *tree, const uint32 objid)
 {
-    const uint16 objid = GState->operands[0];
-    const uint16 attrid = GState->operands[1];
-    uint8 *ptr = objid ? getObjectPtr(objid) : NULL;
-
-    if (ptr == NULL) {
-        return;  // Zork 1 will trigger this on "go X" where "x" isn't a direction, so ignore it.
+    const uint8 *objptr = GState->story + tree->records_addr + ((objid - 1) * tree->record_size);
+    uint64 attributes = 0;
+    for (uint32 i = 0; i < (tree->num_attributes / 8); i++) {
+        attributes = (attributes << 8) | objptr[i];
     }
-
-    if (GState->header.version <= 3) {
-        ptr += (attrid / 8);
-        *ptr &= ~(0x80 >> (attrid & 7));
-    } else {
-        GState->die("write me");
+    tree->attributes[objid] = attributes << (64 - tree->num_attributes);
+    for (int rel = 0; rel < OBJREL_TOTAL; rel++) {
+        tree->relatives[rel][objid] = readObjectRecord(objptr, (ZObjectRelationship) rel);
     }
 }
 
-static uint8 *getObjectPtrParent(const uint8 *objptr)
+// Copies the object tree out of the story's object table. Returns NULL if we're out of memory.
+static ZObjectTree *createObjectTree(void)
 {
-    if (GState->header.version <= 3) {
-        const uint16 parent = objptr[4];
-        return parent ? getObjectPtr(parent) : NULL;
-    } else {
-        GState->die("write me");
+    const int v3 = (GState->header.version <= 3);
+    const uint32 record_size = v3 ? 9 : 14;
+    const uint32 records_addr = ((uint32) GState->header.objtab_addr) + ((v3 ? 31 : 63) * sizeof (uint16));
+    const uint32 max_objects = v3 ? 255 : 0xFFFF;
+    uint32 lowest_proptab = (uint32) GState->story_len;
+    uint32 num_objects = 0;
+
+    // there's no object count anywhere, but the property tables (which
+    //  start right after the object table in every Infocom game) can't
+    //  overlap the records, so stop when we reach the first one.
+    while (num_objects < max_objects) {
+        const uint32 recaddr = records_addr + (num_objects * record_size);
+        if ((recaddr + record_size) > lowest_proptab) {
+            break;
+        }
+        const uint8 *ptr = GState->story + recaddr + (record_size - 2);  // the properties address is the last field.
+        const uint16 proptab = READUI16(ptr);
+        if (proptab < lowest_proptab) {
+            lowest_proptab = proptab;
+        }
+        num_objects++;
+    }
+
+    const uint32 num_slots = num_objects + 1;  // there is no object #0, but it's easier to have a slot for it.
+    ZObjectTree *tree = (ZObjectTree *) malloc(sizeof (ZObjectTree) + (num_slots * sizeof (uint64)) + (OBJREL_TOTAL * num_slots * sizeof (uint16)));
+    if (!tree) {
         return NULL;
     }
+
+    tree->num_objects = num_objects;
+    tree->records_addr = records_addr;
+    tree->record_size = record_size;
+    tree->num_attributes = v3 ? 32 : 48;
+    tree->attributes[0] = 0;
+    for (int rel = 0; rel < OBJREL_TOTAL; rel++) {
+        tree->relatives[rel] = ((uint16 *) (tree->attributes + num_slots)) + (rel * num_slots);
+        tree->relatives[rel][0] = 0;
+    }
+
+    for (uint32 i = 1; i <= num_objects; i++) {
+        copyObjectRecord(tree, i);
+    }
+
+    return tree;
+}
+
+static inline ZObjectTree *getObjectTree(void)
+{
+    if (!GState->object_tree) {
+        GState->object_tree = createObjectTree();  // if this fails, we just use the records directly.
+    }
+    return GState->object_tree;
+}
+
+static void freeObjectTree(ZMachineState *state)
+{
+    free(state->object_tree);  // a new one gets made on demand.
+    state->object_tree = NULL;
+}
+
+// the game wrote to Z-Machine memory; if it landed on any object records, copy them again.
+static void objectTableWritten(const uint32 addr, const uint32 len)
+{
+    ZObjectTree *tree = GState->object_tree;
+    if (tree && ((addr + len) > tree->records_addr)) {
+        const uint32 records_end = tree->records_addr + (tree->num_objects * tree->record_size);
+        for (uint32 i = (addr > tree->records_addr) ? addr : tree->records_addr; (i < (addr + len)) && (i < records_end); i++) {
+            copyObjectRecord(tree, ((i - tree->records_addr) / tree->record_size) + 1);
+        }
+    }
+}
+#endif
+
+// Object `objid`'s parent, sibling or child, or 0 if it doesn't have one.
+static inline uint16 getObjectRelative(const uint16 _objid, const ZObjectRelationship rel)
+{
+    const uint16 objid = remap_objectid(_objid);
+    #if MOJOZORK_OBJECT_TREE
+    const ZObjectTree *tree = getObjectTree();
+    if (tree && (objid >= 1) && (objid <= tree->num_objects)) {
+        return tree->relatives[rel][objid];
+    }
+    #endif
+    return readObjectRecord(getObjectPtr(objid), rel);  // not in the tree (multizorkd's players live elsewhere), or it's a bogus id and this will die().
+}
+
+static inline void setObjectRelative(const uint16 _objid, const ZObjectRelationship rel, const uint16 val)
+{
+    const uint16 objid = remap_objectid(_objid);
+    writeObjectRecord(getObjectPtr(objid), rel, val);  // the story bytes are always up to date.
+    #if MOJOZORK_OBJECT_TREE
+    ZObjectTree *tree = GState->object_tree;
+    if (tree && (objid >= 1) && (objid <= tree->num_objects)) {
+        tree->relatives[rel][objid] = val;
+    }
+    #endif
+}
+
+// multizorkd keeps some attributes separately for each player. If attribute
+//  `attrid` of `objid` is one of them, this returns the byte that holds it,
+//  and which bit in it. Otherwise it returns NULL, and the attribute lives in
+//  the object like normal.
+static uint8 *getAttributeOverlay(const uint16 objid, const uint16 attrid, uint8 *_mask);
+#ifndef MULTIZORK
+static inline uint8 *getAttributeOverlay(const uint16 objid, const uint16 attrid, uint8 *_mask)
+{
+    (void) objid;
+    (void) attrid;
+    (void) _mask;
+    return NULL;
+}
+#endif
+
+static inline int testObjectAttribute(const uint16 objid, const uint16 attrid)
+{
+    uint8 mask;
+    const uint8 *overlay = getAttributeOverlay(objid, attrid, &mask);
+    if (overlay) {
+        return (*overlay & mask) ? 1 : 0;
+    }
+
+    #if MOJOZORK_OBJECT_TREE
+    const uint16 id = remap_objectid(objid);
+    const ZObjectTree *tree = getObjectTree();
+    if (tree && (id >= 1) && (id <= tree->num_objects) && (attrid < tree->num_attributes)) {
+        return (int) ((tree->attributes[id] << attrid) >> 63);
+    }
+    #endif
+
+    const uint8 *ptr = getObjectPtr(objid) + (attrid / 8);
+    return (*ptr & (0x80 >> (attrid & 7))) ? 1 : 0;
+}
+
+static void setObjectAttribute(const uint16 objid, const uint16 attrid, const int value)
+{
+    uint8 mask;
+    uint8 *ptr = getAttributeOverlay(objid, attrid, &mask);
+    if (!ptr) {
+        ptr = getObjectPtr(objid) + (attrid / 8);  // the story bytes are always up to date.
+        mask = 0x80 >> (attrid & 7);
+        #if MOJOZORK_OBJECT_TREE
+        const uint16 id = remap_objectid(objid);
+        ZObjectTree *tree = GState->object_tree;
+        if (tree && (id >= 1) && (id <= tree->num_objects) && (attrid < tree->num_attributes)) {
+            const uint64 bit = ((uint64) 1) << (63 - attrid);
+            tree->attributes[id] = value ? (tree->attributes[id] | bit) : (tree->attributes[id] & ~bit);
+        }
+        #endif
+    }
+
+    if (value) {
+        *ptr |= mask;
+    } else {
+        *ptr &= ~mask;
+    }
+}
+
+static void opcode_test_attr(void)
+{
+    doBranch(testObjectAttribute(GState->operands[0], GState->operands[1]));
+}
+
+static void opcode_set_attr(void)
+{
+    setObjectAttribute(GState->operands[0], GState->operands[1], 1);
+}
+
+static void opcode_clear_attr(void)
+{
+    const uint16 objid = GState->operands[0];
+    const uint16 attrid = GState->operands[1];
+
+    if (objid == 0) {
+        return;  // Zork 1 will trigger this on "go X" where "x" isn't a direction, so ignore it.
+    }
+
+    setObjectAttribute(objid, attrid, 0);
 }
 
 static void unparentObject(const uint16 _objid)
 {
     const uint16 objid = remap_objectid(_objid);
-    uint8 *objptr = getObjectPtr(objid);
-    uint8 *parentptr = getObjectPtrParent(objptr);
-    if (parentptr != NULL) {  // if NULL, no need to remove it.
-        uint8 *ptr = parentptr + 6;  // 4 to skip attrs, 2 to skip to child.
-        while (*ptr != objid) { // if not direct child, look through sibling list...
-            ptr = getObjectPtr(*ptr) + 5;  // get sibling field.
+    const uint16 parent = getObjectRelative(objid, OBJREL_PARENT);
+    if (parent != 0) {  // if 0, no need to remove it.
+        const uint16 sibling = getObjectRelative(objid, OBJREL_SIBLING);
+        uint16 prev = getObjectRelative(parent, OBJREL_CHILD);
+        if (prev == objid) {
+            setObjectRelative(parent, OBJREL_CHILD, sibling);  // obj sibling takes obj's place.
+        } else {
+            uint16 next;
+            while ((next = getObjectRelative(prev, OBJREL_SIBLING)) != objid) { // if not direct child, look through sibling list...
+                prev = next;
+            }
+            setObjectRelative(prev, OBJREL_SIBLING, sibling);  // obj sibling takes obj's place.
         }
-        *ptr = *(objptr + 5);  // obj sibling takes obj's place.
     }
 }
 
@@ -645,65 +1599,203 @@ static void opcode_insert_obj(void)
     const uint16 objid = remap_objectid(GState->operands[0]);
     const uint16 dstid = remap_objectid(GState->operands[1]);
 
-    uint8 *objptr = getObjectPtr(objid);
-    uint8 *dstptr = getObjectPtr(dstid);
+    getObjectPtr(objid);  // make sure these are valid objects before we touch anything.
+    getObjectPtr(dstid);
 
-    if (GState->header.version <= 3) {
-        unparentObject(objid);  // take object out of its original tree first.
+    unparentObject(objid);  // take object out of its original tree first.
 
-        // now reinsert in the right place.
-        *(objptr + 4) = (uint8) dstid;  // parent field: new destination
-        *(objptr + 5) = *(dstptr + 6);  // sibling field: new dest's old child.
-        *(dstptr + 6) = (uint8) objid;  // dest's child field: object being moved.
-    } else {
-        GState->die("write me");  // fields are different in ver4+.
-    }
+    // now reinsert in the right place.
+    setObjectRelative(objid, OBJREL_PARENT, dstid);  // parent field: new destination
+    setObjectRelative(objid, OBJREL_SIBLING, getObjectRelative(dstid, OBJREL_CHILD));  // sibling field: new dest's old child.
+    setObjectRelative(dstid, OBJREL_CHILD, objid);  // dest's child field: object being moved.
 }
 
 static void opcode_remove_obj(void)
 {
     const uint16 objid = GState->operands[0];
-    uint8 *objptr = getObjectPtr(objid);
 
-    if (GState->header.version > 3) {
-        GState->die("write me");  // fields are different in ver4+.
+    unparentObject(objid);  // take object out of its original tree first.
+
+    // now clear out object's relationships...
+    setObjectRelative(objid, OBJREL_PARENT, 0);  // parent field: zero.
+    setObjectRelative(objid, OBJREL_SIBLING, 0);  // sibling field: zero.
+}
+
+// Walk a version 3 property table (starting with the object name) looking for `propid`.
+static uint8 *findObjectProperty(uint8 *ptr, const uint32 propid, uint8 *_size)
+{
+    ptr += (*ptr * 2) + 1;  // skip object name to start of properties.
+    while (1) {
+        const uint8 info = *(ptr++);
+        const uint16 num = (info & 0x1F);  // 5 bits for the prop id.
+        const uint8 size = ((info >> 5) & 0x7) + 1; // 3 bits for prop size.
+        // these go in descending numeric order, and should fail
+        //  the interpreter if missing. We use 0xFFFFFFFF internally to mean "first property".
+        if ((num == propid) || (propid == 0xFFFFFFFF)) {  // found it?
+            if (_size) {
+                *_size = size;
+            }
+            return ptr;
+        } else if (num < propid) {  // we're past it.
+            break;
+        }
+
+        ptr += size;  // try the next property.
+    }
+
+    return NULL;
+}
+
+#if MOJOZORK_PROPERTY_INDEX
+static void invalidatePropertyIndex(ZMachineState *state)
+{
+    free(state->property_index);  // a new one gets made on demand.
+    state->property_index = NULL;
+}
+
+// Call this when the game writes `len` bytes to Z-Machine memory at `addr`,
+//  in case they change the layout of a property table we indexed.
+static void propertyTablesWritten(const uint32 addr, const uint32 len)
+{
+    const ZPropertyIndex *index = GState->property_index;
+    if (index) {
+        for (uint32 i = 0; i < len; i++) {
+            const uint16 byteaddr = (uint16) (addr + i);
+            if (index->layout[byteaddr / 8] & (1 << (byteaddr % 8))) {
+                invalidatePropertyIndex(GState);
+                return;
+            }
+        }
+    }
+}
+
+// (Re)index object `objid`, whose property table is at `tableaddr`. This
+//  records what findObjectProperty() would find for each property id, even
+//  if the list is out of order. Returns NULL if we're out of memory.
+static ZObjectProperties *indexObjectProperties(const uint16 objid, const uint16 tableaddr)
+{
+    ZPropertyIndex *index = GState->property_index;
+    if (!index) {
+        index = (ZPropertyIndex *) calloc(1, sizeof (ZPropertyIndex));
+        if (!index) {
+            return NULL;
+        }
+        GState->property_index = index;
+    }
+
+    ZObjectProperties *props = &index->objects[objid - 1];
+    const uint8 *ptr = GState->story + tableaddr;
+    const uint8 *end = GState->story + GState->story_len;
+    uint8 lowest = 32;  // lookups for ids below this haven't run into a smaller one yet.
+
+    memset(props, '\0', sizeof (*props));
+    props->table_addr = tableaddr;
+    index->layout[tableaddr / 8] |= 1 << (tableaddr % 8);
+    ptr += (*ptr * 2) + 1;  // skip object name to start of properties.
+    props->first_propid = (ptr < end) ? (*ptr & 0x1F) : 0;
+
+    while (ptr < end) {
+        const uint16 infoaddr = (uint16) (ptr - GState->story);
+        const uint8 info = *(ptr++);
+        const uint8 num = (info & 0x1F);  // 5 bits for the prop id.
+        const uint8 size = ((info >> 5) & 0x7) + 1; // 3 bits for prop size.
+        index->layout[infoaddr / 8] |= 1 << (infoaddr % 8);
+        if (num < lowest) {  // a walk for anything from here up to `lowest` stops on this one.
+            props->offsets[num] = (uint16) (ptr - GState->story);
+            props->sizes[num] = size;
+            lowest = num;
+        }
+        if (num == 0) {
+            break;  // end of the list.
+        }
+        ptr += size;  // try the next property.
+    }
+
+    return props;
+}
+
+static inline uint8 *lookupPropertyIndex(const uint16 objid, const uint16 tableaddr, const uint32 propid, uint8 *_size)
+{
+    const ZObjectProperties *props = GState->property_index ? &GState->property_index->objects[objid - 1] : NULL;
+    if (!props || (props->table_addr != tableaddr)) {  // haven't seen this object yet, or its property table moved.
+        props = indexObjectProperties(objid, tableaddr);
+        if (!props) {
+            return findObjectProperty(GState->story + tableaddr, propid, _size);  // out of memory? Just walk it, then.
+        }
+    }
+
+    uint8 num;
+    if (propid == 0xFFFFFFFF) {  // We use 0xFFFFFFFF internally to mean "first property".
+        num = props->first_propid;
+    } else if (propid < 32) {
+        num = (uint8) propid;
     } else {
-        unparentObject(objid);  // take object out of its original tree first.
+        return NULL;  // property ids only have 5 bits, so there's no way we have this one.
+    }
+
+    if (props->offsets[num] == 0) {
+        return NULL;
+    } else if (_size) {
+        *_size = props->sizes[num];
+    }
+    return GState->story + props->offsets[num];
+}
+#endif
 
-        // now clear out object's relationships...
-        *(objptr + 4) = 0;  // parent field: zero.
-        *(objptr + 5) = 0;  // sibling field: zero.
+static void dynamicMemoryWritten(const uint32 addr, const uint32 len)
+{
+    #if MOJOZORK_NATIVE_GLOBALS
+    uint32 first = 0;
+    const uint32 count = GState->globals_shadowed ? globalsInRange(addr, len, &first) : 0;
+    loadGlobalsShadow(first, count);
+    #endif
+    #if MOJOZORK_PROPERTY_INDEX
+    propertyTablesWritten(addr, len);
+    #endif
+    #if MOJOZORK_OBJECT_TREE
+    objectTableWritten(addr, len);
+    #endif
+    (void) addr;
+    (void) len;
+}
+
+static void dynamicMemoryReplaced(ZMachineState *state)
+{
+    #if MOJOZORK_NATIVE_GLOBALS
+    if ((state == GState) && state->globals_shadowed && state->globals) {  // restoring a game from inside runZMachine(), etc.
+        loadGlobalsShadow(0, 240);
+    }
+    #endif
+    #if MOJOZORK_PROPERTY_INDEX
+    invalidatePropertyIndex(state);
+    #endif
+    #if MOJOZORK_OBJECT_TREE
+    freeObjectTree(state);
+    #endif
+    (void) state;
+}
+
+// Look up a property of object `objid`, whose version 3 property table is at `tableaddr` in Z-Machine memory.
+static uint8 *getStoryObjectProperty(const uint16 objid, const uint16 tableaddr, const uint32 propid, uint8 *_size)
+{
+    #if MOJOZORK_PROPERTY_INDEX
+    if ((objid >= 1) && (objid <= 255)) {
+        return lookupPropertyIndex(objid, tableaddr, propid, _size);
     }
+    #endif
+    return findObjectProperty(GState->story + tableaddr, propid, _size);
 }
 
 static uint8 *getObjectProperty(const uint16 objid, const uint32 propid, uint8 *_size);
 #ifndef MULTIZORK
 static uint8 *getObjectProperty(const uint16 objid, const uint32 propid, uint8 *_size)
 {
-    uint8 *ptr = getObjectPtr(objid);
+    const uint8 *ptr = getObjectPtr(objid);
 
     if (GState->header.version <= 3) {
         ptr += 7;  // skip to properties address field.
         const uint16 addr = READUI16(ptr);
-        ptr = GState->story + addr;
-        ptr += (*ptr * 2) + 1;  // skip object name to start of properties.
-        while (1) {
-            const uint8 info = *(ptr++);
-            const uint16 num = (info & 0x1F);  // 5 bits for the prop id.
-            const uint8 size = ((info >> 5) & 0x7) + 1; // 3 bits for prop size.
-            // these go in descending numeric order, and should fail
-            //  the interpreter if missing. We use 0xFFFFFFFF internally to mean "first property".
-            if ((num == propid) || (propid == 0xFFFFFFFF)) {  // found it?
-                if (_size) {
-                    *_size = size;
-                }
-                return ptr;
-            } else if (num < propid) {  // we're past it.
-                break;
-            }
-
-            ptr += size;  // try the next property.
-        }
+        return getStoryObjectProperty(objid, addr, propid, _size);
     } else {
         GState->die("write me");
     }
@@ -760,7 +1852,7 @@ static uint16 getDefaultObjectProperty(const uint16 propid)
 
 static void opcode_get_prop(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     const uint16 objid = GState->operands[0];
     const uint16 propid = GState->operands[1];
     uint16 result = 0;
@@ -775,22 +1867,22 @@ static void opcode_get_prop(void)
         result = READUI16(ptr);
     }
 
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
 }
 
 static void opcode_get_prop_addr(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     const uint16 objid = GState->operands[0];
     const uint16 propid = GState->operands[1];
     uint8 *ptr = getObjectProperty(objid, propid, NULL);
     const uint16 result = ptr ? ((uint16) (ptr-GState->story)) : 0;
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
 }
 
 static void opcode_get_prop_len(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     uint16 result;
 
     if (GState->operands[0] == 0) {
@@ -804,12 +1896,12 @@ static void opcode_get_prop_len(void)
         GState->die("write me");
     }
 
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
 }
 
 static void opcode_get_next_prop(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     const uint16 objid = GState->operands[0];
     const int firstProp = (GState->operands[1] == 0);
     uint16 result = 0;
@@ -823,58 +1915,41 @@ static void opcode_get_next_prop(void)
     } else {
         GState->die("write me");
     }
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
 }
 
 static void opcode_jin(void)
 {
     const uint16 objid = GState->operands[0];
     const uint16 parentid = GState->operands[1];
-    const uint8 *objptr = objid ? getObjectPtr(objid) : NULL;
 
-    if (objptr == NULL) {
+    if (objid == 0) {
         return;  // Zork 1 will trigger this on "go X" where "x" isn't a direction.
     }
 
-    if (GState->header.version <= 3) {
-        doBranch((((uint16) objptr[4]) == parentid) ? 1 : 0);
-    } else {
-        GState->die("write me");  // fields are different in ver4+.
-    }
-}
-
-static uint16 getObjectRelationship(const uint16 objid, const uint8 relationship)
-{
-    const uint8 *objptr = getObjectPtr(objid);
-
-    if (GState->header.version <= 3) {
-        return objptr[relationship];
-    } else {
-        GState->die("write me");  // fields are different in ver4+.
-    }
-    return 0;
+    doBranch((getObjectRelative(objid, OBJREL_PARENT) == parentid) ? 1 : 0);
 }
 
 static void opcode_get_parent(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
-    const uint16 result = getObjectRelationship(GState->operands[0], 4);
-    WRITEUI16(store, result);
+    const uint8 storeid = *(GState->pc++);
+    const uint16 result = getObjectRelative(GState->operands[0], OBJREL_PARENT);
+    storeVariable(storeid, result, 0);
 }
 
 static void opcode_get_sibling(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
-    const uint16 result = getObjectRelationship(GState->operands[0], 5);
-    WRITEUI16(store, result);
+    const uint8 storeid = *(GState->pc++);
+    const uint16 result = getObjectRelative(GState->operands[0], OBJREL_SIBLING);
+    storeVariable(storeid, result, 0);
     doBranch((result != 0) ? 1: 0);
 }
 
 static void opcode_get_child(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
-    const uint16 result = getObjectRelationship(GState->operands[0], 6);
-    WRITEUI16(store, result);
+    const uint8 storeid = *(GState->pc++);
+    const uint16 result = getObjectRelative(GState->operands[0], OBJREL_CHILD);
+    storeVariable(storeid, result, 0);
     doBranch((result != 0) ? 1: 0);
 }
 
@@ -904,27 +1979,98 @@ static char decode_zscii_char(const uint16 val)
     return ch;
 }
 
+// decode_zscii() unpacks this many Z-words at a time.
+#define ZCHAR_CHUNK_WORDS 32
+
+// Unpack up to ZCHAR_CHUNK_WORDS Z-words at `str` into one z-char per byte,
+//  stopping after the word with the top bit set (there is no NULL terminator)
+//  and setting *_done if we find it. Returns the number of words unpacked.
+static uint32 unpackZChars(const uint8 *str, uint8 *zchars, int *_done)
+{
+    uint32 numwords = 0;
+
+    #if MOJOZORK_SIMD
+    // vector loads read 16 bytes at a time, so only use them where that can't
+    //  run off the end of Z-Machine memory. Once we see the end of the string
+    //  coming up, plain C finishes it off, so short strings don't pay for
+    //  unpacking words they don't use.
+    const uintptr storyaddr = ((uintptr) str) - ((uintptr) GState->story);
+    const uintptr avail = (((uintptr) str >= (uintptr) GState->story) && (storyaddr < GState->story_len)) ? (GState->story_len - storyaddr) : 0;
+    while (((numwords + 8) <= ZCHAR_CHUNK_WORDS) && (((numwords * sizeof (uint16)) + 16) <= avail)) {
+        const uint8 *src = str + (numwords * sizeof (uint16));
+        uint8 *dst = zchars + (numwords * 3);
+        #if MOJOZORK_SIMD_SSE2
+        const __m128i raw = _mm_loadu_si128((const __m128i *) src);
+        if (_mm_movemask_epi8(raw) & 0x5555) {  // top bit of each (big endian) word's first byte.
+            break;  // the end of the string is in here.
+        }
+        const __m128i words = _mm_or_si128(_mm_slli_epi16(raw, 8), _mm_srli_epi16(raw, 8));  // byteswap to native words.
+        const __m128i mask = _mm_set1_epi16(0x1F);
+        uint8 lanes[32];
+        _mm_storeu_si128((__m128i *) lanes, _mm_packus_epi16(_mm_and_si128(_mm_srli_epi16(words, 10), mask), _mm_and_si128(_mm_srli_epi16(words, 5), mask)));
+        _mm_storeu_si128((__m128i *) (lanes + 16), _mm_packus_epi16(_mm_and_si128(words, mask), _mm_setzero_si128()));
+        for (int i = 0; i < 8; i++) {  // SSE2 can't interleave bytes three ways, so do that part by hand.
+            dst[(i * 3) + 0] = lanes[i];
+            dst[(i * 3) + 1] = lanes[i + 8];
+            dst[(i * 3) + 2] = lanes[i + 16];
+        }
+        #elif MOJOZORK_SIMD_NEON
+        const uint16x8_t words = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(src)));  // byteswap to native words.
+        if (vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(vshrq_n_u16(words, 15))), 0)) {
+            break;  // the end of the string is in here.
+        }
+        const uint16x8_t mask = vdupq_n_u16(0x1F);
+        uint8x8x3_t lanes;
+        lanes.val[0] = vmovn_u16(vandq_u16(vshrq_n_u16(words, 10), mask));
+        lanes.val[1] = vmovn_u16(vandq_u16(vshrq_n_u16(words, 5), mask));
+        lanes.val[2] = vmovn_u16(vandq_u16(words, mask));
+        vst3_u8(dst, lanes);  // interleaves them, three z-chars per word.
+        #endif
+        numwords += 8;
+    }
+    #endif
+
+    // plain C for whatever is left (or everything, without SIMD).
+    while (numwords < ZCHAR_CHUNK_WORDS) {
+        const uint8 *src = str + (numwords * sizeof (uint16));
+        const uint16 code = READUI16(src);
+        uint8 *dst = zchars + (numwords * 3);
+        dst[0] = (uint8) ((code >> 10) & 0x1F);  // characters are 5 bits each, packed three to a 16-bit word.
+        dst[1] = (uint8) ((code >> 5) & 0x1F);
+        dst[2] = (uint8) (code & 0x1F);
+        numwords++;
+        if (code & (1<<15)) {
+            *_done = 1;
+            break;
+        }
+    }
+
+    return numwords;
+}
+
 static uintptr decode_zscii(const uint8 *_str, const int abbr, char *buf, uintptr *_buflen)
 {
     // ZCSII encoding is so nasty.
     uintptr buflen = *_buflen;
     uintptr decoded_chars = 0;
     const uint8 *str = _str;
-    uint16 code = 0;
     uint8 alphabet = 0;
     uint8 useAbbrTable = 0;
     uint8 zscii_collector = 0;
     uint16 zscii_code = 0;
+    uint8 zchars[ZCHAR_CHUNK_WORDS * 3];
+    int done = 0;
 
-    do {
-        code = READUI16(str);
+    // unpack the z-chars a chunk at a time, then run the alphabet and abbreviation state machine over them.
+    while (!done) {
+        const uint32 numwords = unpackZChars(str, zchars, &done);
+        const uint32 numzchars = numwords * 3;
+        str += numwords * sizeof (uint16);
 
-        // characters are 5 bits each, packed three to a 16-bit word.
-        sint8 i;
-        for (i = 10; i >= 0; i -= 5) {
+        for (uint32 i = 0; i < numzchars; i++) {
             int newshift = 0;
             char printVal = 0;
-            const uint8 ch = ((code >> i) & 0x1F);
+            const uint8 ch = zchars[i];
 
             if (zscii_collector) {
                 if (zscii_collector == 2) {
@@ -951,12 +2097,17 @@ static uintptr decode_zscii(const uint8 *_str, const int abbr, char *buf, uintpt
                 if (abbr) {
                     GState->die("Abbreviation strings can't use abbreviations");
                 }
-                //FIXME("Make sure offset is sane");
                 const uintptr index = ((32 * (((uintptr) useAbbrTable) - 1)) + (uintptr) ch);
-                const uint8 *ptr = (GState->story + GState->header.abbrtab_addr) + (index * sizeof (uint16));
-                const uint16 abbraddr = READUI16(ptr);
                 uintptr abbr_decoded_chars = buflen;
-                decode_zscii(GState->story + (abbraddr * sizeof (uint16)), 1, buf, &abbr_decoded_chars);
+                if (GState->abbreviations) {  // already decoded by initAbbreviations().
+                    abbr_decoded_chars = GState->abbreviation_lengths[index];
+                    memcpy(buf, GState->abbreviations + GState->abbreviation_offsets[index], (buflen < abbr_decoded_chars) ? buflen : abbr_decoded_chars);
+                } else {
+                    //FIXME("Make sure offset is sane");
+                    const uint8 *ptr = (GState->story + GState->header.abbrtab_addr) + (index * sizeof (uint16));
+                    const uint16 abbraddr = READUI16(ptr);
+                    decode_zscii(GState->story + (abbraddr * sizeof (uint16)), 1, buf, &abbr_decoded_chars);
+                }
                 decoded_chars += abbr_decoded_chars;
                 buf += (buflen < abbr_decoded_chars) ? buflen : abbr_decoded_chars;
                 buflen = (buflen < abbr_decoded_chars) ? 0 : (buflen - abbr_decoded_chars);
@@ -1018,16 +2169,201 @@ static uintptr decode_zscii(const uint8 *_str, const int abbr, char *buf, uintpt
                 alphabet = 0;
             }
         }
-
-        // there is no NULL terminator, you look for a word with the top bit set.
-    } while ((code & (1<<15)) == 0);
+    }
 
     *_buflen = decoded_chars;
     return str - _str;
 }
 
+#if MOJOZORK_STRING_CACHE
+static ZStringCache *createStringCache(void)
+{
+    ZStringCache *cache = (ZStringCache *) calloc(1, sizeof (ZStringCache));
+    if (cache) {
+        cache->refcount = 1;
+    }
+    return cache;
+}
+
+static void releaseStringCache(ZStringCache *cache)
+{
+    if (cache && (--cache->refcount == 0)) {
+        for (uint32 i = 0; i < cache->size; i++) {
+            free(cache->table[i]);
+        }
+        free(cache->table);
+        free(cache);
+    }
+}
+
+// Make `state` use `cache` for decoded strings, dropping whatever it had
+//  before. Only do this if every state sharing a cache is running the same story!
+static inline void shareStringCache(ZMachineState *state, ZStringCache *cache)
+{
+    cache->refcount++;
+    releaseStringCache(state->string_cache);
+    state->string_cache = cache;
+}
+
+// returns the hashtable slot for addr, which might be NULL.
+static ZDecodedString **findDecodedString(ZStringCache *cache, const uint32 addr)
+{
+    ZDecodedString **table = cache->table;
+    const uint32 mask = cache->size - 1;
+    uint32 i = (addr >> 1) & mask;  // strings are usually word-aligned.
+    while (table[i] && (table[i]->addr != addr)) {
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+static int growStringCache(ZStringCache *cache)
+{
+    ZDecodedString **oldtable = cache->table;
+    const uint32 oldsize = cache->size;
+    const uint32 newsize = oldsize ? (oldsize * 2) : 1024;
+    ZDecodedString **newtable = (ZDecodedString **) calloc(newsize, sizeof (ZDecodedString *));
+    if (!newtable) {
+        return 0;
+    }
+
+    cache->table = newtable;
+    cache->size = newsize;
+    for (uint32 i = 0; i < oldsize; i++) {
+        if (oldtable[i]) {
+            *findDecodedString(cache, oldtable[i]->addr) = oldtable[i];
+        }
+    }
+
+    free(oldtable);
+    return 1;
+}
+
+// Returns the decoded string at `str`, decoding and caching it first if
+//  necessary. Returns NULL if it can't be cached (it's not in Z-Machine
+//  memory, or we're out of memory), in which case the caller should decode
+//  it directly.
+static const ZDecodedString *getDecodedString(const uint8 *str, const int abbr)
+{
+    const uintptr addr = ((uintptr) str) - ((uintptr) GState->story);
+    if (((uintptr) str < (uintptr) GState->story) || (addr >= GState->story_len)) {
+        return NULL;  // multizorkd keeps some things outside of Z-Machine memory.
+    }
+
+    ZStringCache *cache = GState->string_cache;
+    if (!cache) {
+        cache = GState->string_cache = createStringCache();
+        if (!cache) {
+            return NULL;
+        }
+    }
+
+    const ZDecodedString *decoded = cache->table ? *findDecodedString(cache, (uint32) addr) : NULL;
+    if (decoded && (!decoded->encoded || ((decoded->encoded_len <= (GState->story_len - addr)) && (memcmp(decoded->encoded, str, decoded->encoded_len) == 0)))) {
+        GState->string_cache_hits++;
+        return decoded;
+    }
+
+    GState->string_cache_misses++;
+
+    // decode it before touching the hashtable, since abbreviations might add to it, too.
+    char buf[512];
+    uintptr decoded_len = sizeof (buf);
+    const uintptr encoded_len = decode_zscii(str, abbr, buf, &decoded_len);
+    const uintptr copy_len = (addr < GState->header.staticmem_addr) ? encoded_len : 0;
+    ZDecodedString *entry = (ZDecodedString *) malloc(sizeof (ZDecodedString) + decoded_len + copy_len);
+    if (!entry) {
+        return NULL;
+    } else if (decoded_len <= sizeof (buf)) {
+        memcpy(entry->text, buf, decoded_len);
+    } else {
+        decode_zscii(str, abbr, entry->text, &decoded_len);  // too big for the stack buffer, do it again.
+    }
+
+    entry->addr = (uint32) addr;
+    entry->encoded_len = (uint32) encoded_len;
+    entry->decoded_len = (uint32) decoded_len;
+    entry->encoded = NULL;
+    if (copy_len) {
+        uint8 *encoded = ((uint8 *) entry->text) + decoded_len;
+        memcpy(encoded, str, copy_len);
+        entry->encoded = encoded;
+    }
+
+    if (((cache->used + 1) * 2) > cache->size) {  // keep it no more than half full so probing stays short.
+        if (!growStringCache(cache)) {
+            free(entry);
+            return NULL;
+        }
+    }
+
+    ZDecodedString **slot = findDecodedString(cache, (uint32) addr);
+    if (*slot) {
+        free(*slot);  // it was in dynamic memory, and changed. Replace it.
+    } else {
+        cache->used++;
+    }
+    *slot = entry;
+    return entry;
+}
+#endif
+
+// Decode every abbreviation once, back to back in one buffer, so
+//  decode_zscii() can just copy them. If this fails, decode_zscii() will
+//  decode each abbreviation as it comes up instead.
+static void initAbbreviations(void)
+{
+    free(GState->abbreviations);
+    GState->abbreviations = NULL;
+
+    const uint32 count = (GState->header.version >= 3) ? 96 : ((GState->header.version == 2) ? 32 : 0);  // ver1 has no abbreviations.
+    const uint32 tableaddr = (uint32) GState->header.abbrtab_addr;
+    if ((count == 0) || (tableaddr == 0) || ((tableaddr + (count * sizeof (uint16))) > GState->story_len)) {
+        return;
+    }
+
+    // figure out how big everything is first, then decode it for real.
+    uint32 total = 0;
+    const uint8 *ptr = GState->story + tableaddr;
+    for (uint32 i = 0; i < count; i++) {
+        const uint16 wordaddr = READUI16(ptr);  // abbreviations are stored as word addresses.
+        const uint32 abbraddr = ((uint32) wordaddr) * sizeof (uint16);
+        uintptr decoded_chars = 0;
+        if (abbraddr >= GState->story_len) {
+            return;  // let it die later, if the game actually uses it.
+        }
+        decode_zscii(GState->story + abbraddr, 1, NULL, &decoded_chars);
+        GState->abbreviation_offsets[i] = total;
+        GState->abbreviation_lengths[i] = (uint16) decoded_chars;
+        total += (uint32) decoded_chars;
+    }
+
+    char *pool = (char *) malloc(total ? total : 1);
+    if (!pool) {
+        return;
+    }
+
+    ptr = GState->story + tableaddr;
+    for (uint32 i = 0; i < count; i++) {
+        const uint16 wordaddr = READUI16(ptr);  // abbreviations are stored as word addresses.
+        const uint32 abbraddr = ((uint32) wordaddr) * sizeof (uint16);
+        uintptr decoded_chars = GState->abbreviation_lengths[i];
+        decode_zscii(GState->story + abbraddr, 1, pool + GState->abbreviation_offsets[i], &decoded_chars);
+    }
+
+    GState->abbreviations = pool;
+}
+
 static uintptr print_zscii(const uint8 *_str, const int abbr)
 {
+    #if MOJOZORK_STRING_CACHE
+    const ZDecodedString *decoded = getDecodedString(_str, abbr);
+    if (decoded) {
+        GState->writestr(decoded->text, decoded->decoded_len);
+        return decoded->encoded_len;
+    }
+    #endif
+
     char buf[512];
     char *ptr = buf;
     uintptr decoded_chars = sizeof (buf);
@@ -1098,7 +2434,7 @@ static void opcode_print_paddr(void)
     print_zscii(unpackAddress(GState->operands[0]), 0);
 }
 
-static sint32 random_seed = 0;
+static MOJOZORK_THREAD_LOCAL sint32 random_seed = 0;
 static int randomNumber(void)
 {
     // this is POSIX.1-2001's potentially bad suggestion, but we're not exactly doing cryptography here.
@@ -1125,10 +2461,100 @@ static uint16 doRandom(const sint16 range)
 
 static void opcode_random(void)
 {
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     const sint16 range = (sint16) GState->operands[0];
     const uint16 result = doRandom(range);
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
+}
+
+static uint64 dictionaryKey(const uint16 *encoded)
+{
+    return (((uint64) encoded[0]) << 32) | (((uint64) encoded[1]) << 16) | ((uint64) encoded[2]);
+}
+
+static int cmpDictionaryEntry(const void *a, const void *b)
+{
+    const ZDictionaryEntry *x = (const ZDictionaryEntry *) a;
+    const ZDictionaryEntry *y = (const ZDictionaryEntry *) b;
+    if (x->key != y->key) {
+        return (x->key < y->key) ? -1 : 1;
+    }
+    return (x->addr < y->addr) ? -1 : ((x->addr > y->addr) ? 1 : 0);  // keep duplicates in story order, so the first one wins like a linear search.
+}
+
+// Returns NULL if the dictionary can't be indexed (if it's in dynamic memory,
+//  the game could change it behind our back), or we're out of memory. In
+//  either case, tokenizing just searches the dictionary directly.
+static ZDictionaryIndex *createDictionaryIndex(void)
+{
+    const uint8 *seps = GState->story + GState->header.dict_addr;
+    const uint8 numseps = *(seps++);
+    const uint8 *dict = seps + numseps;
+    const uint8 entrylen = *(dict++);
+    const uint16 numentries = READUI16(dict);
+    const uint32 keylen = (GState->header.version <= 3) ? 4 : 6;
+    const uint32 dictstart = (uint32) GState->header.dict_addr;
+    const uint32 dictend = (uint32) (dict - GState->story) + (((uint32) numentries) * entrylen);
+
+    if ((dictstart < GState->header.staticmem_addr) || (dictend > GState->story_len) || (entrylen < keylen)) {
+        return NULL;
+    }
+
+    ZDictionaryIndex *index = (ZDictionaryIndex *) malloc(sizeof (ZDictionaryIndex) + (numentries * sizeof (ZDictionaryEntry)));
+    if (!index) {
+        return NULL;
+    }
+
+    index->refcount = 1;
+    index->num_entries = numentries;
+    for (uint16 i = 0; i < numentries; i++) {
+        const uint8 *ptr = dict + (i * entrylen);
+        uint16 encoded[3] = { 0, 0, 0 };
+        index->entries[i].addr = (uint32) (ptr - GState->story);
+        encoded[0] = READUI16(ptr);
+        encoded[1] = READUI16(ptr);
+        if (keylen > 4) {
+            encoded[2] = READUI16(ptr);
+        }
+        index->entries[i].key = dictionaryKey(encoded);
+    }
+
+    qsort(index->entries, numentries, sizeof (ZDictionaryEntry), cmpDictionaryEntry);
+    return index;
+}
+
+static void releaseDictionaryIndex(ZDictionaryIndex *index)
+{
+    if (index && (--index->refcount == 0)) {
+        free(index);
+    }
+}
+
+// Make `state` use `index` for tokenizing, dropping whatever it had before.
+//  Only do this if every state sharing an index is running the same story!
+static inline void shareDictionaryIndex(ZMachineState *state, ZDictionaryIndex *index)
+{
+    index->refcount++;
+    releaseDictionaryIndex(state->dictionary_index);
+    state->dictionary_index = index;
+}
+
+// returns the address of the dictionary entry for `encoded`, or 0 if there isn't one.
+static uint16 lookupDictionaryIndex(const ZDictionaryIndex *index, const uint16 *encoded)
+{
+    const uint64 key = dictionaryKey(encoded);
+    const ZDictionaryEntry *entries = index->entries;
+    uint32 lo = 0;
+    uint32 hi = index->num_entries;
+    while (lo < hi) {  // find the first entry that isn't less than key.
+        const uint32 mid = lo + ((hi - lo) / 2);
+        if (entries[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return ((lo < index->num_entries) && (entries[lo].key == key)) ? ((uint16) entries[lo].addr) : 0;
 }
 
 static void tokenizeUserInput(void)
@@ -1205,12 +2631,21 @@ static void tokenizeUserInput(void)
             encoded[1] |= ((pos < zchidx) ? zchars[pos++] : 5) << 5;
             encoded[1] |= ((pos < zchidx) ? zchars[pos++] : 5) << 0;
 
-            FIXME("this can binary search, since we know how many equal-sized records there are.");
             const uint8 *dictptr = dict;
             uint16 i;
             if (GState->header.version <= 3) {
                 encoded[1] |= 0x8000;
+            } else {
+                encoded[2] |= ((pos < zchidx) ? zchars[pos++] : 5) << 10;
+                encoded[2] |= ((pos < zchidx) ? zchars[pos++] : 5) << 5;
+                encoded[2] |= ((pos < zchidx) ? zchars[pos++] : 5) << 0;
+                encoded[2] |= 0x8000;
+            }
 
+            if (GState->dictionary_index) {
+                const uint16 addr = lookupDictionaryIndex(GState->dictionary_index, encoded);
+                dictptr = addr ? (GState->story + addr) : NULL;
+            } else if (GState->header.version <= 3) {
                 FIXME("byteswap 'encoded' and just memcmp here.");
                 for (i = 0; i < numentries; i++) {
                     const uint16 zscii1 = READUI16(dictptr);
@@ -1221,12 +2656,10 @@ static void tokenizeUserInput(void)
                     }
                     dictptr += (entrylen - 4);
                 }
+                if (i == numentries) {
+                    dictptr = NULL;  // not found.
+                }
             } else {
-                encoded[2] |= ((pos < zchidx) ? zchars[pos++] : 5) << 10;
-                encoded[2] |= ((pos < zchidx) ? zchars[pos++] : 5) << 5;
-                encoded[2] |= ((pos < zchidx) ? zchars[pos++] : 5) << 0;
-                encoded[2] |= 0x8000;
-
                 FIXME("byteswap 'encoded' and just memcmp here.");
                 for (i = 0; i < numentries; i++) {
                     const uint16 zscii1 = READUI16(dictptr);
@@ -1238,10 +2671,9 @@ static void tokenizeUserInput(void)
                     }
                     dictptr += (entrylen - 6);
                 }
-            }
-
-            if (i == numentries) {
-                dictptr = NULL;  // not found.
+                if (i == numentries) {
+                    dictptr = NULL;  // not found.
+                }
             }
 
             const uint16 dictaddr = dictptr ? ((unsigned int) (dictptr - GState->story)) : 0;
@@ -1269,6 +2701,10 @@ static void tokenizeUserInput(void)
     dbg("Tokenized %u tokens\n", (unsigned int) numtoks);
 
     *(GState->story + GState->operands[1] + 1) = numtoks;
+
+    // the text and parse buffers are in dynamic memory, so make sure the game didn't put them on top of the object table.
+    dynamicMemoryWritten(GState->operands[0], ((uint32) GState->story[GState->operands[0]]) + 1);
+    dynamicMemoryWritten(GState->operands[1], (((uint32) parselen) * 4) + 2);
 }
 
 static void opcode_read(void)
@@ -1301,6 +2737,7 @@ static void opcode_read(void)
         printf("%s", (const char *) input);
     } else if (script == NULL) {
         FIXME("fgets isn't really the right solution here.");
+        PROFILE_STOP();  // don't charge this opcode for the time spent waiting on the user.
         if (!fgets((char *) input, inputlen, stdin)) {
             GState->die("EOF or error on stdin during read");
         }
@@ -1372,6 +2809,12 @@ static void opcode_read(void)
         printf("*** random replied: %u\n", (unsigned int) val);
         opcode_read();  // go again.
         return;
+    #if MOJOZORK_PROFILING
+    } else if (strcmp((const char *) input, "#profile") == 0) {
+        profileReport(stdout);
+        opcode_read();  // go again.
+        return;
+    #endif
     }
 
     tokenizeUserInput();
@@ -1420,6 +2863,9 @@ static void opcode_restart(void)
     loadStory(GState->story_filename);
 }
 
+// savegames before "MOJOZORK1" always have this many stack entries.
+#define MOJOZORK0_SAVE_STACK_SIZE 2048
+
 static void opcode_save(void)
 {
     FIXME("this should write Quetzal format; this is temporary.");
@@ -1428,236 +2874,783 @@ static void opcode_save(void)
     FILE *io = fopen("save.dat", "wb");
     int okay = 1;
     okay &= io != NULL;
-    okay &= fwrite("MOJOZORK0\n", 10, 1, io) == 1;
+    okay &= fwrite("MOJOZORK1\n", 10, 1, io) == 1;
+    dynamicMemoryRead(0, GState->header.staticmem_addr);
     okay &= fwrite(GState->story, GState->header.staticmem_addr, 1, io) == 1;
     okay &= fwrite(&addr, sizeof (addr), 1, io) == 1;
     okay &= fwrite(&sp, sizeof (sp), 1, io) == 1;
-    okay &= fwrite(GState->stack, sizeof (GState->stack), 1, io) == 1;
+    okay &= (sp == 0) || (fwrite(GState->stack, sp * sizeof (uint16), 1, io) == 1);
     okay &= fwrite(&GState->bp, sizeof (GState->bp), 1, io) == 1;
     if (io) {
         fclose(io);
     }
-    doBranch(okay ? 1 : 0);
+    doBranch(okay ? 1 : 0);
+}
+
+static void opcode_restore(void)
+{
+    FIXME("this should read Quetzal format; this is temporary.");
+    FILE *io = fopen("save.dat", "rb");
+    int okay = 1;
+    uint32 x = 0;
+
+    okay &= io != NULL;
+
+    char header[10];
+    okay &= io != NULL;
+    okay &= fread(header, 10, 1, io) == 1;
+    const int fixed_stack = !okay || (memcmp(header, "MOJOZORK1\n", 10) != 0);  // older saves have the whole stack.
+    if (okay && fixed_stack && (memcmp(header, "MOJOZORK0\n", 10) != 0)) {
+        rewind(io);  // might be an older MojoZork savegame with no identifier...?
+    }
+    okay &= fread(GState->story, GState->header.staticmem_addr, 1, io) == 1;
+    dynamicMemoryReplaced(GState);
+    okay &= fread(&x, sizeof (x), 1, io) == 1;
+    GState->logical_pc = x;
+    GState->pc = GState->story + x;
+    okay &= fread(&x, sizeof (x), 1, io) == 1;
+    const uint32 stack_entries = fixed_stack ? MOJOZORK0_SAVE_STACK_SIZE : x;
+    okay &= (x <= stack_entries) && (stack_entries <= MAX_STACK_SIZE);
+    if (okay) {
+        growStack(GState->stack, stack_entries);
+        GState->sp = GState->stack + x;
+        okay &= (stack_entries == 0) || (fread(GState->stack, stack_entries * sizeof (uint16), 1, io) == 1);
+    }
+    okay &= fread(&GState->bp, sizeof (GState->bp), 1, io) == 1;
+    if (io) {
+        fclose(io);
+    }
+
+    if (!okay) {
+        GState->die("Failed to restore.");
+    }
+
+    // 8.6.1.3: Following a "restore" of the game, the interpreter should automatically collapse the upper window to size 0.
+    if (okay && GState->split_window) {
+        const uint16 oldval = GState->upper_window_line_count;
+        GState->upper_window_line_count = 0;
+        GState->split_window(oldval, 0);
+    }
+
+    doBranch(okay ? 1 : 0);
+}
+
+static void opcode_quit(void)
+{
+    GState->quit = 1;
+    GState->step_completed = 1;  // possibly time to break out of the Z-Machine simulation loop.
+}
+
+static void opcode_nop(void)
+{
+    // that's all, folks.
+}
+
+static void calculateStatusBar(char *buf, uint8 *highlight, size_t buflen)
+{
+    // if not a score game, then it's a time game.
+    const int score_game = (GState->header.version < 3) || ((GState->header.flags1 & (1<<1)) == 0);
+    const uint16 objid = globalValue(0);
+    const uint16 scoreval = globalValue(1);
+    const uint16 movesval = globalValue(2);
+    const uint8 *objzstr = getObjectShortName(objid);
+    const int short_score = (buflen < 50);  // this is a hack to make the C-64 UI in the libretro code look like the original.
+
+    char objstr[64];
+
+    if (highlight) {
+        memset(highlight, 0, buflen);
+    }
+
+    memset(buf, ' ', buflen - 1);
+    buf[buflen - 1] = '\0';
+
+    objstr[0] = '\0';
+    if (objzstr) {
+        uintptr decoded_chars = sizeof (objstr) - 1;
+        decode_zscii(objzstr, 0, objstr, &decoded_chars);
+        objstr[(decoded_chars < sizeof (objstr)) ? decoded_chars : sizeof (objstr) - 1] = '\0';
+    }
+
+    const int scoremovelen = short_score ?
+                                (score_game ? (3 + 4 + 8) : (2 + 2 + 9)) :
+                                (score_game ? (3 + 4 + 20) : (2 + 2 + 16));
+    if (buflen < scoremovelen) {
+        return;  // oh well.
+    }
+
+    const int maxobjlen = (buflen > scoremovelen) ? (buflen - scoremovelen) : 0;
+    if (strlen(objstr) > maxobjlen) {
+        if (maxobjlen < 3) {
+            objstr[0] = '\0';
+        } else {
+            objstr[maxobjlen] = '\0';
+            objstr[maxobjlen - 1] = '.';
+            objstr[maxobjlen - 2] = '.';
+            objstr[maxobjlen - 3] = '.';
+        }
+    }
+
+    snprintf(buf, buflen, "%s", objstr);
+    const int slen = strlen(buf);
+    buf[slen] = ' ';
+    if (highlight) {
+        memset(highlight, 1, slen);
+    }
+
+    int scorestrlen = 0;
+    if (score_game) {
+        if (short_score) {
+            scorestrlen = snprintf((buf + buflen) - scoremovelen, scoremovelen, "Score: %d/%u", (int) scoreval, (unsigned int) movesval);
+        } else {
+            scorestrlen = snprintf((buf + buflen) - scoremovelen, scoremovelen, "     Score:%-3d  Moves:%-4u", (int) scoreval, (unsigned int) movesval);
+        }
+    } else {
+        if (short_score) {
+            scorestrlen = snprintf((buf + buflen) - scoremovelen, scoremovelen, "Time: %2u:%02u %s", (unsigned int) (scoreval % 12) + 1, (unsigned int) movesval, (scoreval < 12) ? "am" : "pm");
+        } else {
+            scorestrlen = snprintf((buf + buflen) - scoremovelen, scoremovelen, "     Time: %2u:%02u %s", (unsigned int) (scoreval % 12) + 1, (unsigned int) movesval, (scoreval < 12) ? "am" : "pm");
+        }
+    }
+
+    if (highlight) {
+        memset((highlight + buflen) - scoremovelen, 1, scorestrlen);
+        if (short_score) {
+            highlight[(buflen - scoremovelen) + (score_game ? 6 : 5)] = 2;
+        }
+    }
+}
+
+static void updateStatusBar(void)
+{
+    if (GState->status_bar && GState->status_bar_len && GState->status_bar_enabled) {
+        calculateStatusBar(GState->status_bar, GState->status_bar_char_highlight, GState->status_bar_len);
+    }
+}
+
+// decode an operand of type `optype` at `ptr` into the next slot of insn->operands.
+//  Variables aren't looked up here, since reading the stack pops it; we just
+//  note which operands need to be looked up when the instruction runs.
+//  Returns a pointer past the operand, or NULL if the operand was omitted.
+static const uint8 *decodeOperand(const uint8 optype, const uint8 *ptr, ZDecodedInstruction *insn)
+{
+    const uint8 i = insn->operand_count;
+    switch (optype) {
+        case 0: insn->operands[i] = (uint16) READUI16(ptr); break;  // large constant (uint16)
+        case 1: insn->operands[i] = *(ptr++); break;  // small constant (uint8)
+        case 2:  // variable
+            insn->operands[i] = *(ptr++);
+            insn->variable_operands |= (1 << i);
+            insn->operand_classes |= ((uint16) variableClass((uint8) insn->operands[i])) << (i * 2);
+            break;
+        case 3: return NULL;  // omitted altogether, we're done.
+    }
+
+    insn->operand_count++;
+    return ptr;
+}
+
+static const uint8 *decodeVarOperands(const uint8 *ptr, ZDecodedInstruction *insn)
+{
+    const uint8 operandTypes = *(ptr++);
+    uint8 shifter = 6;
+
+    for (uint8 i = 0; i < 4; i++) {
+        const uint8 *next = decodeOperand((operandTypes >> shifter) & 0x3, ptr, insn);
+        if (!next) {
+            break;
+        }
+        ptr = next;
+        shifter -= 2;
+    }
+
+    return ptr;
+}
+
+#if MOJOZORK_THREADED_ENGINE
+// which of the threaded engine's inline handlers can run this opcode? If a
+//  target replaced an opcode's function, we call theirs instead.
+static uint8 engineOpForFunction(const OpcodeFn fn)
+{
+    #define ENGINEOP(name, opname) if (fn == opcode_##opname) { return ENGINEOP_##name; }
+    ENGINEOP(JE, je);
+    ENGINEOP(JL, jl);
+    ENGINEOP(JG, jg);
+    ENGINEOP(JZ, jz);
+    ENGINEOP(TEST, test);
+    ENGINEOP(OR, or);
+    ENGINEOP(AND, and);
+    ENGINEOP(NOT, not);
+    ENGINEOP(ADD, add);
+    ENGINEOP(SUB, sub);
+    ENGINEOP(MUL, mul);
+    ENGINEOP(DIV, div);
+    ENGINEOP(MOD, mod);
+    ENGINEOP(INC, inc);
+    ENGINEOP(DEC, dec);
+    ENGINEOP(INC_CHK, inc_chk);
+    ENGINEOP(DEC_CHK, dec_chk);
+    ENGINEOP(STORE, store);
+    ENGINEOP(LOAD, load);
+    ENGINEOP(LOADW, loadw);
+    ENGINEOP(LOADB, loadb);
+    ENGINEOP(STOREW, storew);
+    ENGINEOP(STOREB, storeb);
+    ENGINEOP(PUSH, push);
+    ENGINEOP(PULL, pull);
+    ENGINEOP(POP, pop);
+    ENGINEOP(JUMP, jump);
+    ENGINEOP(CALL, call);
+    ENGINEOP(RET, ret);
+    ENGINEOP(RTRUE, rtrue);
+    ENGINEOP(RFALSE, rfalse);
+    ENGINEOP(RET_POPPED, ret_popped);
+    ENGINEOP(NOP, nop);
+    #if MOJOZORK_SUPERINSTRUCTIONS
+    ENGINEOP(TEST_ATTR, test_attr);
+    #endif
+    #undef ENGINEOP
+    return ENGINEOP_GENERIC;
+}
+#endif
+
+// Pick apart the instruction at logical_pc without running it. This doesn't
+//  change any VM state, so it can be done ahead of time.
+static void decodeInstruction(const uint32 logical_pc, ZDecodedInstruction *insn)
+{
+    const uint8 *start = GState->story + logical_pc;
+    const uint8 *ptr = start;
+    uint8 opcode = *(ptr++);
+    const Opcode *op = NULL;
+
+    insn->logical_pc = logical_pc;
+    insn->next = NULL;
+    insn->branch_next = NULL;
+    insn->variable_operands = 0;
+    insn->operand_classes = 0;
+    insn->operand_count = 0;
+    insn->store = 0;
+    insn->store_class = VARCLASS_CONSTANT;
+    insn->branch_on_truth = 0;
+    insn->branch_offset = 0;
+    insn->fused_count = 0;
+    insn->fused_operand_count = 0;
+    insn->fused_variable_operands = 0;
+    insn->fused_branch_on_truth = 0;
+    insn->fused_branch_offset = 0;
+    insn->fused_offsets[0] = insn->fused_offsets[1] = 0;
+    insn->fused_len = 0;
+    memset(insn->fused_operands, '\0', sizeof (insn->fused_operands));
+
+    const int extended = ((opcode == 190) && (GState->header.version >= 5)) ? 1 : 0;
+    if (extended) {
+        opcode = *(ptr++);
+        if (opcode >= (sizeof (GState->extended_opcodes) / sizeof (GState->extended_opcodes[0]))) {
+            GState->die("Unsupported or unknown extended opcode #%u", (unsigned int) opcode);
+        }
+        ptr = decodeVarOperands(ptr, insn);
+        op = &GState->extended_opcodes[opcode];
+    } else {
+        if (opcode <= 127) {   // 2OP
+            ptr = decodeOperand(((opcode >> 6) & 0x1) ? 2 : 1, ptr, insn);
+            ptr = decodeOperand(((opcode >> 5) & 0x1) ? 2 : 1, ptr, insn);
+        } else if (opcode <= 175) {  // 1OP
+            ptr = decodeOperand((opcode >> 4) & 0x3, ptr, insn);
+        } else if (opcode <= 191) {  // 0OP
+            // nothing to decode.
+        } else if (opcode > 191) {  // VAR
+            const int takes8 = ((opcode == 236) || (opcode == 250));  // call_vs2 and call_vn2 take up to EIGHT arguments!
+            ptr = decodeVarOperands(ptr, insn);
+            if (takes8) {
+                if (insn->operand_count == 4) {
+                    ptr = decodeVarOperands(ptr, insn);
+                } else {
+                    ptr++;  // skip the next byte, since we don't have any more args.
+                }
+            }
+        }
+
+        op = &GState->opcodes[opcode];
+    }
+
+    insn->opcode = opcode;
+    insn->extended = (uint8) extended;
+    insn->operands_len = (uint8) (ptr - start);
+
+    // the opcode handlers read these themselves, but it's useful to know
+    //  where the instruction ends without running it.
+    if (op->flags & OPFLAG_STORE) {
+        insn->store = *(ptr++);
+        insn->store_class = variableClass(insn->store);
+    }
+
+    if (op->flags & OPFLAG_BRANCH) {
+        const uint8 branch = *(ptr++);
+        sint16 offset = (sint16) (branch & 0x3F);
+        insn->branch_on_truth = (branch & (1<<7)) ? 1 : 0;
+        if ((branch & (1<<6)) == 0) {  // far jump?
+            if (offset & (1 << 5)) {
+                offset |= 0xC0;   // extend out sign bit.
+            }
+            offset = (offset << 8) | ((sint16) *(ptr++));
+        }
+        insn->branch_offset = offset;
+    }
+
+    if (op->flags & OPFLAG_TEXT) {  // skip the ZSCII string; the last word has the high bit set.
+        const uint8 *end = GState->story + GState->story_len;
+        while ((ptr + 1) < end) {
+            const uint16 code = READUI16(ptr);
+            if (code & 0x8000) {
+                break;
+            }
+        }
+    }
+
+    insn->len = (uint16) (ptr - start);
+
+    #if MOJOZORK_THREADED_ENGINE
+    insn->engine_op = extended ? ENGINEOP_GENERIC : engineOpForFunction(op->fn);
+    #else
+    insn->engine_op = ENGINEOP_GENERIC;
+    #endif
+}
+
+// decoded instructions don't point into the opcode table, since they might
+//  be shared between ZMachineStates. Look it up in the current one.
+static inline const Opcode *instructionOpcode(const ZDecodedInstruction *insn)
+{
+    return insn->extended ? &GState->extended_opcodes[insn->opcode] : &GState->opcodes[insn->opcode];
+}
+
+#if MOJOZORK_DECODE_CACHE
+// the longest an instruction can be, not counting inline strings.
+//  (opcode, extended opcode, two operand type bytes, eight word operands, store, two branch bytes.)
+#define MAX_INSTRUCTION_LEN (1 + 1 + 2 + (8 * 2) + 1 + 2)
+
+// the most instructions we'll decode into one translation. If a routine is
+//  bigger than this, the rest of it gets translated when we get there.
+#define MAX_TRANSLATION_INSTRUCTIONS 1024
+
+static ZDecodeCache *createDecodeCache(void)
+{
+    ZDecodeCache *cache = (ZDecodeCache *) calloc(1, sizeof (ZDecodeCache));
+    if (cache) {
+        cache->refcount = 1;
+    }
+    return cache;
+}
+
+// throw away every translation, but keep the cache itself around.
+static void flushDecodeCache(ZDecodeCache *cache)
+{
+    ZTranslation *next = NULL;
+    for (ZTranslation *translation = cache->translations; translation; translation = next) {
+        next = translation->next_translation;
+        free(translation);
+    }
+
+    free(cache->table);
+    cache->table = NULL;
+    cache->size = 0;
+    cache->used = 0;
+    cache->translations = NULL;
+    cache->num_translations = 0;
+    cache->num_instructions = 0;
+    cache->flushes++;
+}
+
+static void releaseDecodeCache(ZDecodeCache *cache)
+{
+    if (cache && (--cache->refcount == 0)) {
+        flushDecodeCache(cache);
+        free(cache);
+    }
 }
 
-static void opcode_restore(void)
+// Make `state` use `cache` for decoded instructions, dropping whatever it
+//  had before. Only do this if every state sharing a cache is running the
+//  same story with the same opcode handlers, since translations bake in both!
+static inline void shareDecodeCache(ZMachineState *state, ZDecodeCache *cache)
 {
-    FIXME("this should read Quetzal format; this is temporary.");
-    FILE *io = fopen("save.dat", "rb");
-    int okay = 1;
-    uint32 x = 0;
-
-    okay &= io != NULL;
+    cache->refcount++;
+    releaseDecodeCache(state->decode_cache);
+    state->decode_cache = cache;
+}
 
-    char header[10];
-    okay &= io != NULL;
-    okay &= fread(header, 10, 1, io) == 1;
-    if (okay && (memcmp(header, "MOJOZORK0\n", 10) != 0)) {
-        rewind(io);  // might be an older MojoZork savegame with no identifier...?
-    }
-    okay &= fread(GState->story, GState->header.staticmem_addr, 1, io) == 1;
-    okay &= fread(&x, sizeof (x), 1, io) == 1;
-    GState->logical_pc = x;
-    GState->pc = GState->story + x;
-    okay &= fread(&x, sizeof (x), 1, io) == 1;
-    GState->sp = GState->stack + x;
-    okay &= fread(GState->stack, sizeof (GState->stack), 1, io) == 1;
-    okay &= fread(&GState->bp, sizeof (GState->bp), 1, io) == 1;
-    if (io) {
-        fclose(io);
+// returns the hashtable slot for logical_pc, which might be NULL.
+static ZDecodedInstruction **findDecodedInstruction(ZDecodeCache *cache, const uint32 logical_pc)
+{
+    ZDecodedInstruction **table = cache->table;
+    const uint32 mask = cache->size - 1;
+    uint32 i = logical_pc & mask;
+    while (table[i] && (table[i]->logical_pc != logical_pc)) {
+        i = (i + 1) & mask;
     }
+    return &table[i];
+}
 
-    if (!okay) {
-        GState->die("Failed to restore.");
+static void growDecodeCache(ZDecodeCache *cache)
+{
+    ZDecodedInstruction **oldtable = cache->table;
+    const uint32 oldsize = cache->size;
+    const uint32 newsize = oldsize ? (oldsize * 2) : 4096;
+    ZDecodedInstruction **newtable = (ZDecodedInstruction **) calloc(newsize, sizeof (ZDecodedInstruction *));
+    if (!newtable) {
+        GState->die("Out of memory");
     }
 
-    // 8.6.1.3: Following a "restore" of the game, the interpreter should automatically collapse the upper window to size 0.
-    if (okay && GState->split_window) {
-        const uint16 oldval = GState->upper_window_line_count;
-        GState->upper_window_line_count = 0;
-        GState->split_window(oldval, 0);
+    cache->table = newtable;
+    cache->size = newsize;
+    for (uint32 i = 0; i < oldsize; i++) {
+        if (oldtable[i]) {
+            *findDecodedInstruction(cache, oldtable[i]->logical_pc) = oldtable[i];
+        }
     }
 
-    doBranch(okay ? 1 : 0);
+    free(oldtable);
 }
 
-static void opcode_quit(void)
+#if MOJOZORK_SUPERINSTRUCTIONS
+// the most instructions we'll fuse into one superinstruction.
+#define MAX_FUSED_INSTRUCTIONS 3
+
+// See if the instructions after this one can be run as part of it. We only
+//  do this for cached instructions, since code in static memory can't change.
+//  Everything is still checked at runtime exactly as if the instructions
+//  ran separately, we just skip dispatching and decoding between them.
+static void fuseInstructions(ZDecodedInstruction *insn)
 {
-    GState->quit = 1;
-    GState->step_completed = 1;  // possibly time to break out of the Z-Machine simulation loop.
+    const Opcode *op = instructionOpcode(insn);
+    ZDecodedInstruction next;
+    uint32 next_pc = insn->logical_pc + insn->len;
+
+    // don't decode past the end of the story, or into an extended opcode (which can die if it's garbage).
+    if (((next_pc + (MAX_INSTRUCTION_LEN * MAX_FUSED_INSTRUCTIONS)) >= GState->story_len) || (GState->story[next_pc] == 190)) {
+        return;
+    }
+
+    decodeInstruction(next_pc, &next);
+
+    const int stores_without_branching = ((op->flags & (OPFLAG_STORE|OPFLAG_BRANCH)) == OPFLAG_STORE);
+    const int next_tests_store = (next.variable_operands & 1) && (next.operands[0] == insn->store);
+
+    if ((insn->engine_op == ENGINEOP_GENERIC) && op->fn && stores_without_branching && (next.engine_op == ENGINEOP_JZ) && next_tests_store) {
+        insn->engine_op = ENGINEOP_FUSED_JZ;  // get_prop, get_prop_addr, get_parent, etc, then jz.
+    } else if ((insn->engine_op == ENGINEOP_LOADW) && (next.engine_op == ENGINEOP_JZ) && next_tests_store) {
+        insn->engine_op = ENGINEOP_LOADW_JZ;
+    } else if ((insn->engine_op == ENGINEOP_LOADW) && (next.engine_op == ENGINEOP_JE) && next_tests_store && (next.variable_operands == 1) && (next.operand_count >= 2)) {
+        insn->engine_op = ENGINEOP_LOADW_JE;
+        insn->fused_operand_count = next.operand_count - 1;
+        for (uint8 i = 1; i < next.operand_count; i++) {
+            insn->fused_operands[i-1] = next.operands[i];
+        }
+    } else if ((insn->engine_op == ENGINEOP_STORE) && (next.engine_op == ENGINEOP_STORE)) {
+        insn->engine_op = ENGINEOP_STORE_STORE;
+        insn->fused_operand_count = 0;
+        insn->fused_variable_operands = 0;
+        while (1) {
+            const uint8 i = insn->fused_operand_count;
+            insn->fused_operands[i] = next.operands[0];
+            insn->fused_operands[i+1] = next.operands[1];
+            insn->fused_variable_operands |= (next.variable_operands & 0x3) << i;
+            insn->fused_operand_count += 2;
+            insn->fused_offsets[insn->fused_count++] = (uint8) (next_pc - insn->logical_pc);
+            next_pc += next.len;
+            if ((insn->fused_count + 1) >= MAX_FUSED_INSTRUCTIONS) {
+                break;
+            } else if (GState->story[next_pc] == 190) {
+                break;
+            }
+            decodeInstruction(next_pc, &next);
+            if (next.engine_op != ENGINEOP_STORE) {
+                break;
+            }
+        }
+        insn->fused_len = (uint16) (next_pc - insn->logical_pc);
+        return;
+    } else {
+        return;  // nothing to fuse.
+    }
+
+    insn->fused_count = 1;
+    insn->fused_offsets[0] = insn->len;
+    insn->fused_branch_on_truth = next.branch_on_truth;
+    insn->fused_branch_offset = next.branch_offset;
+    insn->fused_len = (uint16) ((next_pc + next.len) - insn->logical_pc);
 }
+#endif
 
-static void opcode_nop(void)
+// does this instruction ever continue on to the next one in memory?
+static int instructionFallsThrough(const ZDecodedInstruction *insn)
 {
-    // that's all, folks.
+    const uint8 opcode = insn->opcode;
+    if (insn->extended) {
+        return 1;
+    } else if ((opcode >= 128) && (opcode <= 175)) {  // 1OP
+        const uint8 op1 = opcode & 0xF;
+        return ((op1 != 11) && (op1 != 12)) ? 1 : 0;  // ret, jump
+    }
+
+    switch (opcode) {
+        case 176:  // rtrue
+        case 177:  // rfalse
+        case 179:  // print_ret
+        case 183:  // restart
+        case 184:  // ret_popped
+        case 186:  // quit
+            return 0;
+        default: break;
+    }
+
+    return instructionOpcode(insn)->name ? 1 : 0;  // if it's garbage, don't decode past it.
 }
 
-static int parseOperand(const uint8 optype, uint16 *operand)
+// where a taken branch or jump lands, or zero if it returns instead, or we
+//  can't know until it runs.
+static uint32 instructionBranchTarget(const ZDecodedInstruction *insn)
 {
-    switch (optype) {
-        case 0: *operand = (uint16) READUI16(GState->pc); return 1;  // large constant (uint16)
-        case 1: *operand = *(GState->pc++); return 1;  // small constant (uint8)
-        case 2: { // variable
-            const uint8 *addr = varAddress(*(GState->pc++), 0, 0);
-            *operand = READUI16(addr);
-            return 1;
+    const sint32 end = (sint32) (insn->logical_pc + insn->len);
+    if (instructionOpcode(insn)->flags & OPFLAG_BRANCH) {
+        if ((insn->branch_offset == 0) || (insn->branch_offset == 1)) {
+            return 0;  // return false/true from current routine.
         }
-        case 3: break;  // omitted altogether, we're done.
+        return (uint32) ((end + insn->branch_offset) - 2);
+    } else if (!insn->extended && (insn->opcode >= 128) && (insn->opcode <= 175) && ((insn->opcode & 0xF) == 12) && !(insn->variable_operands & 1)) {  // jump
+        return (uint32) ((end + ((sint16) insn->operands[0])) - 2);
     }
-
     return 0;
 }
 
-static uint8 parseVarOperands(uint16 *operands)
+static int cmpDecodedInstruction(const void *a, const void *b)
 {
-    const uint8 operandTypes = *(GState->pc++);
-    uint8 shifter = 6;
-    uint8 i;
+    const uint32 x = ((const ZDecodedInstruction *) a)->logical_pc;
+    const uint32 y = ((const ZDecodedInstruction *) b)->logical_pc;
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
 
-    for (i = 0; i < 4; i++) {
-        const uint8 optype = (operandTypes >> shifter) & 0x3;
-        shifter -= 2;
-        if (!parseOperand(optype, operands + i)) {
-            break;
+static const ZDecodedInstruction *findTranslatedInstruction(const ZTranslation *translation, const uint32 logical_pc)
+{
+    uint32 lo = 0;
+    uint32 hi = translation->num_instructions;
+    while (lo < hi) {
+        const uint32 mid = lo + ((hi - lo) / 2);
+        const ZDecodedInstruction *insn = &translation->instructions[mid];
+        if (insn->logical_pc == logical_pc) {
+            return insn;
+        } else if (insn->logical_pc < logical_pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
-
-    return i;
+    return NULL;
 }
 
-static void calculateStatusBar(char *buf, uint8 *highlight, size_t buflen)
+// Decode everything reachable from entry_pc (usually the first instruction
+//  of a routine) without leaving the routine, following branches and jumps
+//  but not calls, and stopping at anything that's already translated.
+static void translateCode(const uint32 entry_pc)
 {
-    // if not a score game, then it's a time game.
-    const int score_game = (GState->header.version < 3) || ((GState->header.flags1 & (1<<1)) == 0);
-    const uint8 *addr = varAddress(0x10, 0, 0);
-    const uint16 objid = READUI16(addr);
-    const uint16 scoreval = READUI16(addr);
-    const uint16 movesval = READUI16(addr);
-    const uint8 *objzstr = getObjectShortName(objid);
-    const int short_score = (buflen < 50);  // this is a hack to make the C-64 UI in the libretro code look like the original.
-
-    char objstr[64];
+    ZDecodeCache *cache = GState->decode_cache;
+    const uint8 *story = GState->story;
+    ZDecodedInstruction *decoded = NULL;
+    uint32 num_decoded = 0;
+    uint32 decoded_allocated = 0;
+    uint32 pending[MAX_TRANSLATION_INSTRUCTIONS];  // every decoded instruction adds at most one branch target here.
+    uint32 num_pending = 0;
+
+    pending[num_pending++] = entry_pc;
+    while (num_pending && (num_decoded < MAX_TRANSLATION_INSTRUCTIONS)) {
+        uint32 pc = pending[--num_pending];
+        while (num_decoded < MAX_TRANSLATION_INSTRUCTIONS) {
+            if (num_decoded > 0) {  // the entry point always gets decoded, we're here because something wants to run it.
+                if (pc < GState->header.staticmem_addr) {
+                    break;  // dynamic memory can change, don't cache it.
+                } else if ((pc + MAX_INSTRUCTION_LEN) >= GState->story_len) {
+                    break;  // don't decode past the end of the story.
+                } else if ((story[pc] == 190) && (GState->header.version >= 5)) {
+                    break;  // extended opcodes can die if they're garbage; we'll get it when it runs.
+                } else if (*findDecodedInstruction(cache, pc)) {
+                    break;  // some other translation already has it.
+                }
 
-    if (highlight) {
-        memset(highlight, 0, buflen);
-    }
+                uint32 i;
+                for (i = 0; i < num_decoded; i++) {
+                    if (decoded[i].logical_pc == pc) {
+                        break;
+                    }
+                }
+                if (i < num_decoded) {
+                    break;  // already got it.
+                }
+            }
 
-    memset(buf, ' ', buflen - 1);
-    buf[buflen - 1] = '\0';
+            if (num_decoded >= decoded_allocated) {
+                decoded_allocated = decoded_allocated ? (decoded_allocated * 2) : 64;
+                void *ptr = realloc(decoded, decoded_allocated * sizeof (ZDecodedInstruction));
+                if (!ptr) {
+                    free(decoded);
+                    GState->die("Out of memory");
+                }
+                decoded = (ZDecodedInstruction *) ptr;
+            }
 
-    objstr[0] = '\0';
-    if (objzstr) {
-        uintptr decoded_chars = sizeof (objstr) - 1;
-        decode_zscii(objzstr, 0, objstr, &decoded_chars);
-        objstr[(decoded_chars < sizeof (objstr)) ? decoded_chars : sizeof (objstr) - 1] = '\0';
-    }
+            ZDecodedInstruction *insn = &decoded[num_decoded++];
+            decodeInstruction(pc, insn);
 
-    const int scoremovelen = short_score ?
-                                (score_game ? (3 + 4 + 8) : (2 + 2 + 9)) :
-                                (score_game ? (3 + 4 + 20) : (2 + 2 + 16));
-    if (buflen < scoremovelen) {
-        return;  // oh well.
-    }
+            const uint32 target = instructionBranchTarget(insn);
+            if (target) {
+                pending[num_pending++] = target;
+            }
 
-    const int maxobjlen = (buflen > scoremovelen) ? (buflen - scoremovelen) : 0;
-    if (strlen(objstr) > maxobjlen) {
-        if (maxobjlen < 3) {
-            objstr[0] = '\0';
-        } else {
-            objstr[maxobjlen] = '\0';
-            objstr[maxobjlen - 1] = '.';
-            objstr[maxobjlen - 2] = '.';
-            objstr[maxobjlen - 3] = '.';
+            if (!instructionFallsThrough(insn)) {
+                break;
+            }
+            pc += insn->len;
         }
     }
 
-    snprintf(buf, buflen, "%s", objstr);
-    const int slen = strlen(buf);
-    buf[slen] = ' ';
-    if (highlight) {
-        memset(highlight, 1, slen);
+    qsort(decoded, num_decoded, sizeof (ZDecodedInstruction), cmpDecodedInstruction);
+
+    ZTranslation *translation = (ZTranslation *) malloc(sizeof (ZTranslation) + (num_decoded * sizeof (ZDecodedInstruction)));
+    if (!translation) {
+        free(decoded);
+        GState->die("Out of memory");
     }
 
-    int scorestrlen = 0;
-    if (score_game) {
-        if (short_score) {
-            scorestrlen = snprintf((buf + buflen) - scoremovelen, scoremovelen, "Score: %d/%u", (int) scoreval, (unsigned int) movesval);
+    translation->num_instructions = num_decoded;
+    memcpy(translation->instructions, decoded, num_decoded * sizeof (ZDecodedInstruction));
+    free(decoded);
+
+    // now that we have everything, fuse what we can and chain instructions to whatever runs after them.
+    for (uint32 i = 0; i < num_decoded; i++) {
+        ZDecodedInstruction *insn = &translation->instructions[i];
+
+        #if MOJOZORK_SUPERINSTRUCTIONS
+        fuseInstructions(insn);
+        #endif
+
+        if (insn->fused_count) {
+            const uint32 end = insn->logical_pc + insn->fused_len;
+            insn->next = findTranslatedInstruction(translation, end);
+            if ((insn->engine_op != ENGINEOP_STORE_STORE) && (insn->fused_branch_offset != 0) && (insn->fused_branch_offset != 1)) {  // the last fused instruction branches.
+                insn->branch_next = findTranslatedInstruction(translation, (uint32) ((((sint32) end) + insn->fused_branch_offset) - 2));
+            }
         } else {
-            scorestrlen = snprintf((buf + buflen) - scoremovelen, scoremovelen, "     Score:%-3d  Moves:%-4u", (int) scoreval, (unsigned int) movesval);
+            const uint32 target = instructionBranchTarget(insn);
+            if (instructionFallsThrough(insn)) {
+                insn->next = findTranslatedInstruction(translation, insn->logical_pc + insn->len);
+            }
+            if (target) {
+                insn->branch_next = findTranslatedInstruction(translation, target);
+            }
         }
-    } else {
-        if (short_score) {
-            scorestrlen = snprintf((buf + buflen) - scoremovelen, scoremovelen, "Time: %2u:%02u %s", (unsigned int) (scoreval % 12) + 1, (unsigned int) movesval, (scoreval < 12) ? "am" : "pm");
-        } else {
-            scorestrlen = snprintf((buf + buflen) - scoremovelen, scoremovelen, "     Time: %2u:%02u %s", (unsigned int) (scoreval % 12) + 1, (unsigned int) movesval, (scoreval < 12) ? "am" : "pm");
+
+        if ((cache->used * 2) >= cache->size) {
+            growDecodeCache(cache);  // keep it no more than half full so probing stays short.
+        }
+
+        ZDecodedInstruction **slot = findDecodedInstruction(cache, insn->logical_pc);
+        if (!*slot) {  // the entry point might have been in another translation's code that we didn't follow.
+            *slot = insn;
+            cache->used++;
         }
     }
 
-    if (highlight) {
-        memset((highlight + buflen) - scoremovelen, 1, scorestrlen);
-        if (short_score) {
-            highlight[(buflen - scoremovelen) + (score_game ? 6 : 5)] = 2;
+    translation->next_translation = cache->translations;
+    cache->translations = translation;
+    cache->num_translations++;
+    cache->num_instructions += num_decoded;
+}
+
+static const ZDecodedInstruction *getDecodedInstruction(const uint32 logical_pc)
+{
+    ZDecodeCache *cache = GState->decode_cache;
+    if (!cache) {
+        cache = GState->decode_cache = createDecodeCache();
+        if (!cache) {
+            GState->die("Out of memory");
         }
     }
+
+    if ((cache->used * 2) >= cache->size) {
+        growDecodeCache(cache);  // keep it no more than half full so probing stays short.
+    }
+
+    const ZDecodedInstruction *insn = *findDecodedInstruction(cache, logical_pc);
+    if (insn) {
+        GState->decode_cache_hits++;
+        return insn;
+    }
+
+    GState->decode_cache_misses++;
+    translateCode(logical_pc);
+    return *findDecodedInstruction(cache, logical_pc);
 }
+#endif
 
-static void updateStatusBar(void)
+// Call this if you change code bytes in the story after it has started
+//  running. Translations fuse and chain instructions together, so rather
+//  than hunt down everything that might have seen `addr`, we throw all of
+//  them away (for every state sharing the cache, too).
+static inline void invalidateDecodedInstructions(const uint32 addr)
 {
-    if (GState->status_bar && GState->status_bar_len && GState->status_bar_enabled) {
-        calculateStatusBar(GState->status_bar, GState->status_bar_char_highlight, GState->status_bar_len);
+    #if MOJOZORK_DECODE_CACHE
+    if (GState->decode_cache && (addr >= GState->header.staticmem_addr)) {
+        flushDecodeCache(GState->decode_cache);
     }
+    #else
+    (void) addr;
+    #endif
 }
 
+#if !MOJOZORK_THREADED_ENGINE  // the threaded engine replaces this.
 static void runInstruction(void)
 {
     FIXME("verify PC is sane");
 
-    GState->logical_pc = (uint32) (GState->pc - GState->story);
-    uint8 opcode = *(GState->pc++);
-
-    const Opcode *op = NULL;
+    const uint8 *start = GState->pc;
+    GState->logical_pc = (uint32) (start - GState->story);
 
-    const int extended = ((opcode == 190) && (GState->header.version >= 5)) ? 1 : 0;
-    if (extended) {
-        opcode = *(GState->pc++);
-        if (opcode >= (sizeof (GState->extended_opcodes) / sizeof (GState->extended_opcodes[0]))) {
-            GState->die("Unsupported or unknown extended opcode #%u", (unsigned int) opcode);
-        }
-        GState->operand_count = parseVarOperands(GState->operands);
-        op = &GState->extended_opcodes[opcode];
-    } else {
-        if (opcode <= 127) {   // 2OP
-            GState->operand_count = 2;
-            parseOperand(((opcode >> 6) & 0x1) ? 2 : 1, GState->operands + 0);
-            parseOperand(((opcode >> 5) & 0x1) ? 2 : 1, GState->operands + 1);
-        } else if (opcode <= 175) {  // 1OP
-            GState->operand_count = 1;
-            const uint8 optype = (opcode >> 4) & 0x3;
-            parseOperand(optype, GState->operands);  // 1OP or 0OP
-        } else if (opcode <= 191) {  // 0OP
-            GState->operand_count = 0;
-        } else if (opcode > 191) {  // VAR
-            const int takes8 = ((opcode == 236) || (opcode == 250));  // call_vs2 and call_vn2 take up to EIGHT arguments!
-            if (!takes8) {
-                GState->operand_count = parseVarOperands(GState->operands);
-            } else {
-                GState->operand_count = parseVarOperands(GState->operands);
-                if (GState->operand_count == 4) {
-                    GState->operand_count += parseVarOperands(GState->operands + 4);
-                } else {
-                    GState->pc++;  // skip the next byte, since we don't have any more args.
-                }
-            }
-        }
+    ZDecodedInstruction decoded;
+    const ZDecodedInstruction *insn = &decoded;
 
-        op = &GState->opcodes[opcode];
+    #if MOJOZORK_DECODE_CACHE
+    if (GState->logical_pc >= GState->header.staticmem_addr) {  // dynamic memory can change, don't cache it.
+        insn = getDecodedInstruction(GState->logical_pc);
+    } else
+    #endif
+    {
+        decodeInstruction(GState->logical_pc, &decoded);
     }
 
+    const Opcode *op = instructionOpcode(insn);
+    const uint8 opcode = insn->opcode;
+    const int extended = insn->extended;
+
     if (!op->name) {
         GState->die("Unsupported or unknown %sopcode #%u", extended ? "extended " : "", (unsigned int) opcode);
     } else if (!op->fn) {
         GState->die("Unimplemented %sopcode #%d ('%s')", extended ? "extended " : "", (unsigned int) opcode, op->name);
     } else {
+        const uint8 operand_count = insn->operand_count;
+        const uint8 variable_operands = insn->variable_operands;
+        uint16 *operands = GState->operands;
+
+        // look up variables in order, since reading from the stack pops it.
+        GState->operand_count = operand_count;
+        for (uint8 i = 0; i < operand_count; i++) {
+            if (variable_operands & (1 << i)) {
+                operands[i] = loadVariable((uint8) insn->operands[i], 0);
+            } else {
+                operands[i] = insn->operands[i];
+            }
+        }
+
+        // the opcode handlers read their own store and branch bytes.
+        GState->pc = start + insn->operands_len;
+
         #if MOJOZORK_DEBUGGING
         dbg("pc=%X %sopcode=%u ('%s') [", (unsigned int) GState->logical_pc, extended ? "ext " : "", opcode, op->name);
         if (GState->operand_count)
@@ -1670,10 +3663,41 @@ static void runInstruction(void)
         dbg("]\n");
         #endif
 
+        PROFILE_INSTRUCTION(opcode, extended, op->name);
+
+        // don't touch `insn` after this, as the opcode might restart or reload the story.
         op->fn();
         GState->instructions_run++;
     }
 }
+#endif
+
+#if MOJOZORK_THREADED_ENGINE && !MOJOZORK_NO_COMPUTED_GOTO && (defined(__GNUC__) || defined(__clang__))
+#define MOJOZORK_ENGINE_COMPUTED_GOTO 1
+#else
+#define MOJOZORK_ENGINE_COMPUTED_GOTO 0
+#endif
+
+// Run instructions until something (READ, QUIT, etc) sets GState->step_completed.
+#if !MOJOZORK_THREADED_ENGINE
+static void runInstructions(void)
+{
+    while (!GState->step_completed) {
+        runInstruction();
+    }
+    PROFILE_STOP();
+}
+#else
+// The threaded engine is big, so it lives in its own file.
+#include "mojozork-engine.h"
+#endif
+
+static void runZMachine(void)
+{
+    shadowGlobals();
+    runInstructions();
+    unshadowGlobals();
+}
 
 static void initAlphabetTable(void)
 {
@@ -1807,12 +3831,27 @@ static void inititialOpcodeTableSetup(void)
     OPCODE(232, push);
     OPCODE(233, pull);
 
+    // note which instructions have data after their operands, so we can decode them ahead of time.
+    FIXME("ver4+ opcodes need flags here when they are implemented");
+    for (uint8 i = 1; i <= 7; i++) { opcodes[i].flags = OPFLAG_BRANCH; }  // je, jl, jg, dec_chk, inc_chk, jin, test
+    for (uint8 i = 15; i <= 24; i++) { opcodes[i].flags = OPFLAG_STORE; }  // loadw ... mod
+    opcodes[8].flags = opcodes[9].flags = OPFLAG_STORE;  // or, and
+    opcodes[10].flags = OPFLAG_BRANCH;  // test_attr
+    opcodes[128].flags = OPFLAG_BRANCH;  // jz
+    opcodes[129].flags = opcodes[130].flags = OPFLAG_STORE | OPFLAG_BRANCH;  // get_sibling, get_child
+    opcodes[131].flags = opcodes[132].flags = OPFLAG_STORE;  // get_parent, get_prop_len
+    opcodes[142].flags = opcodes[143].flags = OPFLAG_STORE;  // load, not
+    opcodes[178].flags = opcodes[179].flags = OPFLAG_TEXT;  // print, print_ret
+    opcodes[181].flags = opcodes[182].flags = OPFLAG_BRANCH;  // save, restore
+    opcodes[224].flags = opcodes[231].flags = OPFLAG_STORE;  // call, random
+
     if (GState->header.version < 3) {  // most Infocom games are version 3.
         return;  // we're done.
     }
 
     OPCODE(188, show_status);
     OPCODE(189, verify);
+    opcodes[189].flags = OPFLAG_BRANCH;
     OPCODE(234, split_window);
     OPCODE(235, set_window);
     OPCODE_WRITEME(243, output_stream);
@@ -1966,14 +4005,57 @@ static void calculateActualChecksum(void)
     GState->calculated_checksum = checksum;
 }
 
-// WE OWN THIS copy of story, which we will free() later. Caller should not free it!
-static void initStory(const char *fname, uint8 *story, const uint32 storylen)
+#if MOJOZORK_MMAP
+// Map a private view of the story image in file descriptor `fd`, which you
+//  can hand to initMappedStory(). Pages are shared with the file (and
+//  everything else mapping it) until they get written to, so each view only
+//  costs what it writes to dynamic memory. Returns NULL on failure.
+static uint8 *mapStory(const int fd, const uint32 storylen)
+{
+    void *ptr = mmap(NULL, (size_t) storylen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    return (ptr == MAP_FAILED) ? NULL : (uint8 *) ptr;
+}
+#endif
+
+static void freeStory(ZMachineState *state)
 {
-    if (GState->story) {
-        free(GState->story);
-        GState->story = NULL;
+    #if MOJOZORK_MMAP
+    if (state->story_mapped) {
+        if (state->story) {
+            munmap(state->story, (size_t) state->story_len);
+        }
+    } else
+    #endif
+    {
+        free(state->story);
     }
 
+    state->story = NULL;
+    state->story_mapped = 0;
+    state->globals = NULL;
+}
+
+static void initStoryMemory(const char *fname, uint8 *story, const uint32 storylen, const int mapped)
+{
+    freeStory(GState);
+
+    #if MOJOZORK_DECODE_CACHE
+    releaseDecodeCache(GState->decode_cache);  // a new one gets made on demand.
+    GState->decode_cache = NULL;
+    GState->decode_cache_hits = 0;
+    GState->decode_cache_misses = 0;
+    #endif
+    GState->superinstructions_run = 0;
+    releaseDictionaryIndex(GState->dictionary_index);  // we'll make a new one once the header is loaded.
+    GState->dictionary_index = NULL;
+    dynamicMemoryReplaced(GState);  // throws out the property index and object tree; they get rebuilt on demand.
+    #if MOJOZORK_STRING_CACHE
+    releaseStringCache(GState->string_cache);  // a new one gets made on demand.
+    GState->string_cache = NULL;
+    GState->string_cache_hits = 0;
+    GState->string_cache_misses = 0;
+    #endif
+
     if (GState->story_filename != fname) {
         free(GState->story_filename);
         GState->story_filename = fname ? strdup(fname) : NULL;
@@ -1981,11 +4063,13 @@ static void initStory(const char *fname, uint8 *story, const uint32 storylen)
 
     GState->story = story;
     GState->story_len = (uintptr) storylen;
+    GState->story_mapped = mapped;
     GState->instructions_run = 0;
     GState->pc = 0;
     GState->logical_pc = 0;
     GState->quit = 0;
-    memset(GState->stack, '\0', sizeof (GState->stack));
+    growStack(GState->stack, INITIAL_STACK_SIZE);  // make sure we have one at all.
+    memset(GState->stack, '\0', GState->stack_size * sizeof (uint16));
     memset(GState->operands, '\0', sizeof (GState->operands));
     GState->operand_count = 0;
     GState->sp = NULL;  // stack pointer
@@ -2024,6 +4108,12 @@ static void initStory(const char *fname, uint8 *story, const uint32 storylen)
     GState->header.dict_addr = READUI16(ptr);
     GState->header.objtab_addr = READUI16(ptr);
     GState->header.globals_addr = READUI16(ptr);
+    GState->globals = GState->story + GState->header.globals_addr;
+    #if MOJOZORK_NATIVE_GLOBALS
+    if (GState->globals_shadowed) {
+        loadGlobalsShadow(0, 240);  // opcode_restart reloads the story from inside runZMachine().
+    }
+    #endif
     GState->header.staticmem_addr = READUI16(ptr);
     GState->header.flags2 = READUI16(ptr);
     GState->header.serial_code[0] = READUI8(ptr);
@@ -2058,7 +4148,9 @@ static void initStory(const char *fname, uint8 *story, const uint32 storylen)
 
     calculateActualChecksum();
     initAlphabetTable();
+    initAbbreviations();
     initOpcodeTable();
+    GState->dictionary_index = createDictionaryIndex();  // if this fails, tokenizing searches the dictionary directly.
 
     FIXME("in ver6+, this is the address of a main() routine, not a raw instruction address.");
     GState->pc = GState->story + GState->header.pc_start;
@@ -2067,9 +4159,48 @@ static void initStory(const char *fname, uint8 *story, const uint32 storylen)
     GState->sp = GState->stack;
 }
 
+// WE OWN THIS copy of story, which we will free() later. Caller should not free it!
+static void initStory(const char *fname, uint8 *story, const uint32 storylen)
+{
+    initStoryMemory(fname, story, storylen, 0);
+}
+
+#if MOJOZORK_MMAP
+// WE OWN THIS view of the story from mapStory(), which we will munmap() later.
+static void initMappedStory(const char *fname, uint8 *story, const uint32 storylen)
+{
+    initStoryMemory(fname, story, storylen, 1);
+}
+#endif
+
+// free everything initStory() and the interpreter allocated for this state.
+static void unloadStory(ZMachineState *state)
+{
+    freeStory(state);
+    free(state->stack);
+    state->stack = NULL;
+    state->stack_size = 0;
+    state->sp = NULL;
+    free(state->story_filename);
+    state->story_filename = NULL;
+    free(state->abbreviations);
+    state->abbreviations = NULL;
+    releaseDictionaryIndex(state->dictionary_index);
+    state->dictionary_index = NULL;
+    dynamicMemoryReplaced(state);  // frees the property index and object tree.
+    #if MOJOZORK_STRING_CACHE
+    releaseStringCache(state->string_cache);
+    state->string_cache = NULL;
+    #endif
+    #if MOJOZORK_DECODE_CACHE
+    releaseDecodeCache(state->decode_cache);
+    state->decode_cache = NULL;
+    #endif
+}
+
 static void loadStory(const char *fname)
 {
-    uint8 *story;
+    uint8 *story = NULL;
     FILE *io;
     long len;
 
@@ -2079,7 +4210,24 @@ static void loadStory(const char *fname)
         GState->die("Failed to open '%s'", fname);
     } else if ((fseek(io, 0, SEEK_END) == -1) || ((len = ftell(io)) == -1)) {
         GState->die("Failed to determine size of '%s'", fname);
-    } else if ((story = (uint8 *) malloc(len)) == NULL) {
+    }
+
+    #if MOJOZORK_MMAP
+    // Map the file copy-on-write if we can: static and high memory come
+    //  straight from the OS's page cache, shared with anything else running
+    //  this story, and only the dynamic memory that gets written to ends up
+    //  private. Otherwise, read the whole thing in.
+    if (len > 0) {
+        story = mapStory(fileno(io), (uint32) len);
+    }
+    if (story) {
+        fclose(io);
+        initMappedStory(fname, story, (uint32) len);
+        return;
+    }
+    #endif
+
+    if ((story = (uint8 *) malloc(len)) == NULL) {
         GState->die("Out of memory");
     } else if ((fseek(io, 0, SEEK_SET) == -1) || (fread(story, len, 1, io) != 1)) {
         GState->die("Failed to read '%s'", fname);
@@ -2091,7 +4239,7 @@ static void loadStory(const char *fname)
 }
 
 
-#if !defined(MULTIZORK) && !defined(MOJOZORK_LIBRETRO)
+#if !defined(MULTIZORK) && !defined(MOJOZORK_LIBRETRO) && !defined(MOJOZORK_BENCH)
 
 #if defined(__GNUC__) || defined(__clang__)
 static void die(const char *fmt, ...) __attribute__((noreturn));
@@ -2109,6 +4257,9 @@ static void die(const char *fmt, ...)
     va_end(ap);
     fprintf(stderr, " (pc=%X)\n", (unsigned int) GState->logical_pc);
     fprintf(stderr, " %u instructions run\n", (unsigned int) GState->instructions_run);
+    #if MOJOZORK_DECODE_CACHE
+    fprintf(stderr, " %u decode cache hits, %u misses\n", (unsigned int) GState->decode_cache_hits, (unsigned int) GState->decode_cache_misses);
+    #endif
     fprintf(stderr, "\n");
     fflush(stderr);
     fflush(stdout);
@@ -2139,14 +4290,18 @@ int main(int argc, char **argv)
 
     loadStory(fname);
 
-    while (!GState->quit) {
-        runInstruction();
-    }
+    runZMachine();  // runs until opcode_quit sets step_completed.
+
+    #if MOJOZORK_PROFILING
+    profileReport(stderr);
+    #endif
 
     dbg("ok.\n");
+    #if MOJOZORK_DECODE_CACHE
+    dbg("%u decode cache hits, %u misses\n", (unsigned int) GState->decode_cache_hits, (unsigned int) GState->decode_cache_misses);
+    #endif
 
-    free(GState->story);
-    free(GState->story_filename);
+    unloadStory(GState);
 
     return 0;
 }
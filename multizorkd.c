@@ -6,18 +6,31 @@
  *  This file written by Ryan C. Gordon.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE 1  // for memfd_create().
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <signal.h>
 #include <poll.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#if MULTIZORKD_IO_URING
+#include <liburing.h>
+#endif
 #include <errno.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <setjmp.h>
@@ -26,6 +39,7 @@
 #include "sqlite3.h"
 
 #define MULTIZORK 1
+#define MOJOZORK_THREAD_LOCAL _Thread_local  // each worker thread has its own GState.
 #include "mojozork.c"
 
 #define MULTIZORKD_VERSION "0.0.9"
@@ -33,10 +47,47 @@
 #define MULTIZORKD_DEFAULT_BACKLOG 64
 #define MULTIZORKD_DEFAULT_EGID 0
 #define MULTIZORKD_DEFAULT_EUID 0
+#define MULTIZORKD_DEFAULT_WORKERS 0  /* zero means one per CPU core. */
 #define MULTIZORK_TRANSCRIPT_BASEURL "https://multizork.icculus.org"
 #define MULTIZORK_BLOCKED_TIMEOUT (60 * 60 * 24)  /* 24 hours in seconds */
 #define MULTIZORK_AUTOSAVE_EVERY_X_MOVES 30
 
+// On Linux, we wait for socket activity with epoll, so idle connections
+//  cost nothing per wakeup. Everywhere else (or if you build with
+//  -DMULTIZORKD_EPOLL=0), we rebuild a poll() array every time.
+// If you build with -DMULTIZORKD_IO_URING=1 (CMake does this if it finds
+//  liburing), we hand accept/recv/send to the kernel through io_uring
+//  instead, and don't use either of those.
+#ifndef MULTIZORKD_IO_URING
+#define MULTIZORKD_IO_URING 0
+#endif
+#ifndef MULTIZORKD_EPOLL
+#if defined(__linux__) && !MULTIZORKD_IO_URING
+#define MULTIZORKD_EPOLL 1
+#else
+#define MULTIZORKD_EPOLL 0
+#endif
+#endif
+#if MULTIZORKD_EPOLL && MULTIZORKD_IO_URING
+#error Please pick one of MULTIZORKD_EPOLL and MULTIZORKD_IO_URING.
+#endif
+#define MULTIZORKD_EPOLL_EVENTS 64
+#define MULTIZORKD_URING_ENTRIES 256  // submission queue size; we submit early if it fills up.
+#define MULTIZORKD_URING_BUFFERS 256  // receive buffers the kernel picks from; must be a power of two.
+#define MULTIZORKD_URING_BUFSIZE 512
+#define MULTIZORKD_URING_BUFGROUP 0
+
+// Output waits in a queue of fixed-size chunks until the socket takes it.
+//  Once a connection has MULTIZORKD_OUTPUT_HIGH_WATER bytes waiting, we stop
+//  reading its input until it catches up. If it gets to
+//  MULTIZORKD_OUTPUT_LIMIT, the other end isn't reading at all, so we drop it.
+#define MULTIZORKD_OUTPUT_CHUNK_SIZE 4096
+#define MULTIZORKD_OUTPUT_IOVECS 16  // most chunks we hand to one writev().
+#define MULTIZORKD_OUTPUT_SPARE_CHUNKS 64  // sent chunks each worker keeps around to reuse.
+#define MULTIZORKD_OUTPUT_HIGH_WATER (64 * 1024)
+#define MULTIZORKD_OUTPUT_LIMIT (1024 * 1024)
+#define MULTIZORKD_PENDING_INPUT_LIMIT (128 * 1024)  // most input we'll hold for a connection we aren't reading right now.
+
 typedef unsigned int uint;  // for cleaner printf casting.
 
 // the "_t" drives me nuts.  :/
@@ -52,19 +103,43 @@ typedef size_t uintptr;
 
 #define ARRAYSIZE(x) ( (sizeof (x)) / (sizeof ((x)[0])) )
 
-static time_t GNow = 0;
+// Each worker thread runs its own event loop, for its own connections and
+//  the instances they're playing, so most of this program's state is
+//  per-thread (MOJOZORK_THREAD_LOCAL). The original story data is shared,
+//  since no one writes to it.
+static MOJOZORK_THREAD_LOCAL time_t GNow = 0;
 static const char *GOriginalStoryName = NULL;
 static uint8 *GOriginalStory = NULL;
 static uint32 GOriginalStoryLen = 0;
+#if MOJOZORK_MMAP
+static int GOriginalStoryMapped = 0;  // non-zero if GOriginalStory is mmap()'d from the story file.
+#endif
+static int GStoryImageFd = -1;  // the story file (or an in-memory copy of it) that instances map, or -1 to give them full copies.
+
+#if MOJOZORK_DECODE_CACHE
+// every instance runs the same story with the same opcode handlers, so they share decoded instructions.
+//  The caches fill in as instances run, so each worker thread gets its own to share.
+static MOJOZORK_THREAD_LOCAL ZDecodeCache *GSharedDecodeCache = NULL;
+#endif
+
+// every instance runs the same story, so they share a dictionary index, too. The first instance's one gets kept here.
+static MOJOZORK_THREAD_LOCAL ZDictionaryIndex *GSharedDictionaryIndex = NULL;
+
+#if MOJOZORK_STRING_CACHE
+// ...and decoded strings.
+static MOJOZORK_THREAD_LOCAL ZStringCache *GSharedStringCache = NULL;
+#endif
 
 static void loginfo(const char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
+    flockfile(stdout);  // keep other threads from writing into the middle of this line.
     printf("multizorkd: ");
     vprintf(fmt, ap);
-    va_end(ap);
     printf("\n");
+    funlockfile(stdout);
+    va_end(ap);
 }
 
 #if defined(__GNUC__) || defined(__clang__)
@@ -83,6 +158,7 @@ static void panic(const char *fmt, ...)
 }
 
 typedef struct Connection Connection;
+typedef struct Worker Worker;
 
 typedef enum ConnectionState
 {
@@ -102,7 +178,8 @@ typedef struct Player
     uint32 next_logical_pc;  // next step_instance() should run this player from this z-machine program counter.
     uint32 next_logical_sp;  // next step_instance() should run this player from this z-machine stack pointer.
     uint16 next_logical_bp;  // next step_instance() should run this player from this z-machine base pointer.
-    uint16 stack[2048];      // Copy of the stack to restore for next step_instance()  // !!! FIXME: make this dynamic?
+    uint16 *stack;           // this player's Z-Machine stack. step_instance() swaps it into the instance, see swapStack().
+    uint32 stack_allocated;  // number of uint16s we can fit in `stack` before the Z-Machine has to grow it.
     uint8 *next_inputbuf;   // where to write the next input for this player.
     uint8 next_inputbuflen;
     uint16 next_operands[2];  // to save off the READ operands for later.
@@ -141,6 +218,16 @@ typedef struct Instance
     jmp_buf jmpbuf;
 } Instance;
 
+// a piece of a Connection's output queue. Sends take bytes off the front of
+//  the first chunk, write_to_connection() adds them to the end of the last one.
+typedef struct OutputChunk
+{
+    struct OutputChunk *next;
+    uint32 start;  // first byte in data that hasn't been sent yet.
+    uint32 end;  // one past the last byte queued in data.
+    char data[MULTIZORKD_OUTPUT_CHUNK_SIZE];
+} OutputChunk;
+
 typedef void (*InputFn)(Connection *conn, const char *str);
 struct Connection
 {
@@ -153,19 +240,129 @@ struct Connection
     char inputbuf[128];
     uint32 inputbuf_used;
     int overlong_input;
-    char *outputbuf;
-    uint32 outputbuf_len;
-    uint32 outputbuf_used;
+    OutputChunk *output_head;  // oldest queued output; sends start here.
+    OutputChunk *output_tail;  // newest; write_to_connection() adds to this.
+    uint32 output_queued;  // total bytes waiting in the output chunks.
+    int output_overflow;  // non-zero if output hit MULTIZORKD_OUTPUT_LIMIT, so we're dropping them.
+    int input_paused;  // non-zero if we stopped reading input until their output drains.
     time_t last_activity;
     int blocked;
+    size_t index;  // where this is in connections[].
+    int dirty;  // non-zero if this is in dirty_connections[].
+    #if MULTIZORKD_IO_URING
+    struct msghdr uring_msg;  // the send in flight. The kernel reads the queued chunks in place.
+    struct iovec uring_iov[MULTIZORKD_OUTPUT_IOVECS];
+    int uring_pending;  // io_uring operations in flight that point at this connection; we can't free it until this is zero.
+    int uring_sending;  // non-zero if a send is in flight.
+    int uring_receiving;  // non-zero if a recv is armed.
+    int uring_shutdown;  // non-zero if we already told the kernel to give up on this socket.
+    int uring_detaching;  // non-zero if we cancelled the recv to hand this connection off.
+    #endif
+    Worker *handoff_to;  // non-NULL if this is moving to another worker thread, see handoff_connection().
+    int handing_off;  // non-zero while we rerun the command that caused a handoff, so we can't bounce around.
+    char handoff_command[128];  // the command to rerun once we get there.
+    char *pending_input;  // input that arrived after that command (or while input was paused), to process later.
+    uint32 pending_input_used;
+    uint32 pending_input_allocated;
+};
+
+// A worker thread. Connections land on whichever one accepts them, and stay
+//  there until they start or join a game, which happens on the worker that
+//  owns the game's instance. New games go to whichever worker has the fewest,
+//  since one worker tends to accept most connections when things are quiet.
+//  Workers only touch each other through the handoff list (and the instance
+//  directory), under a mutex.
+struct Worker
+{
+    pthread_t thread;
+    int num;
+    int wakefds[2];  // a pipe; writing a byte here wakes up this worker's event loop.
+    pthread_mutex_t handoff_mutex;
+    Connection **handoffs;  // connections other workers gave us, not yet in our event loop.
+    size_t num_handoffs;
+    size_t handoffs_allocated;
 };
 
-static Connection **connections = NULL;
-static size_t num_connections = 0;
+static Worker *GWorkers = NULL;
+static int GNumWorkers = 0;
+static MOJOZORK_THREAD_LOCAL Worker *GWorker = NULL;  // the worker running on this thread.
+static int GListenSock = -1;  // all the workers accept new connections from this.
+
+static MOJOZORK_THREAD_LOCAL Connection **connections = NULL;
+static MOJOZORK_THREAD_LOCAL size_t num_connections = 0;
+
+// connections that queued output or changed state since the last trip
+//  through the event loop, so we don't have to look at all of them.
+static MOJOZORK_THREAD_LOCAL Connection **dirty_connections = NULL;
+static MOJOZORK_THREAD_LOCAL size_t num_dirty_connections = 0;
+static MOJOZORK_THREAD_LOCAL size_t dirty_connections_allocated = 0;
+
+// output chunks that were sent, to reuse instead of going back to malloc().
+static MOJOZORK_THREAD_LOCAL OutputChunk *spare_output_chunks = NULL;
+static MOJOZORK_THREAD_LOCAL int num_spare_output_chunks = 0;
+
+// Every live instance, and which worker owns it, so any worker can send a
+//  connection to the right place for a game code or access code. Only the
+//  owner looks at the Instance itself; everyone else gets the copies here.
+typedef struct InstanceDirectoryEntry
+{
+    const Instance *inst;  // only the owner may look at this.
+    Worker *owner;
+    sqlite3_int64 dbid;
+    char hash[8];
+    char player_hashes[4][8];
+} InstanceDirectoryEntry;
+
+static pthread_mutex_t GInstanceDirectoryMutex = PTHREAD_MUTEX_INITIALIZER;
+static InstanceDirectoryEntry *GInstanceDirectory = NULL;
+static size_t GInstanceDirectoryLen = 0;
+static size_t GInstanceDirectoryAllocated = 0;
+
+#if MULTIZORKD_EPOLL
+static MOJOZORK_THREAD_LOCAL int GEpollFd = -1;
+#endif
+
+#if MULTIZORKD_IO_URING
+// each io_uring request carries the Connection it's for, with the kind of
+//  request in the low bits of the pointer (calloc() gives us at least 8-byte
+//  alignment, so three bits are free).
+typedef enum
+{
+    URING_OP_ACCEPT,  // Connection pointer is NULL.
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_WAKE,  // something wrote to our worker's wake pipe. Connection pointer is NULL.
+    URING_OP_IGNORE  // cancellations and such; we don't care how they turn out.
+} UringOp;
+#define URING_OP_MASK 7
+
+static MOJOZORK_THREAD_LOCAL struct io_uring GUring;
+static MOJOZORK_THREAD_LOCAL struct io_uring_buf_ring *GUringBufRing = NULL;
+static MOJOZORK_THREAD_LOCAL char *GUringBuffers = NULL;
+
+static inline uint64 uring_tag(const Connection *conn, const UringOp op)
+{
+    return ((uint64) (uintptr_t) conn) | ((uint64) op);
+}
+
+static struct io_uring_sqe *get_uring_sqe(void)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&GUring);
+    if (!sqe) {  // submission queue is full, push what we have to the kernel and try again.
+        io_uring_submit(&GUring);
+        sqe = io_uring_get_sqe(&GUring);
+        if (!sqe) {
+            panic("Uhoh, io_uring submission queue is still full!");
+        }
+    }
+    return sqe;
+}
+#endif
 
 
 
 #define MULTIZORK_DATABASE_PATH "multizork.sqlite3"
+#define MULTIZORK_DATABASE_BUSY_TIMEOUT_MS 10000  /* how long to wait on another worker's transaction. */
 
 #define SQL_CREATE_TABLES \
     "create table if not exists instances (" \
@@ -309,23 +506,23 @@ static size_t num_connections = 0;
     "delete from transcripts where player = $player and timestamp > $savetime;"
 
 
-static sqlite3 *GDatabase = NULL;
-static sqlite3_stmt *GStmtBegin = NULL;
-static sqlite3_stmt *GStmtCommit = NULL;
-static sqlite3_stmt *GStmtTranscriptInsert = NULL;
-static sqlite3_stmt *GStmtUsedHashInsert = NULL;
-static sqlite3_stmt *GStmtInstanceInsert = NULL;
-static sqlite3_stmt *GStmtInstanceUpdate = NULL;
-static sqlite3_stmt *GStmtInstanceSelect = NULL;
-static sqlite3_stmt *GStmtPlayerInsert = NULL;
-static sqlite3_stmt *GStmtPlayerUpdate = NULL;
-static sqlite3_stmt *GStmtFindInstanceByPlayerHash = NULL;
-static sqlite3_stmt *GStmtPlayersSelect = NULL;
-static sqlite3_stmt *GStmtRecapSelect = NULL;
-static sqlite3_stmt *GStmtCrashInsert = NULL;
-static sqlite3_stmt *GStmtBlockedInsert = NULL;
-static sqlite3_stmt *GStmtBlockedSelect = NULL;
-static sqlite3_stmt *GStmtRecapTrim = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3 *GDatabase = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtBegin = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtCommit = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtTranscriptInsert = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtUsedHashInsert = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtInstanceInsert = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtInstanceUpdate = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtInstanceSelect = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtPlayerInsert = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtPlayerUpdate = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtFindInstanceByPlayerHash = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtPlayersSelect = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtRecapSelect = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtCrashInsert = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtBlockedInsert = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtBlockedSelect = NULL;
+static MOJOZORK_THREAD_LOCAL sqlite3_stmt *GStmtRecapTrim = NULL;
 
 
 static void db_log_error(const char *what)
@@ -342,7 +539,7 @@ static int db_set_transaction(sqlite3_stmt *stmt, const char *what)
     return 1;
 }
 
-static unsigned int db_transaction_count = 0;
+static MOJOZORK_THREAD_LOCAL unsigned int db_transaction_count = 0;
 static int db_begin_transaction(void)
 {
     db_transaction_count++;
@@ -433,6 +630,25 @@ static sqlite3_int64 db_insert_used_hash(const char *hashid, int *_notunique)
     return retval;
 }
 
+// give a player their own Z-Machine stack, starting with `count` entries from `stack`. Returns zero if out of memory.
+static int init_player_stack(Player *player, const uint16 *stack, const uint32 count)
+{
+    const uint32 allocation = (count > INITIAL_STACK_SIZE) ? count : INITIAL_STACK_SIZE;
+    uint16 *ptr = (uint16 *) calloc(allocation, sizeof (uint16));
+    if (!ptr) {
+        return 0;
+    }
+
+    if (count) {
+        memcpy(ptr, stack, count * sizeof (uint16));
+    }
+
+    free(player->stack);
+    player->stack = ptr;
+    player->stack_allocated = allocation;
+    return 1;
+}
+
 static sqlite3_int64 db_insert_instance(const Instance *inst)
 {
     //"insert into instances (hashid, num_players, starttime, savetime, instructions_run, dynamic_memory, story_filename)"
@@ -598,6 +814,7 @@ static int db_select_instance(Instance *inst, const sqlite3_int64 dbid)
         dynmemlen = (size_t) inst->zmachine_state.header.staticmem_addr;
     }
     memcpy(inst->zmachine_state.story, dynmem, dynmemlen);
+    dynamicMemoryReplaced(&inst->zmachine_state);
     sqlite3_reset(GStmtInstanceSelect);
 
     //"select * from players where instance=$instance order by id limit $limit;"
@@ -624,7 +841,10 @@ static int db_select_instance(Instance *inst, const sqlite3_int64 dbid)
         player->next_operands[0] = (uint16) SQLCOLUMN(int, GStmtPlayersSelect, "next_operands_1");
         player->next_operands[1] = (uint16) SQLCOLUMN(int, GStmtPlayersSelect, "next_operands_2");
         snprintf(player->againbuf, sizeof (player->againbuf), "%s", SQLCOLUMN(text, GStmtPlayersSelect, "againbuf"));
-        memcpy(player->stack, SQLCOLUMN(blob, GStmtPlayersSelect, "stack"), player->next_logical_sp * 2);
+        const uint16 *stack = (const uint16 *) SQLCOLUMN(blob, GStmtPlayersSelect, "stack");  // (sqlite wants _blob called before _bytes.)
+        if ((SQLCOLUMN(bytes, GStmtPlayersSelect, "stack") < (int) (player->next_logical_sp * 2)) || !init_player_stack(player, stack, player->next_logical_sp)) {
+            break;  // we'll report this below, since num_players will be wrong.
+        }
         memcpy(player->object_table_data, SQLCOLUMN(blob, GStmtPlayersSelect, "object_table_data"), sizeof (player->object_table_data));
         memcpy(player->property_table_data, SQLCOLUMN(blob, GStmtPlayersSelect, "property_table_data"), sizeof (player->property_table_data));
         memcpy(player->touchbits, SQLCOLUMN(blob, GStmtPlayersSelect, "touchbits"), sizeof (player->touchbits));
@@ -741,23 +961,30 @@ static void db_trim_recap(Instance *inst)
     }
 }
 
+// Each worker thread opens its own connection to the database (and has its
+//  own prepared statements), so they never share SQLite objects. SQLite
+//  serializes the writes between them, and write-ahead logging keeps
+//  readers from waiting on writers.
 static void db_init(void)
 {
     char *errmsg = NULL;
 
-    if (sqlite3_initialize() != SQLITE_OK) {
-        panic("sqlite3_initialize failed!");
+    if (sqlite3_open_v2(MULTIZORK_DATABASE_PATH, &GDatabase, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        panic("Couldn't open '%s'!", MULTIZORK_DATABASE_PATH);
     }
 
-    if (sqlite3_open(MULTIZORK_DATABASE_PATH, &GDatabase) != SQLITE_OK) {
-        panic("Couldn't open '%s'!", MULTIZORK_DATABASE_PATH);
+    sqlite3_busy_timeout(GDatabase, MULTIZORK_DATABASE_BUSY_TIMEOUT_MS);
+
+    if (sqlite3_exec(GDatabase, "pragma journal_mode=wal;", NULL, NULL, &errmsg) != SQLITE_OK) {
+        panic("Couldn't set database journal mode! %s", errmsg);
     }
 
     if (sqlite3_exec(GDatabase, SQL_CREATE_TABLES, NULL, NULL, &errmsg) != SQLITE_OK) {
         panic("Couldn't create database tables! %s", errmsg);
     }
 
-    if (sqlite3_prepare_v2(GDatabase, "begin transaction;", -1, &GStmtBegin, NULL) != SQLITE_OK) {
+    // "immediate" so we wait for other workers' writes here, instead of failing partway through.
+    if (sqlite3_prepare_v2(GDatabase, "begin immediate transaction;", -1, &GStmtBegin, NULL) != SQLITE_OK) {
         panic("Failed to create BEGIN TRANSACTION SQL statement! %s", sqlite3_errmsg(GDatabase));
     }
 
@@ -847,8 +1074,6 @@ static void db_quit(void)
         sqlite3_close(GDatabase);
         GDatabase = NULL;
     }
-
-    sqlite3_shutdown();
 }
 
 static int generate_unique_hash(char *hash)  // `hash` points to up to 8 bytes of space.
@@ -871,46 +1096,224 @@ static int generate_unique_hash(char *hash)  // `hash` points to up to 8 bytes o
     return 1;  // we're good.
 }
 
-static size_t count_newlines(const char *str, const uintptr slen)
+static void mark_connection_dirty(Connection *conn)
+{
+    if (!conn->dirty) {
+        if (num_dirty_connections >= dirty_connections_allocated) {
+            const size_t newalloc = dirty_connections_allocated ? (dirty_connections_allocated * 2) : 64;
+            void *ptr = realloc(dirty_connections, sizeof (*dirty_connections) * newalloc);
+            if (!ptr) {
+                panic("Uhoh, out of memory in mark_connection_dirty");
+            }
+            dirty_connections = (Connection **) ptr;
+            dirty_connections_allocated = newalloc;
+        }
+        dirty_connections[num_dirty_connections++] = conn;
+        conn->dirty = 1;
+    }
+}
+
+static OutputChunk *append_output_chunk(Connection *conn)
+{
+    OutputChunk *chunk = spare_output_chunks;
+    if (chunk) {
+        spare_output_chunks = chunk->next;
+        num_spare_output_chunks--;
+    } else {
+        chunk = (OutputChunk *) malloc(sizeof (*chunk));
+        if (!chunk) {
+            panic("Uhoh, out of memory in write_to_connection");  // !!! FIXME: we could handle this more gracefully.
+        }
+    }
+
+    chunk->next = NULL;
+    chunk->start = chunk->end = 0;
+    if (conn->output_tail) {
+        conn->output_tail->next = chunk;
+    } else {
+        conn->output_head = chunk;
+    }
+    conn->output_tail = chunk;
+    return chunk;
+}
+
+static void free_output_chunk(OutputChunk *chunk)
+{
+    if (num_spare_output_chunks < MULTIZORKD_OUTPUT_SPARE_CHUNKS) {
+        chunk->next = spare_output_chunks;
+        spare_output_chunks = chunk;
+        num_spare_output_chunks++;
+    } else {
+        free(chunk);
+    }
+}
+
+static void free_spare_output_chunks(void)
+{
+    while (spare_output_chunks) {
+        OutputChunk *next = spare_output_chunks->next;
+        free(spare_output_chunks);
+        spare_output_chunks = next;
+    }
+    num_spare_output_chunks = 0;
+}
+
+// take `len` bytes that made it to the socket off the front of the output queue.
+static void consume_output(Connection *conn, uint32 len)
+{
+    assert(len <= conn->output_queued);
+    conn->output_queued -= len;
+    while (len > 0) {
+        OutputChunk *chunk = conn->output_head;
+        const uint32 avail = chunk->end - chunk->start;
+        if (len < avail) {
+            chunk->start += len;
+            break;
+        }
+        len -= avail;
+        conn->output_head = chunk->next;
+        if (!conn->output_head) {
+            conn->output_tail = NULL;
+        }
+        free_output_chunk(chunk);
+    }
+}
+
+static void discard_output(Connection *conn)
+{
+    consume_output(conn, conn->output_queued);
+}
+
+// point iovecs at the front of the output queue, for writev() and friends.
+static int get_output_iovecs(const Connection *conn, struct iovec *iov, const int max_iovecs)
 {
-    size_t retval = 0;
-    for (size_t i = 0; i < slen; i++) {
-        if (str[i] == '\n') {
+    int retval = 0;
+    for (OutputChunk *chunk = conn->output_head; chunk && (retval < max_iovecs); chunk = chunk->next) {
+        if (chunk->end > chunk->start) {
+            iov[retval].iov_base = chunk->data + chunk->start;
+            iov[retval].iov_len = chunk->end - chunk->start;
             retval++;
         }
     }
     return retval;
 }
 
+// a null-terminated copy of what was queued for this connection since it had
+//  `since` bytes waiting, for transcripts. Nothing gets sent while instances
+//  run, so that's all still in the queue. The caller free()s it.
+static char *copy_recent_output(const Connection *conn, const uint32 since)
+{
+    assert(since <= conn->output_queued);
+    char *retval = (char *) malloc((conn->output_queued - since) + 1);
+    if (!retval) {
+        panic("Uhoh, out of memory in copy_recent_output");
+    }
+
+    char *dst = retval;
+    uint32 skip = since;
+    for (const OutputChunk *chunk = conn->output_head; chunk; chunk = chunk->next) {
+        const uint32 avail = chunk->end - chunk->start;
+        if (skip >= avail) {
+            skip -= avail;
+        } else {
+            memcpy(dst, chunk->data + chunk->start + skip, avail - skip);
+            dst += avail - skip;
+            skip = 0;
+        }
+    }
+    *dst = '\0';
+    return retval;
+}
+
+// non-zero if a connection has so much output waiting that we should stop
+//  reading its input (and running its commands) until it catches up.
+static int output_is_backed_up(const Connection *conn)
+{
+    return (conn->output_queued >= MULTIZORKD_OUTPUT_HIGH_WATER);
+}
+
+// add bytes to the end of the output queue, as-is.
+static void queue_output(Connection *conn, const char *data, size_t len)
+{
+    OutputChunk *chunk = conn->output_tail;
+    conn->output_queued += (uint32) len;
+    while (len > 0) {
+        if (!chunk || (chunk->end == MULTIZORKD_OUTPUT_CHUNK_SIZE)) {
+            chunk = append_output_chunk(conn);
+        }
+        const size_t avail = MULTIZORKD_OUTPUT_CHUNK_SIZE - chunk->end;
+        const size_t cpy = (len < avail) ? len : avail;
+        memcpy(chunk->data + chunk->end, data, cpy);
+        chunk->end += (uint32) cpy;
+        data += cpy;
+        len -= cpy;
+    }
+}
+
+// returns zero if this connection shouldn't get any more output. `len` is
+//  the most bytes this might add to the queue, after any escaping.
+static int can_write_to_connection(Connection *conn, const uintptr len)
+{
+    if (!conn || (conn->state != CONNSTATE_READY) || conn->output_overflow) {
+        return 0;
+    } else if ((conn->output_queued + len) > MULTIZORKD_OUTPUT_LIMIT) {
+        // we might be in the middle of running an instance, so service_dirty_connections() drops them later.
+        conn->output_overflow = 1;
+        mark_connection_dirty(conn);
+        return 0;
+    }
+    return 1;
+}
+
 // This queues a string for sending over the connection's socket when possible.
+//  We replace "\n" with "\r\n" because telnet is terrible, and double any
+//  0xFF bytes, so the client doesn't think they're the start of a telnet
+//  command (Interpret As Command). We let memchr() find those and copy
+//  everything between them in bulk, since libc makes memchr() fast.
 static void write_to_connection_slen(Connection *conn, const char *str, const uintptr slen)
 {
-    if (!conn || (conn->state != CONNSTATE_READY)) {
+    if (!can_write_to_connection(conn, slen * 2)) {  // worst case, every byte is a "\n" or 0xFF.
         return;
     }
 
-    const size_t needed_space = slen + count_newlines(str, slen);
-    const size_t avail = conn->outputbuf_len - conn->outputbuf_used;
-    if (avail < needed_space) {
-        void *ptr = realloc(conn->outputbuf, conn->outputbuf_len + needed_space + 1);
-        if (!ptr) {
-            panic("Uhoh, out of memory in write_to_connection");  // !!! FIXME: we could handle this more gracefully.
+    const char *end = str + slen;
+    const int has_iac = (memchr(str, 0xFF, slen) != NULL);  // this almost never happens, so check once up front.
+    const char *ptr = str;
+    while (ptr < end) {
+        const char *nl = (const char *) memchr(ptr, '\n', (size_t) (end - ptr));
+        const char *stop = nl ? nl : end;
+
+        if (has_iac) {
+            const char *iac;
+            while ((iac = (const char *) memchr(ptr, 0xFF, (size_t) (stop - ptr))) != NULL) {
+                queue_output(conn, ptr, (size_t) ((iac + 1) - ptr));
+                queue_output(conn, "\xFF", 1);
+                ptr = iac + 1;
+            }
         }
-        conn->outputbuf = (char *) ptr;
-        conn->outputbuf_len += needed_space;
-    }
 
-    // replace "\n" with "\r\n" because telnet is terrible.
-    for (size_t i = 0; i < slen; i++) {
-        const char ch = str[i];
-        if ( (ch == '\n') && ((i == 0) || (str[i-1] != '\r')) ) {
-            conn->outputbuf[conn->outputbuf_used++] = '\r';
-            conn->outputbuf[conn->outputbuf_used++] = '\n';
+        queue_output(conn, ptr, (size_t) (stop - ptr));
+        if (!nl) {
+            break;
+        } else if ((nl == str) || (nl[-1] != '\r')) {
+            queue_output(conn, "\r\n", 2);
         } else {
-            conn->outputbuf[conn->outputbuf_used++] = ch;
+            queue_output(conn, "\n", 1);  // already a "\r\n".
         }
+        ptr = nl + 1;
+    }
+
+    mark_connection_dirty(conn);
+}
+
+// This queues a telnet command (which starts with an IAC byte), so we don't
+//  escape it like write_to_connection() would.
+static void write_telnet_command(Connection *conn, const uint8 *cmd, const uintptr len)
+{
+    if (can_write_to_connection(conn, len)) {
+        queue_output(conn, (const char *) cmd, len);
+        mark_connection_dirty(conn);
     }
-    conn->outputbuf[conn->outputbuf_used] = '\0';  // make sure we're always null-terminated.
 }
 
 static void write_to_connection(Connection *conn, const char *str)
@@ -929,6 +1332,7 @@ static void drop_connection(Connection *conn)
     loginfo("Starting drop of connection for socket %d", conn->sock);
     write_to_connection(conn, "\n\n");  // make sure we are a new line.
     conn->state = CONNSTATE_DRAINING;   // flush any pending output to the socket first.
+    mark_connection_dirty(conn);
 
     Instance *inst = conn->instance;
     int players_still_connected = 0;
@@ -980,6 +1384,149 @@ static void broadcast_to_room(Instance *inst, const uint16 room, const char *str
     }
 }
 
+// the caller must hold GInstanceDirectoryMutex.
+static InstanceDirectoryEntry *get_instance_directory_entry(const Instance *inst)
+{
+    for (size_t i = 0; i < GInstanceDirectoryLen; i++) {
+        if (GInstanceDirectory[i].inst == inst) {
+            return &GInstanceDirectory[i];
+        }
+    }
+
+    if (GInstanceDirectoryLen >= GInstanceDirectoryAllocated) {
+        const size_t newalloc = GInstanceDirectoryAllocated ? (GInstanceDirectoryAllocated * 2) : 64;
+        void *ptr = realloc(GInstanceDirectory, sizeof (*GInstanceDirectory) * newalloc);
+        if (!ptr) {
+            panic("Uhoh, out of memory in get_instance_directory_entry");
+        }
+        GInstanceDirectory = (InstanceDirectoryEntry *) ptr;
+        GInstanceDirectoryAllocated = newalloc;
+    }
+
+    InstanceDirectoryEntry *entry = &GInstanceDirectory[GInstanceDirectoryLen++];
+    memset(entry, '\0', sizeof (*entry));
+    entry->inst = inst;
+    entry->owner = GWorker;
+    return entry;
+}
+
+// Add `inst` to the instance directory, or update its entry.
+static void register_instance(const Instance *inst)
+{
+    pthread_mutex_lock(&GInstanceDirectoryMutex);
+    InstanceDirectoryEntry *entry = get_instance_directory_entry(inst);
+    entry->dbid = inst->dbid;
+    memcpy(entry->hash, inst->hash, sizeof (entry->hash));
+    for (size_t i = 0; i < ARRAYSIZE(entry->player_hashes); i++) {
+        memcpy(entry->player_hashes[i], inst->players[i].hash, sizeof (entry->player_hashes[i]));
+    }
+    pthread_mutex_unlock(&GInstanceDirectoryMutex);
+}
+
+static void unregister_instance(const Instance *inst)
+{
+    pthread_mutex_lock(&GInstanceDirectoryMutex);
+    for (size_t i = 0; i < GInstanceDirectoryLen; i++) {
+        if (GInstanceDirectory[i].inst == inst) {
+            GInstanceDirectory[i] = GInstanceDirectory[--GInstanceDirectoryLen];  // move the last one into this slot.
+            break;
+        }
+    }
+    pthread_mutex_unlock(&GInstanceDirectoryMutex);
+}
+
+// Find a live instance by its game code, or (if `by_player`) by one of its
+//  players' access codes. `*_owner` is set to the worker running it, or NULL
+//  if it isn't live. We only return the instance itself if this worker owns it.
+static Instance *find_instance(const char *code, const int by_player, Worker **_owner)
+{
+    Instance *retval = NULL;
+    *_owner = NULL;
+    pthread_mutex_lock(&GInstanceDirectoryMutex);
+    // !!! FIXME: a hashtable would mean less searching.
+    for (size_t i = 0; (i < GInstanceDirectoryLen) && !*_owner; i++) {
+        InstanceDirectoryEntry *entry = &GInstanceDirectory[i];
+        int found = 0;
+        if (!by_player) {
+            found = (strcmp(entry->hash, code) == 0);
+        } else {
+            for (size_t j = 0; !found && (j < ARRAYSIZE(entry->player_hashes)); j++) {
+                found = (strcmp(entry->player_hashes[j], code) == 0);
+            }
+        }
+
+        if (found) {
+            *_owner = entry->owner;
+            retval = (entry->owner == GWorker) ? (Instance *) entry->inst : NULL;  // it's ours, so we're allowed to touch it.
+        }
+    }
+    pthread_mutex_unlock(&GInstanceDirectoryMutex);
+    return retval;
+}
+
+// Before bringing an archived instance back from the database, make sure
+//  no other worker has it (or is bringing it back, too). If no one does, this
+//  claims it for `inst` on this worker. Returns the worker that owns it.
+static Worker *claim_archived_instance(const Instance *inst, const sqlite3_int64 dbid)
+{
+    Worker *owner = NULL;
+    pthread_mutex_lock(&GInstanceDirectoryMutex);
+    for (size_t i = 0; (i < GInstanceDirectoryLen) && !owner; i++) {
+        if (GInstanceDirectory[i].dbid == dbid) {
+            owner = GInstanceDirectory[i].owner;
+        }
+    }
+
+    if (!owner) {
+        InstanceDirectoryEntry *entry = get_instance_directory_entry(inst);
+        entry->dbid = dbid;  // the hashes get filled in by register_instance() once it's loaded.
+        owner = entry->owner;
+    }
+    pthread_mutex_unlock(&GInstanceDirectoryMutex);
+    return owner;
+}
+
+// The worker that should run a new instance: the one with the fewest live
+//  instances, preferring this one in a tie, so we don't hand off for nothing.
+static Worker *least_busy_worker(void)
+{
+    Worker *retval = GWorker;
+    int lowest = -1;
+    pthread_mutex_lock(&GInstanceDirectoryMutex);
+    for (int i = 0; i < GNumWorkers; i++) {
+        Worker *worker = &GWorkers[(GWorker->num + i) % GNumWorkers];  // start with ours, so it wins ties.
+        int total = 0;
+        for (size_t j = 0; j < GInstanceDirectoryLen; j++) {
+            if (GInstanceDirectory[j].owner == worker) {
+                total++;
+            }
+        }
+        if ((lowest == -1) || (total < lowest)) {
+            lowest = total;
+            retval = worker;
+        }
+    }
+    pthread_mutex_unlock(&GInstanceDirectoryMutex);
+    return retval;
+}
+
+// Move a connection to another worker, to rerun `command` there. This
+//  finishes up in service_dirty_connections(). Returns zero if we can't,
+//  because this connection just got here by a handoff and things changed in
+//  the meantime; the caller should act like it didn't find what it wanted.
+static int handoff_connection(Connection *conn, Worker *worker, const char *command)
+{
+    if (conn->handing_off || (conn->state != CONNSTATE_READY)) {
+        return 0;
+    }
+
+    loginfo("Handing off socket %d from worker %d to worker %d.", conn->sock, GWorker->num, worker->num);
+    conn->handoff_to = worker;
+    snprintf(conn->handoff_command, sizeof (conn->handoff_command), "%s", command);
+    mark_connection_dirty(conn);
+    return 1;
+}
+
 static Player *get_current_player(Instance *inst)
 {
     assert(inst->current_player >= 0);
@@ -1023,6 +1570,33 @@ static uint16 remap_objectid(const uint16 objid)
     return (objid == ZORK1_PLAYER_OBJID) ? (external_mem_objects_base + inst->current_player) : objid;  // ZORK 1 SPECIFIC MAGIC
 }
 
+// ZORK 1 SPECIFIC MAGIC:
+//  Some globals are different for each player (where they are, if they're
+//  dead, etc). Rather than swap them in and out of Z-Machine memory on every
+//  step_instance(), we point the Z-Machine at the current player's copy.
+//  These are kept in the same byte order as Z-Machine memory.
+static uint8 *getGlobalPtr(const uint8 globalid)
+{
+    Instance *inst = (Instance *) GState;  // this works because zmachine_state is the first field in Instance.
+    if (inst->current_player >= 0) {
+        Player *player = &inst->players[inst->current_player];
+        switch (globalid) {
+            case 0: return (uint8 *) &player->gvar_location;
+            case 60: return (uint8 *) &player->gvar_lucky;
+            case 61: return (uint8 *) &player->gvar_deaths;
+            case 62: return (uint8 *) &player->gvar_dead;
+            case 66: return (uint8 *) &player->gvar_lit;
+            case 70: return (uint8 *) &player->gvar_superbrief;
+            case 71: return (uint8 *) &player->gvar_verbose;
+            case 72: return (uint8 *) &player->gvar_alwayslit;
+            case 133: return (uint8 *) &player->gvar_loadallowed;
+            case 139: return (uint8 *) &player->gvar_coffin_held;
+            default: break;
+        }
+    }
+    return GState->globals + (globalid * sizeof (uint16));
+}
+
 // see comments on getObjectProperty
 static uint8 *get_virtualized_mem_ptr(const uint16 offset)
 {
@@ -1065,6 +1639,40 @@ static uint8 *getObjectPtr(const uint16 _objid)
     return ptr;
 }
 
+// ZORK 1 SPECIFIC MAGIC:
+//  Some attributes are different for each player. Like the per-player
+//  globals, we point the Z-Machine at the current player's copy instead of
+//  swapping them into the object table on every step_instance(). Each one
+//  is a bitset in Player, one bit per object id. Each player's own object
+//  (and so its INVISIBLE and NDESCBIT) is already separate, so that doesn't
+//  need to be here.
+typedef struct PlayerAttributeOverlay
+{
+    uint16 attrid;
+    uint16 parentid;  // only for children of this object.
+    size_t bitset_offset;  // offsetof() the bitset in Player.
+} PlayerAttributeOverlay;
+
+static const PlayerAttributeOverlay player_attribute_overlays[] = {
+    { 3, 82, offsetof(Player, touchbits) },  // TOUCHBIT on rooms (all rooms are children of object #82), so everyone gets descriptions on their first visit.
+};
+
+static uint8 *getAttributeOverlay(const uint16 objid, const uint16 attrid, uint8 *_mask)
+{
+    Instance *inst = (Instance *) GState;  // this works because zmachine_state is the first field in Instance.
+    if ((inst->current_player >= 0) && (objid != 0) && (objid < ZORK1_EXTERN_MEM_OBJS_BASE)) {
+        for (size_t i = 0; i < ARRAYSIZE(player_attribute_overlays); i++) {
+            const PlayerAttributeOverlay *overlay = &player_attribute_overlays[i];
+            if ((overlay->attrid == attrid) && (getObjectRelative(objid, OBJREL_PARENT) == overlay->parentid)) {
+                uint8 *bitset = ((uint8 *) &inst->players[inst->current_player]) + overlay->bitset_offset;
+                *_mask = 1 << ((objid-1) % 8);
+                return &bitset[(objid-1) / 8];
+            }
+        }
+    }
+    return NULL;
+}
+
 // See notes on getObjectPointer(); we need to provide external memory for the multiplayer object property tables, too.
 //
 // ZORK 1 SPECIFIC MAGIC:
@@ -1080,7 +1688,6 @@ static uint8 *getObjectPtr(const uint16 _objid)
 static uint8 *getObjectProperty(const uint16 _objid, const uint32 propid, uint8 *_size)
 {
     const uint16 objid = remap_objectid(_objid);
-    uint8 *ptr;
     if (GState->header.version <= 3) {
         const uint16 external_mem_objects_base = ZORK1_EXTERN_MEM_OBJS_BASE;  // ZORK 1 SPECIFIC MAGIC
         if (objid >= external_mem_objects_base) {  // looking for a multiplayer character
@@ -1089,30 +1696,12 @@ static uint8 *getObjectProperty(const uint16 _objid, const uint32 propid, uint8
             if (requested_player >= inst->num_players) {
                 GState->die("Invalid multiplayer object id referenced");
             }
-            ptr = inst->players[requested_player].property_table_data;
+            return findObjectProperty(inst->players[requested_player].property_table_data, propid, _size);  // these are tiny and out of Z-Machine memory, don't index them.
         } else {
-            ptr = getObjectPtr(objid);
+            const uint8 *ptr = getObjectPtr(objid);
             ptr += 7;  // skip to properties address field.
             const uint16 addr = READUI16(ptr);
-            ptr = GState->story + addr;
-        }
-        ptr += (*ptr * 2) + 1;  // skip object name to start of properties.
-
-        while (1) {
-            const uint8 info = *(ptr++);
-            const uint16 num = (info & 0x1F);  // 5 bits for the prop id.
-            const uint8 size = ((info >> 5) & 0x7) + 1; // 3 bits for prop size.
-            // these go in descending numeric order, and should fail
-            //  the interpreter if missing. We use 0xFFFFFFFF internally to mean "first property".
-            if ((num == propid) || (propid == 0xFFFFFFFF)) { // found it?
-                if (_size) {
-                    *_size = size;
-                }
-                return ptr;
-            } else if (num < propid) { // we're past it.
-                break;
-            }
-            ptr += size;  // try the next property.
+            return getStoryObjectProperty(objid, addr, propid, _size);
         }
     } else {
         GState->die("write me");
@@ -1131,7 +1720,7 @@ static void writestr_multizork(const char *str, const uintptr slen)
 static void opcode_get_prop_addr_multizork(void)
 {
     Instance *inst = (Instance *) GState;  // this works because zmachine_state is the first field in Instance.
-    uint8 *store = varAddress(*(GState->pc++), 1, 0);
+    const uint8 storeid = *(GState->pc++);
     const uint16 objid = remap_objectid(GState->operands[0]);
     const uint16 propid = GState->operands[1];
     const uint16 external_mem_objects_base = ZORK1_EXTERN_MEM_OBJS_BASE;  // ZORK 1 SPECIFIC MAGIC
@@ -1149,7 +1738,7 @@ static void opcode_get_prop_addr_multizork(void)
     } else {
         result = ptr ? ((uint16) (ptr-GState->story)) : 0;
     }
-    WRITEUI16(store, result);
+    storeVariable(storeid, result, 0);
 }
 
 static void opcode_print_obj_multizork(void)
@@ -1224,6 +1813,25 @@ static void opcode_restore_multizork(void)
     GState->die("RESTORE opcode executed despite our best efforts. Should not have happened!");
 }
 
+// ZORK 1 SPECIFIC MAGIC: These are places where there is a hardcoded check for the ADVENTURER object index (4).
+//  There may be others I've missed. We used to patch the story bytes with the current multiplayer object,
+//  but now all the instances share decoded instructions, so we swap it into the operands here instead.
+static void opcode_je_multizork(void)
+{
+    Instance *inst = (Instance *) GState;  // this works because zmachine_state is the first field in Instance.
+    const uint16 playerobj = (uint16) (uint8) (ZORK1_EXTERN_MEM_OBJS_BASE + inst->current_player);
+    switch (GState->logical_pc) {
+        case 0x6B3D: GState->operands[1] = playerobj; break;  // 6b3d:  JE              G6f,#04 [TRUE] 6b47
+        case 0x93E2: GState->operands[1] = playerobj; break;  // 93e2:  JE              G6f,#04 [FALSE] 93fd
+        case 0x9410: GState->operands[0] = playerobj; break;  // 9410:  JE              #04,G6f [TRUE] 9424
+        case 0xD743: GState->operands[3] = playerobj; break;  // d743:  JE              L02,#bf,#72,#04 [TRUE] d7a4
+        case 0xE1AD: GState->operands[1] = playerobj; break;  // e1ad:  JE              G6f,#04 [FALSE] e1c0
+        case 0x6B86: GState->operands[1] = playerobj; break;  // 6b86:  JE              G6f,#04 [FALSE] 6b0e
+        default: break;
+    }
+    opcode_je();
+}
+
 static void opcode_restart_multizork(void)
 {
     GState->die("RESTART opcode executed despite our best efforts. Should not have happened!");
@@ -1263,22 +1871,36 @@ static Instance *create_instance(void)
 {
     Instance *inst = (Instance *) calloc(1, sizeof (Instance));
     if (inst) {
-        // !!! FIXME: if the z-machine didn't have to write to a portion of this data
-        // !!! FIXME:  (if we separate out the dynamic RAM section to a different part of ZMachineState
-        // !!! FIXME:  and update mojozork to work out of there) then we wouldn't need a full copy
-        // !!! FIXME:  of the game data for each instance. In practice, Zork 1 is 92160 bytes and
-        // !!! FIXME:  only the first 11859 bytes are dynamic, so you're looking at an almost 80 kilobyte
-        // !!! FIXME:  savings per instance here. But then again...80k ain't much in modern times.
-        uint8 *story = (uint8 *) malloc(GOriginalStoryLen);
+        // In Zork 1, only the first 11859 of 92160 bytes are dynamic, so if we can map the story
+        //  copy-on-write, every instance shares the other ~80 kilobytes and only owns the handful
+        //  of pages it actually writes to.
+        uint8 *story = NULL;
+        #if MOJOZORK_MMAP
+        if (GStoryImageFd != -1) {
+            story = mapStory(GStoryImageFd, GOriginalStoryLen);
+        }
+        const int mapped = story ? 1 : 0;
+        #endif
+
         if (!story) {
-            free(inst);
-            return NULL;
+            story = (uint8 *) malloc(GOriginalStoryLen);
+            if (!story) {
+                free(inst);
+                return NULL;
+            }
+            memcpy(story, GOriginalStory, GOriginalStoryLen);
         }
 
         inst->current_player = -1;
         GState = &inst->zmachine_state;
-        memcpy(story, GOriginalStory, GOriginalStoryLen);
-        initStory(GOriginalStoryName, story, GOriginalStoryLen);
+        #if MOJOZORK_MMAP
+        if (mapped) {
+            initMappedStory(GOriginalStoryName, story, GOriginalStoryLen);
+        } else
+        #endif
+        {
+            initStory(GOriginalStoryName, story, GOriginalStoryLen);
+        }
         for (size_t i = 0; i < ARRAYSIZE(inst->players); i++) {
             inst->players[i].next_logical_pc = GState->logical_pc;  // set all players to game entry point.
         }
@@ -1298,6 +1920,36 @@ static Instance *create_instance(void)
         for (uint8 i = 192; i <= 223; i++)  // 2OP opcodes repeating with VAR operand forms.
             GState->opcodes[i] = GState->opcodes[i % 32];
 
+        // only the operand forms the hardcoded player checks use, so other JEs can still run inline.
+        GState->opcodes[33].fn = opcode_je_multizork;  // small constant, variable
+        GState->opcodes[65].fn = opcode_je_multizork;  // variable, small constant
+        GState->opcodes[193].fn = opcode_je_multizork;  // VAR form
+
+        if (GSharedDictionaryIndex) {
+            shareDictionaryIndex(GState, GSharedDictionaryIndex);
+        } else if (GState->dictionary_index) {
+            GSharedDictionaryIndex = GState->dictionary_index;
+            GSharedDictionaryIndex->refcount++;
+        }
+
+        #if MOJOZORK_STRING_CACHE
+        if (!GSharedStringCache) {
+            GSharedStringCache = createStringCache();  // if this fails, this instance just makes its own later.
+        }
+        if (GSharedStringCache) {
+            shareStringCache(GState, GSharedStringCache);
+        }
+        #endif
+
+        #if MOJOZORK_DECODE_CACHE
+        if (!GSharedDecodeCache) {
+            GSharedDecodeCache = createDecodeCache();  // if this fails, this instance just makes its own later.
+        }
+        if (GSharedDecodeCache) {
+            shareDecodeCache(GState, GSharedDecodeCache);
+        }
+        #endif
+
         GState->writestr = writestr_multizork;
         GState->die = die_multizork;
         GState = NULL;
@@ -1334,59 +1986,21 @@ static int step_instance(Instance *inst, const int playernum, const char *input)
 
     GState->logical_pc = player->next_logical_pc;
     GState->pc = GState->story + GState->logical_pc;
-    GState->sp = GState->stack + player->next_logical_sp;
     GState->bp = player->next_logical_bp;
-    assert(player->next_logical_sp < ARRAYSIZE(player->stack));
-    memcpy(GState->stack, player->stack, player->next_logical_sp * 2);
-    uint16 *globals = (uint16 *) (GState->story + GState->header.globals_addr);
+    swapStack(&player->stack, &player->stack_allocated, &player->next_logical_sp);  // the player's stack goes in, the last one comes out.
+    uint16 *globals = (uint16 *) GState->globals;
 
-    // ZORK 1 SPECIFIC MAGIC:
-    // some "globals" are player-specific, so we swap them in before running.
-    globals[0] = player->gvar_location;
-    globals[60] = player->gvar_lucky;
-    globals[61] = player->gvar_deaths;
-    globals[62] = player->gvar_dead;
-    globals[66] = player->gvar_lit;
-    globals[70] = player->gvar_superbrief;
-    globals[71] = player->gvar_verbose;
-    globals[72] = player->gvar_alwayslit;
-    globals[133] = player->gvar_loadallowed;
-    globals[139] = player->gvar_coffin_held;
+    // the player-specific globals and TOUCHBITs don't need to be swapped in, see getGlobalPtr() and getAttributeOverlay().
 
     // ZORK 1 SPECIFIC MAGIC: save the WONFLAG value before this step runs.
     const uint16 starting_wonflag = globals[140];
 
-    // ZORK 1 SPECIFIC MAGIC:
-    // re-set the TOUCHBITs for all rooms for the current player.
-    uint8 *roomobjptr = getObjectPtr(1);
-    for (int i = 1; i <= 250; i++, roomobjptr += 9) {
-        const uint8 parent = roomobjptr ? roomobjptr[4] : 0;
-        if (parent != 82) { continue; } // in Zork 1, all rooms are children of object #82.
-        const uint8 *bitptr = &player->touchbits[(i-1) / 8];
-        const uint8 flag = 1 << ((i-1) % 8);
-        const int isset = (*bitptr & flag) ? 1 : 0;
-        if (isset) {
-            *roomobjptr |= (0x80 >> 3);  // in zork1, TOUCHBIT is attribute 3.
-        } else {
-            *roomobjptr &= ~(0x80 >> 3);  // in zork1, TOUCHBIT is attribute 3.
-        }
-    }
-
     // ZORK 1 SPECIFIC MAGIC:
     // PLAYER global points to this player's object.
     uint8 *glob111 = (uint8 *) &globals[111];
     const uint16 playerobj = external_mem_objects_base + playernum;
     WRITEUI16(glob111, playerobj);
 
-    // ZORK 1 SPECIFIC MAGIC: Thse are places where there is a hardcoded check for the ADVENTURER object index (4).
-    //  There may be others I've missed. Patch those index values to be the current multiplayer object.
-    const uint8 playerobj8 = (uint8) playerobj;
-    GState->story[0x6B3F] = playerobj8;  // 6b3d:  JE              G6f,#04 [TRUE] 6b47
-    GState->story[0x93E4] = playerobj8;  // 93e2:  JE              G6f,#04 [FALSE] 93fd
-    GState->story[0x9411] = playerobj8;  // 9410:  JE              #04,G6f [TRUE] 9424
-    GState->story[0xD748] = playerobj8;  // d743:  JE              L02,#bf,#72,#04 [TRUE] d7a4
-    GState->story[0xE1AF] = playerobj8;  // e1ad:  JE              G6f,#04 [FALSE] e1c0
-    GState->story[0x6B88] = playerobj8;  // 6b86:  JE              G6f,#04 [FALSE] 6b0e
 
     // If user had hit a READ instruction. Write the user's
     //  input to Z-Machine memory, and tokenize it.
@@ -1423,45 +2037,12 @@ static int step_instance(Instance *inst, const int playernum, const char *input)
     // Now run the Z-Machine!
     if (setjmp(inst->jmpbuf) == 0) {
         GState->step_completed = 0;  // opcode_quit or opcode_read, etc.
-        while (!GState->step_completed) {
-            runInstruction();
-        }
+        runZMachine();
 
-        // save off Z-Machine state for next time.
+        // save off Z-Machine state for next time. The stack might have moved if it grew, so this swaps back whatever is there now.
         player->next_logical_pc = GState->logical_pc;
-        player->next_logical_sp = (uint32) (GState->sp - GState->stack);
         player->next_logical_bp = GState->bp;
-        assert(player->next_logical_sp < ARRAYSIZE(player->stack));
-        memcpy(player->stack, GState->stack, player->next_logical_sp * 2);
-
-        // ZORK 1 SPECIFIC MAGIC:
-        // some "globals" are player-specific, so we swap them out after running.
-        player->gvar_location = globals[0];
-        player->gvar_lucky = globals[60];
-        player->gvar_deaths = globals[61];
-        player->gvar_dead = globals[62];
-        player->gvar_lit = globals[66];
-        player->gvar_superbrief = globals[70];
-        player->gvar_verbose = globals[71];
-        player->gvar_alwayslit = globals[72];
-        player->gvar_loadallowed = globals[133];
-        player->gvar_coffin_held = globals[139];
-
-        // ZORK 1 SPECIFIC MAGIC:
-        // save off the TOUCHBIT for the player's current location, so we know they've already been there.
-        roomobjptr = getObjectPtr(1);
-        for (int i = 1; i <= 250; i++, roomobjptr += 9) {
-            const uint8 parent = roomobjptr ? roomobjptr[4] : 0;
-            if (parent != 82) { continue; } // in Zork 1, all rooms are children of object #82.
-            const int isset = ((*roomobjptr) & (0x80 >> 3)) ? 1 : 0;  // in zork1, TOUCHBIT is attribute 3.
-            uint8 *bitptr = &player->touchbits[(i-1) / 8];
-            const uint8 flag = 1 << ((i-1) % 8);
-            if (isset) {
-                *bitptr |= flag;
-            } else {
-                *bitptr &= ~flag;
-            }
-        }
+        swapStack(&player->stack, &player->stack_allocated, &player->next_logical_sp);
 
         // ZORK 1 SPECIFIC MAGIC:
         // Did WONFLAG get set? Player triggered the endgame this step!
@@ -1497,6 +2078,7 @@ static int step_instance(Instance *inst, const int playernum, const char *input)
         }
     } else {
         // uhoh, the Z-machine called die(). Kill this instance.
+        swapStack(&player->stack, &player->stack_allocated, &player->next_logical_sp);  // so everything gets freed correctly.
         broadcast_to_instance(inst, "\n\n*** Oh no, this game instance had a fatal error, so we're jumping ship! ***\n\n\n");
         free_instance(inst);
         retval = 0;
@@ -1535,7 +2117,7 @@ static void start_instance(Instance *inst)
 
     // !!! FIXME: split this out to a separate function.
     GState = &inst->zmachine_state;
-    uint16 *globals = (uint16 *) (GState->story + GState->header.globals_addr);
+    uint16 *globals = (uint16 *) GState->globals;
     const uint8 *playerptr = GState->story + GState->header.objtab_addr;
     playerptr += 31 * sizeof (uint16);  // skip properties defaults table
     playerptr += 9 * (ZORK1_PLAYER_OBJID-1);  // find object in object table  // ZORK 1 SPECIFIC MAGIC
@@ -1600,6 +2182,7 @@ static void start_instance(Instance *inst)
 
         snprintf(player->againbuf, sizeof (player->againbuf), "verbose");  // typing "again" as the first command appears to do "verbose". Beats me.
 
+        dbokay = dbokay && init_player_stack(player, NULL, 0);  // not a database thing, but failing here works the same way.
         dbokay = dbokay && generate_unique_hash(player->hash);  // assign a hash to the player while we're here so they can rejoin.
 
         snprintf(player->username, sizeof (player->username), "%s", conn->username);
@@ -1625,15 +2208,16 @@ static void start_instance(Instance *inst)
     GState = NULL;
 
     const uint8 orig_start_room_child = startroomptr[6];
-    uint32 outputbuf_used_at_start[ARRAYSIZE(inst->players)];
+    uint32 output_queued_at_start[ARRAYSIZE(inst->players)];
 
     // run a step right now, so they get the intro text and their next input will be for the game.
     for (int i = 0; i < num_players; i++) {
-        outputbuf_used_at_start[i] = inst->players[i].connection ? inst->players[i].connection->outputbuf_used : 0;
+        output_queued_at_start[i] = inst->players[i].connection ? inst->players[i].connection->output_queued : 0;
         // just this once, reset the Z-Machine between each player, so that we end up with
         //  one definite state and things like intro text gets run...
         // This just resets the dynamic memory. The rest of the address space is immutable.
         memcpy(inst->zmachine_state.story, GOriginalStory, ((size_t) inst->zmachine_state.header.staticmem_addr));
+        dynamicMemoryReplaced(&inst->zmachine_state);
 
         // ZORK 1 SPECIFIC MAGIC:
         // Insert all the players into the West of House room each time. The
@@ -1657,6 +2241,7 @@ static void start_instance(Instance *inst)
             opcode_clear_attr();
         }
         startroomptr[6] = external_mem_objects_base;  // make players start of child list for start room.
+        dynamicMemoryWritten((uint32) ((startroomptr + 6) - GState->story), 1);
         GState = NULL;
 
         // PLAYER global points to this player's object.
@@ -1681,7 +2266,9 @@ static void start_instance(Instance *inst)
                 player->dbid = db_insert_player(inst, i);
                 dbokay = dbokay && (player->dbid != 0);
                 if (player->connection) {
-                    dbokay = dbokay && db_insert_transcript(player->dbid, TT_GAME_OUTPUT, player->connection->outputbuf + outputbuf_used_at_start[i]);
+                    char *output = copy_recent_output(player->connection, output_queued_at_start[i]);
+                    dbokay = dbokay && db_insert_transcript(player->dbid, TT_GAME_OUTPUT, output);
+                    free(output);
                 }
             }
         }
@@ -1692,6 +2279,8 @@ static void start_instance(Instance *inst)
 
     if (!dbokay) {
         db_failed_at_instance_start(inst);
+    } else {
+        register_instance(inst);  // now it has player access codes to find it by.
     }
 }
 
@@ -1730,13 +2319,17 @@ static void free_instance(Instance *inst)
     }
 
     save_instance(inst);
+    unregister_instance(inst);
+
+    for (size_t i = 0; i < ARRAYSIZE(inst->players); i++) {
+        free(inst->players[i].stack);
+    }
 
     if (GState == &inst->zmachine_state) {
         GState = NULL;
     }
 
-    free(inst->zmachine_state.story);
-    free(inst->zmachine_state.story_filename);
+    unloadStory(&inst->zmachine_state);
     free(inst);
 }
 
@@ -1784,7 +2377,7 @@ static void inpfn_confirm_quit(Connection *conn, const char *str)
 static void inpfn_ingame(Connection *conn, const char *str)
 {
     Instance *inst = conn->instance;
-    uint32 newoutput_start = conn->outputbuf_used;
+    uint32 newoutput_start = conn->output_queued;
     int playernum;
     Player *player = find_connection_player(conn, &playernum);
     char msg[256];
@@ -1834,7 +2427,7 @@ static void inpfn_ingame(Connection *conn, const char *str)
             broadcast_to_room(inst, player->gvar_location, msg);
         }
         // skip this output: the broadcast_* functions already transcribed it (current_player is still -1 since we aren't stepping the instance yet).
-        newoutput_start = conn->outputbuf_used;
+        newoutput_start = conn->output_queued;
     } else {
         const uint16 loc = player->gvar_location;
         player->gvar_location = 0;  // so we don't broadcast to ourselves.
@@ -1854,8 +2447,10 @@ static void inpfn_ingame(Connection *conn, const char *str)
         }
     }
 
-    if (conn->outputbuf_used > newoutput_start) {  // new output to transcribe?
-        db_insert_transcript(player->dbid, TT_GAME_OUTPUT, conn->outputbuf + newoutput_start);
+    if (conn->output_queued > newoutput_start) {  // new output to transcribe?
+        char *output = copy_recent_output(conn, newoutput_start);
+        db_insert_transcript(player->dbid, TT_GAME_OUTPUT, output);
+        free(output);
     }
 
     db_end_transaction();
@@ -1951,15 +2546,10 @@ static void inpfn_enter_instance_code_to_join(Connection *conn, const char *str)
     }
         
     if (strlen(str) == 6) {
-        // !!! FIXME: maintaining a list of instances means up to 4x less
-        // !!! FIXME:  searches than looking through the connections to
-        // !!! FIXME:  find it. A hashtable even more so.
-        for (size_t i = 0; i < num_connections; i++) {
-            Connection *c = connections[i];
-            if (c->instance && (strcmp(c->instance->hash, str) == 0)) {
-                inst = c->instance;
-                break;
-            }
+        Worker *owner = NULL;
+        inst = find_instance(str, 0, &owner);
+        if (owner && (owner != GWorker) && handoff_connection(conn, owner, str)) {
+            return;  // we'll finish this on the worker that runs that game.
         }
     }
 
@@ -2008,6 +2598,11 @@ static void inpfn_new_game_or_join(Connection *conn, const char *str)
 {
     if (strcmp(str, "1") == 0) {  // new game
         assert(!conn->instance);
+        Worker *worker = least_busy_worker();
+        if ((worker != GWorker) && handoff_connection(conn, worker, str)) {
+            return;  // we'll start it on a worker that isn't as busy.
+        }
+
         conn->instance = create_instance();
         if (!conn->instance) {
             write_to_connection(conn, "Uhoh, we appear to be out of memory. Try again later?\n");
@@ -2025,6 +2620,7 @@ static void inpfn_new_game_or_join(Connection *conn, const char *str)
         }
 
         loginfo("Created new instance '%s'", conn->instance->hash);
+        register_instance(conn->instance);  // so others can find it to join.
 
         conn->instance->players[0].connection = conn;
         write_to_connection(conn, "Okay! Tell your friends to telnet here, too, and join game '");
@@ -2097,26 +2693,26 @@ static Player *reconnect_player(Connection *conn, const char *access_code)
     }
 
     // See if we're rejoining a live game...
-    // !!! FIXME: maintaining a list of instances means a lot less
-    // !!! FIXME:  searches than looking through the connections to
-    // !!! FIXME:  find it. A hashtable even more so.
-    for (size_t i = 0; i < num_connections; i++) {
-        Connection *c = connections[i];
-        Instance *inst = c->instance;
-        if (inst) {
-            for (int i = 0; i < inst->num_players; i++) {
-                Player *player = &inst->players[i];
-                if (strcmp(player->hash, access_code) == 0) {
-                    if (player->connection != NULL) {
-                        write_to_connection(conn, "Hmmm, that's a valid access code, but it's currently in use by another connection.\n");
-                        return NULL;
-                    }
-                    player->connection = conn;   // just wire right back in and go.
-                    conn->instance = inst;
-                    conn->inputfn = inpfn_ingame;
-                    snprintf(conn->username, sizeof (conn->username), "%s", player->username);
-                    return player;
+    Worker *owner = NULL;
+    Instance *live = find_instance(access_code, 1, &owner);
+    if (owner && (owner != GWorker)) {
+        if (!handoff_connection(conn, owner, access_code)) {
+            write_to_connection(conn, "Hmm, that's a valid access code, but I couldn't get you to that game.\n");
+        }
+        return NULL;  // if we handed off, the worker that runs that game will finish this.
+    } else if (live) {
+        for (int i = 0; i < live->num_players; i++) {
+            Player *player = &live->players[i];
+            if (strcmp(player->hash, access_code) == 0) {
+                if (player->connection != NULL) {
+                    write_to_connection(conn, "Hmmm, that's a valid access code, but it's currently in use by another connection.\n");
+                    return NULL;
                 }
+                player->connection = conn;   // just wire right back in and go.
+                conn->instance = live;
+                conn->inputfn = inpfn_ingame;
+                snprintf(conn->username, sizeof (conn->username), "%s", player->username);
+                return player;
             }
         }
     }
@@ -2128,14 +2724,23 @@ static Player *reconnect_player(Connection *conn, const char *access_code)
         return NULL;
     }
 
-    // !!! FIXME: assert this instance definitely isn't live right now.
     Instance *inst = create_instance();
     if (!inst) {
         write_to_connection(conn, "Hmm, that's a valid access code, but I seem to have run out of memory! Try again later.\n");
         return NULL;
     }
 
-    if (!db_select_instance(inst, instance_dbid)) {
+    // make sure another worker isn't bringing this one back at the same time.
+    owner = claim_archived_instance(inst, instance_dbid);
+    if (owner != GWorker) {
+        free_instance(inst);
+        if (!handoff_connection(conn, owner, access_code)) {
+            write_to_connection(conn, "Hmm, that's a valid access code, but I couldn't get you to that game.\n");
+        }
+        return NULL;
+    }
+
+    if (!db_select_instance(inst, instance_dbid)) {
         write_to_connection(conn, "Hmm, that's a valid access code, but I had trouble starting the game! Try again later.\n");
         free_instance(inst);
         return NULL;
@@ -2157,6 +2762,7 @@ static Player *reconnect_player(Connection *conn, const char *access_code)
     db_trim_recap(inst);
 
     loginfo("Rehydrated archived instance '%s'", inst->hash);
+    register_instance(inst);
 
     for (int i = 0; i < inst->num_players; i++) {
         Player *player = &inst->players[i];
@@ -2208,7 +2814,9 @@ static void inpfn_hello_sailor(Connection *conn, const char *str)
         // look up player code.
         Player *player = reconnect_player(conn, str);
         if (!player) {
-            write_to_connection(conn, "Try another code, or just press enter.\n");
+            if (!conn->handoff_to) {
+                write_to_connection(conn, "Try another code, or just press enter.\n");
+            }
             return;
         }
 
@@ -2251,6 +2859,16 @@ static void sanitize_to_low_ascii(char *str)
     }
 }
 
+static void run_connection_command(Connection *conn, const char *str)
+{
+    conn->inputfn(conn, str);
+    if ((conn->state == CONNSTATE_READY) && !conn->handoff_to) {  // if we're handing off, the other worker will prompt.
+        if (conn->inputfn != inpfn_ingame) {  // if in-game, the Z-Machine writes a prompt itself.
+            write_to_connection(conn, "\n>");  // prompt.
+        }
+    }
+}
+
 static void process_connection_command(Connection *conn)
 {
     conn->inputbuf[conn->inputbuf_used] = '\0';  // null-terminate the input.
@@ -2263,39 +2881,42 @@ static void process_connection_command(Connection *conn)
         return;  // don't process this input further.
     }
 
-    conn->inputfn(conn, conn->inputbuf);
-    if (conn->state == CONNSTATE_READY) {
-        if (conn->inputfn != inpfn_ingame) {  // if in-game, the Z-Machine writes a prompt itself.
-            write_to_connection(conn, "\n>");  // prompt.
-        }
-    }
+    run_connection_command(conn, conn->inputbuf);
 }
 
-// this queues data from the actual socket, and if there's a complete command,
-//  we process it in here. We only read a little at a time instead of reading
-//  until the socket is empty to give everyone a chance.
-static void recv_from_connection(Connection *conn)
+// input that arrives while a connection is handing off to another worker
+//  waits here, so the commands run in order over there. So does input that
+//  io_uring had already read when we paused a connection for backed-up output.
+static void stash_pending_input(Connection *conn, const char *buf, const int br)
 {
-    if (conn->state != CONNSTATE_READY) {
-        return;
+    const uint32 avail = MULTIZORKD_PENDING_INPUT_LIMIT - conn->pending_input_used;
+    uint32 len = (uint32) br;
+    if (len > avail) {
+        loginfo("Socket %d sent too much input while we weren't reading it, dropping some.", conn->sock);
+        len = avail;
     }
 
-    char buf[128];
-    const int br = recv(conn->sock, buf, sizeof (buf), 0);
-    //loginfo("Got %d from recv on socket %d", br, conn->sock);
-    if (br == -1) {
-        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-            return;  // okay, just means there's nothing else to read.
+    if ((conn->pending_input_used + len) > conn->pending_input_allocated) {
+        uint32 newalloc = conn->pending_input_allocated ? conn->pending_input_allocated : 512;
+        while (newalloc < (conn->pending_input_used + len)) {
+            newalloc *= 2;
         }
-        loginfo("Socket %d has an error while receiving, dropping. (%s)", conn->sock, strerror(errno));
-        drop_connection(conn);  // some other problem.
-        return;
-    } else if (br == 0) {  // socket has disconnected.
-        loginfo("Socket %d has disconnected.", conn->sock);
-        drop_connection(conn);
-        return;
+        void *ptr = realloc(conn->pending_input, newalloc);
+        if (!ptr) {
+            panic("Uhoh, out of memory in stash_pending_input");
+        }
+        conn->pending_input = (char *) ptr;
+        conn->pending_input_allocated = newalloc;
     }
 
+    memcpy(conn->pending_input + conn->pending_input_used, buf, len);
+    conn->pending_input_used += len;
+}
+
+// this queues data that arrived on the socket, and if there's a complete
+//  command, we process it in here.
+static void process_connection_input(Connection *conn, const char *buf, const int br)
+{
     conn->last_activity = GNow;
 
     int avail = (int) ((sizeof (conn->inputbuf) - 1) - conn->inputbuf_used);
@@ -2309,8 +2930,8 @@ static void recv_from_connection(Connection *conn)
                     i++;
                     // !!! FIXME: fails on a buffer edge.
                     if (i < br) {
-                        const unsigned char wont[4] = { 255, 252, (unsigned char) buf[i], 0 };  // WONT do requested action.
-                        write_to_connection(conn, (const char *) wont);
+                        const uint8 wont[3] = { 255, 252, (uint8) buf[i] };  // WONT do requested action.
+                        write_telnet_command(conn, wont, sizeof (wont));
                     }
                 } else if (((unsigned char) buf[i]) >= 250) {  // ignore everything else.
                     i++;
@@ -2327,6 +2948,10 @@ static void recv_from_connection(Connection *conn)
             conn->overlong_input = 0;
             conn->inputbuf_used = 0;
             avail = sizeof (conn->inputbuf) - 1;
+            if (conn->handoff_to) {  // moving to another worker? It gets the rest of this.
+                stash_pending_input(conn, buf + (i + 1), br - (i + 1));
+                return;
+            }
         } else if ((ch >= 32) && (ch < 127)) {  // basic ASCII only, sorry.
             if (!avail) {
                 conn->overlong_input = 1;  // drop this command.
@@ -2338,93 +2963,415 @@ static void recv_from_connection(Connection *conn)
     }
 }
 
+// run anything stash_pending_input() held on to. If `until_backed_up` is
+//  non-zero, we stop when the connection has too much output waiting and
+//  keep the rest for later, like we do when reading from the socket.
+static void process_pending_input(Connection *conn, const int until_backed_up)
+{
+    char *buf = conn->pending_input;  // take this, since handing off again stashes more.
+    const uint32 total = conn->pending_input_used;
+    conn->pending_input = NULL;
+    conn->pending_input_used = conn->pending_input_allocated = 0;
+
+    uint32 done = 0;
+    while ((done < total) && (conn->state == CONNSTATE_READY) && !conn->handoff_to) {
+        if (until_backed_up && output_is_backed_up(conn)) {
+            break;
+        }
+        const uint32 len = ((total - done) < sizeof (conn->inputbuf)) ? (total - done) : (uint32) sizeof (conn->inputbuf);
+        process_connection_input(conn, buf + done, (int) len);
+        done += len;
+    }
+
+    if ((done < total) && (conn->state == CONNSTATE_READY)) {
+        stash_pending_input(conn, buf + done, (int) (total - done));  // (after anything a new handoff stashed.)
+    }
+    free(buf);
+}
+
+#if !MULTIZORKD_IO_URING
+// this reads data from the actual socket, a little at a time. With poll(),
+//  we do one read each time the socket is ready, to give everyone a chance.
+//  Edge-triggered epoll won't tell us again about data we left behind, so
+//  that loop calls this until the socket is empty (or input gets paused).
+//  (io_uring has its own recv, see recv_from_connection_completed().)
+// returns non-zero if we got data and there might be more waiting.
+static int recv_from_connection(Connection *conn)
+{
+    if ((conn->state != CONNSTATE_READY) || conn->handoff_to) {
+        return 0;  // (if handing off, the other worker reads it.)
+    } else if (output_is_backed_up(conn)) {
+        conn->input_paused = 1;  // leave it in the socket until they catch up on output, see send_to_connection().
+        return 0;
+    }
+
+    char buf[128];
+    const int br = recv(conn->sock, buf, sizeof (buf), 0);
+    //loginfo("Got %d from recv on socket %d", br, conn->sock);
+    if (br == -1) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            return 0;  // okay, just means there's nothing else to read.
+        }
+        loginfo("Socket %d has an error while receiving, dropping. (%s)", conn->sock, strerror(errno));
+        drop_connection(conn);  // some other problem.
+        return 0;
+    } else if (br == 0) {  // socket has disconnected.
+        loginfo("Socket %d has disconnected.", conn->sock);
+        drop_connection(conn);
+        return 0;
+    }
+
+    process_connection_input(conn, buf, br);
+    return 1;
+}
+#endif
+
+#if !MULTIZORKD_IO_URING
+// we stopped reading from this connection while its output backed up; start again.
+static void resume_input(Connection *conn)
+{
+    conn->input_paused = 0;
+    #if MULTIZORKD_EPOLL
+    // edge-triggered, so we won't hear about input that arrived in the meantime unless we ask again.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    epoll_ctl(GEpollFd, EPOLL_CTL_MOD, conn->sock, &event);
+    #endif
+}
+
 // this sends data queued by write_to_connection() down the actual socket.
 static void send_to_connection(Connection *conn)
 {
-    if (conn->outputbuf_used == 0) {
+    if (conn->output_queued == 0) {
         return;  // nothing to send atm.
     } else if (conn->state > CONNSTATE_DRAINING) {
-        conn->outputbuf_used = 0;  // just make sure we don't poll() for this again.
+        discard_output(conn);  // just make sure we don't poll() for this again.
+        return;
+    }
+
+    while (conn->output_queued > 0) {
+        struct iovec iov[MULTIZORKD_OUTPUT_IOVECS];
+        const int iovcnt = get_output_iovecs(conn, iov, MULTIZORKD_OUTPUT_IOVECS);
+        size_t total = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            total += iov[i].iov_len;
+        }
+
+        const ssize_t bw = writev(conn->sock, iov, iovcnt);
+        if ((bw == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            break;  // okay, just means try again later.
+        } else if (bw <= 0) {
+            if (bw == -1) {
+                loginfo("Socket %d has an error while sending, dropping. (%s)", conn->sock, strerror(errno));
+            } else {
+                loginfo("Socket %d has disconnected without warning.", conn->sock);
+            }
+            drop_connection(conn);  // some other problem.
+            if (conn->state == CONNSTATE_DRAINING) {
+                conn->state = CONNSTATE_CLOSING;  // give up.
+                discard_output(conn);
+                mark_connection_dirty(conn);
+            }
+            return;
+        }
+
+        // Still here? We got more data.
+        consume_output(conn, (uint32) bw);
+        if (((size_t) bw) < total) {
+            break;  // the socket is full, we'll hear about it when there's room.
+        }
+    }
+
+    if (conn->input_paused && !output_is_backed_up(conn)) {
+        resume_input(conn);
+    }
+
+    if ((conn->state == CONNSTATE_DRAINING) && (conn->output_queued == 0)) {
+        loginfo("Finished draining output buffer for socket %d, moving to close.", conn->sock);
+        conn->state = CONNSTATE_CLOSING;
+        mark_connection_dirty(conn);
+    }
+}
+#else
+static void arm_recv_for_connection(Connection *conn)
+{
+    // multishot: this keeps producing completions, each with a buffer the kernel picked from GUringBufRing, until it fails or we cancel it.
+    struct io_uring_sqe *sqe = get_uring_sqe();
+    io_uring_prep_recv_multishot(sqe, conn->sock, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = MULTIZORKD_URING_BUFGROUP;
+    io_uring_sqe_set_data64(sqe, uring_tag(conn, URING_OP_RECV));
+    conn->uring_receiving = 1;
+    conn->uring_pending++;
+}
+
+// stop reading from this connection until its output drains, see send_to_connection_completed().
+static void pause_input(Connection *conn)
+{
+    conn->input_paused = 1;
+    if (conn->uring_receiving) {
+        struct io_uring_sqe *sqe = get_uring_sqe();
+        io_uring_prep_cancel64(sqe, uring_tag(conn, URING_OP_RECV), 0);
+        io_uring_sqe_set_data64(sqe, uring_tag(NULL, URING_OP_IGNORE));
+    }
+}
+
+static void resume_input(Connection *conn)
+{
+    conn->input_paused = 0;
+    process_pending_input(conn, 1);  // whatever came in before the cancel took effect.
+    if ((conn->state != CONNSTATE_READY) || conn->handoff_to) {
+        return;
+    } else if (output_is_backed_up(conn)) {
+        conn->input_paused = 1;  // that made more output than they can take, wait some more.
+    } else if (!conn->uring_receiving) {  // (if the cancelled recv hasn't finished yet, it rearms itself when it does.)
+        arm_recv_for_connection(conn);
+    }
+}
+
+// this hands data queued by write_to_connection() to io_uring. It doesn't
+//  go to the kernel until the next trip through wait_for_events(), so
+//  everything queued during a loop iteration is submitted together.
+//  We keep one send in flight per connection, so output stays in order.
+//  The kernel reads straight out of the output chunks; write_to_connection()
+//  only ever adds past what we gave it, and nothing is consumed until the
+//  send completes.
+static void send_to_connection(Connection *conn)
+{
+    if (conn->state > CONNSTATE_DRAINING) {
+        if (!conn->uring_sending) {
+            discard_output(conn);  // just make sure we don't try to send this again.
+        }
         return;
+    } else if (conn->uring_sending || conn->handoff_to) {
+        return;  // we'll get back to this when the current send finishes (or on the worker we're handing off to).
+    } else if (conn->output_queued == 0) {
+        return;  // nothing to send atm.
     }
 
-    const ssize_t bw = send(conn->sock, conn->outputbuf, conn->outputbuf_used, 0);
-    if ((bw == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
-        return;  // okay, just means try again later.
-    } else if (bw <= 0) {
-        if (bw == -1) {
-            loginfo("Socket %d has an error while sending, dropping. (%s)", conn->sock, strerror(errno));
+    memset(&conn->uring_msg, '\0', sizeof (conn->uring_msg));
+    conn->uring_msg.msg_iov = conn->uring_iov;
+    conn->uring_msg.msg_iovlen = (size_t) get_output_iovecs(conn, conn->uring_iov, MULTIZORKD_OUTPUT_IOVECS);
+
+    struct io_uring_sqe *sqe = get_uring_sqe();
+    io_uring_prep_sendmsg(sqe, conn->sock, &conn->uring_msg, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, uring_tag(conn, URING_OP_SEND));
+    conn->uring_sending = 1;
+    conn->uring_pending++;
+}
+
+static void send_to_connection_completed(Connection *conn, const int res)
+{
+    conn->uring_sending = 0;
+    if (conn->state > CONNSTATE_DRAINING) {
+        return;  // we've already given up on this one.
+    } else if ((res == -EAGAIN) || (res == -EINTR)) {
+        mark_connection_dirty(conn);  // try again next time.
+        return;
+    } else if (res <= 0) {
+        if (res < 0) {
+            loginfo("Socket %d has an error while sending, dropping. (%s)", conn->sock, strerror(-res));
         } else {
             loginfo("Socket %d has disconnected without warning.", conn->sock);
         }
         drop_connection(conn);  // some other problem.
         if (conn->state == CONNSTATE_DRAINING) {
             conn->state = CONNSTATE_CLOSING;  // give up.
-            conn->outputbuf_used = 0;
+            discard_output(conn);
+            mark_connection_dirty(conn);
         }
         return;
     }
 
-    // Still here? We got more data.
-
-    assert(bw <= conn->outputbuf_used);
+    consume_output(conn, (uint32) res);
 
-    if (((uint32) bw) < conn->outputbuf_used) {  /* !!! FIXME: lazy, not messing with pointers here. */
-        memmove(conn->outputbuf, conn->outputbuf + bw, conn->outputbuf_used - bw);
+    if (conn->input_paused && !output_is_backed_up(conn) && (conn->state == CONNSTATE_READY) && !conn->handoff_to) {
+        resume_input(conn);
     }
 
-    conn->outputbuf_used -= (uint32) bw;
-
-    if ((conn->state == CONNSTATE_DRAINING) && (conn->outputbuf_used == 0)) {
+    if (conn->output_queued > 0) {
+        mark_connection_dirty(conn);  // partial send, or more output showed up in the meantime.
+    } else if (conn->state == CONNSTATE_DRAINING) {
         loginfo("Finished draining output buffer for socket %d, moving to close.", conn->sock);
         conn->state = CONNSTATE_CLOSING;
+        mark_connection_dirty(conn);
     }
 }
 
-static int accept_new_connection(const int listensock)
+static void recv_from_connection_completed(Connection *conn, const int res, const uint32 flags)
 {
-    Connection *conn = NULL;
-    struct sockaddr_storage addr;
-    socklen_t addrlen = (socklen_t) sizeof (addr);
-    const int sock = accept(listensock, (struct sockaddr *) &addr, &addrlen);
-    if (sock == -1) {
-        loginfo("accept() reported an error! We ignore it! (%s)", strerror(errno));
-        return -1;
+    if (flags & IORING_CQE_F_BUFFER) {
+        const uint16 bid = (uint16) (flags >> IORING_CQE_BUFFER_SHIFT);
+        char *buf = GUringBuffers + (((size_t) bid) * MULTIZORKD_URING_BUFSIZE);
+        if ((res > 0) && (conn->state == CONNSTATE_READY)) {
+            if (conn->handoff_to || conn->input_paused) {
+                stash_pending_input(conn, buf, res);  // the recv is being cancelled, but this got here first.
+            } else {
+                process_connection_input(conn, buf, res);
+                if ((conn->state == CONNSTATE_READY) && !conn->handoff_to && output_is_backed_up(conn)) {
+                    pause_input(conn);
+                }
+            }
+        }
+        // give the buffer back to the kernel.
+        io_uring_buf_ring_add(GUringBufRing, buf, MULTIZORKD_URING_BUFSIZE, bid, io_uring_buf_ring_mask(MULTIZORKD_URING_BUFFERS), 0);
+        io_uring_buf_ring_advance(GUringBufRing, 1);
     }
 
-    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) == -1) {
-        loginfo("Failed to set newly-accept()'d socket as non-blocking! Dropping! (%s)", strerror(errno));
-        close(sock);
-        return -1;
+    if (res == 0) {  // socket has disconnected.
+        if (!conn->uring_shutdown) {
+            loginfo("Socket %d has disconnected.", conn->sock);
+        }
+        drop_connection(conn);
+    } else if ((res < 0) && (res != -ENOBUFS) && (res != -ECANCELED)) {  // ENOBUFS just means we're busy and need to rearm.
+        loginfo("Socket %d has an error while receiving, dropping. (%s)", conn->sock, strerror(-res));
+        drop_connection(conn);  // some other problem.
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) {  // the kernel is done with this recv.
+        conn->uring_receiving = 0;
+        conn->uring_pending--;
+        if ((conn->state == CONNSTATE_READY) && !conn->handoff_to && !conn->input_paused) {
+            arm_recv_for_connection(conn);
+        }
+    }
+}
+#endif
+
+static void free_connection(Connection *conn)
+{
+    free(conn->pending_input);
+    OutputChunk *next;
+    for (OutputChunk *chunk = conn->output_head; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    free(conn);
+}
+
+static void remove_connection(Connection *conn)
+{
+    assert(connections[conn->index] == conn);
+    num_connections--;
+    if (conn->index != num_connections) {  // move the last one into this slot.
+        connections[conn->index] = connections[num_connections];
+        connections[conn->index]->index = conn->index;
     }
+}
+
+// returns non-zero if the connection was closed and freed.
+static int close_connection(Connection *conn)
+{
+    assert(conn->state == CONNSTATE_CLOSING);
+
+    #if MULTIZORKD_IO_URING
+    if (conn->uring_pending) {  // the kernel still has requests pointing at this connection, wait for them to finish.
+        if (!conn->uring_shutdown && (conn->sock >= 0)) {
+            conn->uring_shutdown = 1;
+            shutdown(conn->sock, SHUT_RDWR);  // makes a stuck send fail and the recv report a disconnect.
+            struct io_uring_sqe *sqe = get_uring_sqe();
+            io_uring_prep_cancel_fd(sqe, conn->sock, IORING_ASYNC_CANCEL_ALL);
+            io_uring_sqe_set_data64(sqe, uring_tag(NULL, URING_OP_IGNORE));
+        }
+        return 0;
+    }
+    #endif
+
+    #if MULTIZORKD_EPOLL
+    if (conn->sock >= 0) {
+        epoll_ctl(GEpollFd, EPOLL_CTL_DEL, conn->sock, NULL);  // closing would do this too, unless the socket was dup()'d somewhere.
+    }
+    #endif
 
+    const int rc = (conn->sock < 0) ? 0 : close(conn->sock);
+    // closed, or failed for a reason other than still trying to flush final writes, dump it.
+    if ((rc == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+        loginfo("Closed socket %d, removing connection object. %d current connections.", conn->sock, (int) (num_connections-1));
+        remove_connection(conn);
+        free_connection(conn);
+        return 1;
+    }
+    return 0;
+}
+
+// put a connection in this worker's event loop. Returns zero on failure.
+static int attach_connection(Connection *conn)
+{
     void *ptr = realloc(connections, sizeof (*connections) * (num_connections + 1));
     if (!ptr) {
-        loginfo("Uhoh, out of memory, dropping new connection in socket %d!", sock);
-        close(sock);
-        return -1;
+        return 0;
     }
     connections = (Connection **) ptr;
+    conn->input_paused = 0;  // if we're still backed up, we'll notice again.
+
+    #if MULTIZORKD_EPOLL
+    // edge-triggered: we only hear about a socket when something changes, so we have to read and write until EAGAIN.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (epoll_ctl(GEpollFd, EPOLL_CTL_ADD, conn->sock, &event) == -1) {
+        loginfo("Failed to add socket %d to epoll! (%s)", conn->sock, strerror(errno));
+        return 0;
+    }
+    #elif MULTIZORKD_IO_URING
+    arm_recv_for_connection(conn);
+    #endif
+
+    conn->index = num_connections;
+    connections[num_connections++] = conn;
+    return 1;
+}
+
+// take a connection out of this worker's event loop (without closing it),
+//  so we can hand it to another worker. Returns zero if that has to wait.
+static int detach_connection(Connection *conn)
+{
+    #if MULTIZORKD_IO_URING
+    if (conn->uring_pending) {  // the kernel still has requests pointing at this connection, wait for them to finish.
+        if (!conn->uring_detaching) {
+            conn->uring_detaching = 1;  // stop receiving. Sends in flight can just finish.
+            struct io_uring_sqe *sqe = get_uring_sqe();
+            io_uring_prep_cancel64(sqe, uring_tag(conn, URING_OP_RECV), 0);
+            io_uring_sqe_set_data64(sqe, uring_tag(NULL, URING_OP_IGNORE));
+        }
+        return 0;
+    }
+    conn->uring_detaching = 0;
+    #elif MULTIZORKD_EPOLL
+    epoll_ctl(GEpollFd, EPOLL_CTL_DEL, conn->sock, NULL);
+    #endif
 
-    connections[num_connections] = (Connection *) calloc(1, sizeof (*conn));
-    conn = connections[num_connections];
+    remove_connection(conn);
+    return 1;
+}
+
+// this sets up a Connection for a socket that was just accepted.
+static int add_new_connection(const int sock, const struct sockaddr *addr, const socklen_t addrlen)
+{
+    Connection *conn = (Connection *) calloc(1, sizeof (*conn));
     if (conn == NULL) {
         loginfo("Uhoh, out of memory, dropping new connection in socket %d!", sock);
         close(sock);
         return -1;
     }
 
-    num_connections++;
-
     conn->sock = sock;
     conn->inputfn = inpfn_hello_sailor;
     conn->last_activity = GNow;
 
-    if (getnameinfo((struct sockaddr *) &addr, addrlen, conn->address, sizeof (conn->address), NULL, 0, NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
+    if (!attach_connection(conn)) {
+        loginfo("Uhoh, couldn't add new connection in socket %d, dropping it!", sock);
+        close(sock);
+        free(conn);
+        return -1;
+    }
+
+    if (getnameinfo(addr, addrlen, conn->address, sizeof (conn->address), NULL, 0, NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
         snprintf(conn->address, sizeof (conn->address), "???");
     }
 
-    loginfo("New connection from %s (socket %d). %d current connections.", conn->address, sock, num_connections);
+    loginfo("New connection from %s (socket %d) on worker %d. %d current connections.", conn->address, sock, GWorker->num, (int) num_connections);
 
     const sqlite_int64 blocked_timestamp = db_select_blocked(conn->address);
     const int block_length = (int) (((sqlite_int64) GNow) - blocked_timestamp);
@@ -2442,6 +3389,29 @@ static int accept_new_connection(const int listensock)
     return sock;
 }
 
+#if !MULTIZORKD_IO_URING
+static int accept_new_connection(const int listensock)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = (socklen_t) sizeof (addr);
+    const int sock = accept(listensock, (struct sockaddr *) &addr, &addrlen);
+    if (sock == -1) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {  // EAGAIN: another worker got to it first.
+            loginfo("accept() reported an error! We ignore it! (%s)", strerror(errno));
+        }
+        return -1;
+    }
+
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        loginfo("Failed to set newly-accept()'d socket as non-blocking! Dropping! (%s)", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return add_new_connection(sock, (const struct sockaddr *) &addr, addrlen);
+}
+#endif
+
 static int prep_listen_socket(const int port, const int backlog)
 {
     char service[32];
@@ -2479,6 +3449,10 @@ static int prep_listen_socket(const int port, const int backlog)
             loginfo("Failed to listen() on the listen socket! Will try other options! (%s)", strerror(errno));
             close(fd);
             continue;
+        } else if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {  // several workers wait on this, and only one gets each connection.
+            loginfo("Failed to set the listen socket as non-blocking! Will try other options! (%s)", strerror(errno));
+            close(fd);
+            continue;
         }
 
         freeaddrinfo(ainfo);
@@ -2492,7 +3466,7 @@ static int prep_listen_socket(const int port, const int backlog)
 
 static void loadInitialStory(const char *fname)
 {
-    uint8 *story;
+    uint8 *story = NULL;
     FILE *io;
     long len;
 
@@ -2502,27 +3476,166 @@ static void loadInitialStory(const char *fname)
         panic("Failed to open '%s'", fname);
     } else if ((fseek(io, 0, SEEK_END) == -1) || ((len = ftell(io)) == -1)) {
         panic("Failed to determine size of '%s'", fname);
-    } else if ((story = (uint8 *) malloc(len)) == NULL) {
-        panic("Out of memory");
-    } else if ((fseek(io, 0, SEEK_SET) == -1) || (fread(story, len, 1, io) != 1)) {
-        panic("Failed to read '%s'", fname);
+    }
+
+    GOriginalStoryName = fname;
+    GOriginalStoryLen = (uint32) len;
+
+    #if MOJOZORK_MMAP
+    // If we can map the file, instances map it too, so static and high memory
+    //  come from the OS's page cache once, no matter how many instances (or
+    //  multizorkd processes) are running it. Don't overwrite the story file
+    //  in place while the server is running! Rename a new one over it instead.
+    if (len > 0) {
+        void *ptr = mmap(NULL, (size_t) len, PROT_READ, MAP_PRIVATE, fileno(io), 0);
+        if (ptr != MAP_FAILED) {
+            story = (uint8 *) ptr;
+            GOriginalStoryMapped = 1;
+            GStoryImageFd = dup(fileno(io));  // if this fails, instances just get their own copies.
+            if (GStoryImageFd != -1) {
+                fcntl(GStoryImageFd, F_SETFD, FD_CLOEXEC);
+            }
+        }
+    }
+    #endif
+
+    if (!story) {
+        if ((story = (uint8 *) malloc(len)) == NULL) {
+            panic("Out of memory");
+        } else if ((fseek(io, 0, SEEK_SET) == -1) || (fread(story, len, 1, io) != 1)) {
+            panic("Failed to read '%s'", fname);
+        }
     }
 
     fclose(io);
 
-    GOriginalStoryName = fname;
     GOriginalStory = story;
-    GOriginalStoryLen = (uint32) len;
+
+    #if MOJOZORK_MMAP && defined(__linux__)
+    if (GStoryImageFd != -1) {
+        return;  // we're all set.
+    }
+
+    // put a copy in an in-memory file that every instance can map, so they share static and high memory.
+    GStoryImageFd = memfd_create("multizorkd-story", MFD_CLOEXEC);
+    if (GStoryImageFd == -1) {
+        loginfo("Couldn't create shared story image (%s), instances will get their own copies.", strerror(errno));
+    } else {
+        const uint8 *ptr = story;
+        size_t remaining = (size_t) len;
+        while (remaining > 0) {
+            const ssize_t br = write(GStoryImageFd, ptr, remaining);
+            if ((br == -1) && (errno == EINTR)) {
+                continue;
+            } else if (br <= 0) {
+                loginfo("Couldn't write shared story image (%s), instances will get their own copies.", strerror(errno));
+                close(GStoryImageFd);
+                GStoryImageFd = -1;
+                break;
+            }
+            ptr += br;
+            remaining -= (size_t) br;
+        }
+    }
+    #endif
+}
+
+
+static void wake_worker(Worker *worker)
+{
+    const char ch = 0;
+    const ssize_t rc = write(worker->wakefds[1], &ch, 1);  // if this fails because the pipe is full, it's waking up anyhow.
+    (void) rc;
 }
 
+static void wake_all_workers(void)
+{
+    for (int i = 0; i < GNumWorkers; i++) {
+        wake_worker(&GWorkers[i]);
+    }
+}
 
-static int GStopServer = 0;
+static volatile sig_atomic_t GShutdownRequested = 0;  // the signal that asked us to shut down, zero if none has.
+static MOJOZORK_THREAD_LOCAL int GStopServer = 0;  // this worker's progress through shutting down.
 static void signal_handler_shutdown(int sig)
 {
-    if (GStopServer == 0) {
-        loginfo("PROCESS RECEIVED SIGNAL %d, SHUTTING DOWN!", sig);
-        GStopServer = 1;
+    if (GShutdownRequested == 0) {
+        GShutdownRequested = sig;  // the workers will log it, loginfo() isn't signal-safe.
+        wake_all_workers();
+    }
+}
+
+#if MOJOZORK_PROFILING
+static volatile sig_atomic_t GProfileReportRequested = 0;  // bumped for each request, so every worker notices it.
+static MOJOZORK_THREAD_LOCAL sig_atomic_t GProfileReportsDone = 0;
+static void signal_handler_profile(int sig)
+{
+    GProfileReportRequested++;  // the workers will dump it, printf isn't signal-safe.
+    wake_all_workers();
+}
+#endif
+
+// this runs on the worker that's giving a connection away, once it's out of that worker's event loop.
+static void give_connection_to_worker(Connection *conn)
+{
+    Worker *worker = conn->handoff_to;
+    pthread_mutex_lock(&worker->handoff_mutex);
+    if (worker->num_handoffs >= worker->handoffs_allocated) {
+        const size_t newalloc = worker->handoffs_allocated ? (worker->handoffs_allocated * 2) : 16;
+        void *ptr = realloc(worker->handoffs, sizeof (*worker->handoffs) * newalloc);
+        if (!ptr) {
+            panic("Uhoh, out of memory in give_connection_to_worker");
+        }
+        worker->handoffs = (Connection **) ptr;
+        worker->handoffs_allocated = newalloc;
+    }
+    worker->handoffs[worker->num_handoffs++] = conn;
+    pthread_mutex_unlock(&worker->handoff_mutex);
+    wake_worker(worker);
+}
+
+// put connections other workers handed us in our event loop, and pick up
+//  where they left off.
+static void accept_handoffs(void)
+{
+    char buf[64];
+    while (read(GWorker->wakefds[0], buf, sizeof (buf)) > 0) { /* just empty the pipe. */ }
+
+    pthread_mutex_lock(&GWorker->handoff_mutex);
+    Connection **handoffs = GWorker->handoffs;
+    const size_t total = GWorker->num_handoffs;
+    GWorker->handoffs = NULL;
+    GWorker->num_handoffs = 0;
+    GWorker->handoffs_allocated = 0;
+    pthread_mutex_unlock(&GWorker->handoff_mutex);
+
+    for (size_t i = 0; i < total; i++) {
+        Connection *conn = handoffs[i];
+        conn->handoff_to = NULL;
+        if (!attach_connection(conn)) {
+            loginfo("Uhoh, couldn't take handoff of socket %d, dropping it!", conn->sock);
+            close(conn->sock);
+            free_connection(conn);
+            continue;
+        }
+
+        loginfo("Socket %d is now on worker %d.", conn->sock, GWorker->num);
+        mark_connection_dirty(conn);  // send anything that was queued before the handoff.
+
+        if (GStopServer) {
+            write_to_connection(conn, "\n\n\nThis server is shutting down!\n\n");
+            drop_connection(conn);
+            continue;
+        }
+
+        conn->handing_off = 1;
+        run_connection_command(conn, conn->handoff_command);
+        conn->handing_off = 0;
+
+        process_pending_input(conn, 0);
     }
+
+    free(handoffs);
 }
 
 static void drop_privileges(const gid_t egid, const uid_t euid)
@@ -2557,167 +3670,371 @@ static void drop_privileges(const gid_t egid, const uid_t euid)
     }
 }
 
-int main(int argc, char **argv)
+#if MULTIZORKD_IO_URING
+static void arm_accept(const int listensock)
 {
-    const char *storyfname = NULL;
-    int port = MULTIZORKD_DEFAULT_PORT;
-    int backlog = MULTIZORKD_DEFAULT_BACKLOG;
-    gid_t egid = MULTIZORKD_DEFAULT_EGID;
-    uid_t euid = MULTIZORKD_DEFAULT_EUID;
+    // multishot: one request keeps accepting connections until it fails or we cancel it.
+    struct io_uring_sqe *sqe = get_uring_sqe();
+    io_uring_prep_multishot_accept(sqe, listensock, NULL, NULL, 0);
+    io_uring_sqe_set_data64(sqe, uring_tag(NULL, URING_OP_ACCEPT));
+}
 
-    setvbuf(stdout, NULL, _IOLBF, 0);  // make sure output is line-buffered.
-    setvbuf(stderr, NULL, _IOLBF, 0);  // make sure output is line-buffered.
+static void arm_wake(void)
+{
+    struct io_uring_sqe *sqe = get_uring_sqe();
+    io_uring_prep_poll_multishot(sqe, GWorker->wakefds[0], POLLIN);
+    io_uring_sqe_set_data64(sqe, uring_tag(NULL, URING_OP_WAKE));
+}
 
-    for (int i = 1; i < argc; i++) {
-        const char *arg = argv[i];
-        if (strcmp(arg, "--gid") == 0) {
-            i++;
-            egid = (gid_t) (argv[i] ? atoi(argv[i]) : 0);
-        } else if (strcmp(arg, "--uid") == 0) {
-            i++;
-            euid = (uid_t) (argv[i] ? atoi(argv[i]) : 0);
-        } else if (strcmp(arg, "--port") == 0) {
-            i++;
-            port = argv[i] ? atoi(argv[i]) : 0;
-        } else if (strcmp(arg, "--backlog") == 0) {
-            i++;
-            backlog = argv[i] ? atoi(argv[i]) : 0;
+static void init_uring(const int listensock)
+{
+    int rc = io_uring_queue_init(MULTIZORKD_URING_ENTRIES, &GUring, 0);
+    if (rc < 0) {
+        panic("Failed to create io_uring instance! (%s)", strerror(-rc));
+    }
+
+    GUringBuffers = (char *) malloc(((size_t) MULTIZORKD_URING_BUFFERS) * MULTIZORKD_URING_BUFSIZE);
+    if (!GUringBuffers) {
+        panic("Uhoh, out of memory allocating io_uring receive buffers!");
+    }
+
+    GUringBufRing = io_uring_setup_buf_ring(&GUring, MULTIZORKD_URING_BUFFERS, MULTIZORKD_URING_BUFGROUP, 0, &rc);
+    if (!GUringBufRing) {
+        panic("Failed to register io_uring receive buffers! (%s)", strerror(-rc));
+    }
+
+    for (int i = 0; i < MULTIZORKD_URING_BUFFERS; i++) {
+        io_uring_buf_ring_add(GUringBufRing, GUringBuffers + (((size_t) i) * MULTIZORKD_URING_BUFSIZE), MULTIZORKD_URING_BUFSIZE, (unsigned short) i, io_uring_buf_ring_mask(MULTIZORKD_URING_BUFFERS), i);
+    }
+    io_uring_buf_ring_advance(GUringBufRing, MULTIZORKD_URING_BUFFERS);
+
+    arm_accept(listensock);
+    arm_wake();
+}
+
+static void quit_uring(void)
+{
+    io_uring_free_buf_ring(&GUring, GUringBufRing, MULTIZORKD_URING_BUFFERS, MULTIZORKD_URING_BUFGROUP);
+    io_uring_queue_exit(&GUring);
+    free(GUringBuffers);
+    GUringBufRing = NULL;
+    GUringBuffers = NULL;
+}
+
+static void accept_completed(const int listensock, const int res, const uint32 flags)
+{
+    if (res >= 0) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = (socklen_t) sizeof (addr);
+        if (getpeername(res, (struct sockaddr *) &addr, &addrlen) == -1) {
+            loginfo("getpeername() failed on newly-accepted socket %d! Dropping! (%s)", res, strerror(errno));
+            close(res);
         } else {
-            if (storyfname != NULL) {
-                panic("Tried to choose two story files! '%s' and '%s'", storyfname, arg);
-            }
-            storyfname = arg;
+            add_new_connection(res, (const struct sockaddr *) &addr, addrlen);
         }
+    } else if (res != -ECANCELED) {
+        loginfo("accept() reported an error! We ignore it! (%s)", strerror(-res));
     }
 
-    if (!storyfname) {
-        storyfname = "zork1.dat";
+    if (!(flags & IORING_CQE_F_MORE) && !GStopServer) {
+        arm_accept(listensock);  // the kernel stopped accepting for us, ask again.
+    }
+}
+
+// submit everything we queued since last time (new sends, rearmed receives,
+//  cancellations) in one system call, wait for something to finish, and
+//  deal with every completion that's ready.
+static void wait_for_events(const int listensock)
+{
+    int rc;
+    if (GStopServer && !num_connections) {
+        rc = io_uring_submit(&GUring);
+    } else {
+        rc = io_uring_submit_and_wait(&GUring, 1);
+    }
+
+    if ((rc < 0) && (rc != -EINTR)) {  /* ignore EINTR and just run the loop. */
+        panic("io_uring_submit_and_wait() reported an error! (%s). Giving up.", strerror(-rc));
     }
 
     GNow = time(NULL);
-    srandom((unsigned long) GNow);
 
-    loginfo("multizork daemon " MULTIZORKD_VERSION " (built " __DATE__ " " __TIME__ ") starting up...");
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+    unsigned int seen = 0;
+    io_uring_for_each_cqe(&GUring, head, cqe) {
+        const uint64 data = io_uring_cqe_get_data64(cqe);
+        Connection *conn = (Connection *) (uintptr_t) (data & ~((uint64) URING_OP_MASK));
+        switch ((UringOp) (data & URING_OP_MASK)) {
+            case URING_OP_ACCEPT: accept_completed(listensock, cqe->res, cqe->flags); break;
+            case URING_OP_RECV: recv_from_connection_completed(conn, cqe->res, cqe->flags); break;
+            case URING_OP_SEND: conn->uring_pending--; send_to_connection_completed(conn, cqe->res); break;
+            case URING_OP_WAKE:
+                accept_handoffs();  // another thread woke us up.
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    arm_wake();
+                }
+                break;
+            case URING_OP_IGNORE: break;
+        }
+        seen++;
+    }
+    io_uring_cq_advance(&GUring, seen);
+}
+#elif !MULTIZORKD_EPOLL
+// wait for socket activity with poll(), and deal with it.
+static void wait_for_events(const int listensock, struct pollfd **_pollfds, size_t *_pollfds_allocated)
+{
+    // make sure there's room for everything, plus the listen socket and wake pipe, plus one more in case we accept a new connection.
+    if (*_pollfds_allocated < (num_connections + 3)) {
+        const size_t newalloc = (num_connections + 3) * 2;
+        void *ptr = realloc(*_pollfds, sizeof (struct pollfd) * newalloc);
+        if (!ptr) {
+            panic("Uhoh, out of memory reallocating pollfds!");
+        }
+        *_pollfds = (struct pollfd *) ptr;
+        *_pollfds_allocated = newalloc;
+    }
 
-    signal(SIGPIPE, SIG_IGN);
-    signal(SIGINT, signal_handler_shutdown);
-    signal(SIGTERM, signal_handler_shutdown);
-    signal(SIGQUIT, signal_handler_shutdown);
+    struct pollfd *pollfds = *_pollfds;
+    pollfds[0].fd = listensock;
+    pollfds[0].events = POLLIN | POLLOUT;
+    pollfds[0].revents = 0;
+    pollfds[1].fd = GWorker->wakefds[0];
+    pollfds[1].events = POLLIN;
+    pollfds[1].revents = 0;
+    for (size_t i = 0; i < num_connections; i++) {
+        const Connection *conn = connections[i];
+        pollfds[i+2].fd = conn->sock;
+        pollfds[i+2].events = output_is_backed_up(conn) ? 0 : POLLIN;  // stop reading if they aren't keeping up with output.
+        if (conn->output_queued > 0) {
+            pollfds[i+2].events |= POLLOUT;
+        }
+        pollfds[i+2].revents = 0;
+    }
 
-    loadInitialStory(storyfname);
+    const size_t total = num_connections + 2;
+    int pollrc;
+    if (GStopServer && !num_connections) {
+        pollrc = 0;
+    } else if (GStopServer) {
+        pollrc = poll(pollfds + 1, total - 1, -1);  // don't listen for new connections.
+    } else {
+        pollrc = poll(pollfds, total, -1);
+    }
 
-    db_init();
+    if (pollrc == -1) {
+        if (errno != EINTR) {  /* ignore EINTR and just run the loop. */
+            panic("poll() reported an error! (%s). Giving up.", strerror(errno));
+        }
+    }
 
-    struct pollfd *pollfds = NULL;
+    GNow = time(NULL);
 
-    pollfds = (struct pollfd *) calloc(1, sizeof (struct pollfd));
-    if (!pollfds) {
-        panic("Out of memory creating pollfd array!");
+    for (size_t i = 0; i < total; i++) {
+        const short revents = pollfds[i].revents;
+        if (revents == 0) { continue; }  // nothing happening here.
+        if (pollfds[i].fd < 0) { continue; }   // not a socket in use.
+
+        //loginfo("New activity on socket %d", pollfds[i].fd);
+
+        if (i == 0) {  // new connection.
+            assert(pollfds[0].fd == listensock);
+            if (revents & POLLERR) {
+                panic("Listen socket had an error! Giving up!");
+            }
+            assert(revents & POLLIN);
+            if (accept_new_connection(listensock) != -1) {
+                pollfds[num_connections + 1].fd = -1;  // we'll add it to the array next time.
+                pollfds[num_connections + 1].revents = 0;
+            }
+        } else if (i == 1) {  // another thread woke us up.
+            accept_handoffs();
+        } else {
+            Connection *conn = connections[i-2];
+            if (revents & POLLIN) {
+                recv_from_connection(conn);
+            }
+            if (revents & (POLLOUT | POLLHUP | POLLERR)) {  // (we might not be asking for POLLIN, so catch hangups here.)
+                send_to_connection(conn);
+            }
+        }
+    }
+}
+#else
+// wait for socket activity with epoll, and deal with it. Connections are
+//  registered once, in accept_new_connection(), and only the sockets that
+//  did something show up here.
+static void wait_for_events(const int listensock)
+{
+    struct epoll_event events[MULTIZORKD_EPOLL_EVENTS];
+    int rc;
+    if (GStopServer && !num_connections) {
+        rc = 0;
+    } else {
+        rc = epoll_wait(GEpollFd, events, MULTIZORKD_EPOLL_EVENTS, -1);
     }
 
-    const int listensock = prep_listen_socket(port, backlog);
-    if (listensock == -1) {
-        panic("Can't go on without a listen socket!");
+    if (rc == -1) {
+        if (errno != EINTR) {  /* ignore EINTR and just run the loop. */
+            panic("epoll_wait() reported an error! (%s). Giving up.", strerror(errno));
+        }
+        rc = 0;
     }
 
-    drop_privileges(egid, euid);
+    GNow = time(NULL);
 
-    loginfo("Running with story '%s'", storyfname);
-    loginfo("Now accepting connections on port %d (socket %d).", port, listensock);
+    for (int i = 0; i < rc; i++) {
+        const uint32_t revents = events[i].events;
+        if (events[i].data.ptr == GWorker) {  // another thread woke us up.
+            accept_handoffs();
+            continue;
+        }
 
-    while (GStopServer < 3) {
-        pollfds[0].fd = listensock;
-        pollfds[0].events = POLLIN | POLLOUT;
-        for (size_t i = 0; i < num_connections; i++) {
-            const Connection *conn = connections[i];
-            pollfds[i+1].fd = conn->sock;
-            pollfds[i+1].events = (conn->outputbuf_used > 0) ? (POLLIN | POLLOUT) : POLLIN;
-            pollfds[i+1].revents = 0;
+        Connection *conn = (Connection *) events[i].data.ptr;
+        if (conn == NULL) {  // new connection. The listen socket is level-triggered, so we take one per wakeup, like the poll() path.
+            if (revents & EPOLLERR) {
+                panic("Listen socket had an error! Giving up!");
+            }
+            accept_new_connection(listensock);
+            continue;
         }
 
-        int pollrc;
-        if (GStopServer && !num_connections) {
-            pollrc = 0;
-        } else if (GStopServer) {
-            pollrc = poll(pollfds + 1, num_connections, -1);
-        } else {
-            pollrc = poll(pollfds, num_connections + 1, -1);
+        if (revents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            while (recv_from_connection(conn)) { /* we won't be told again, so read until there's nothing left. */ }
+        }
+        if (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+            send_to_connection(conn);
+        }
+    }
+}
+#endif
+
+// Send queued output, and close finished connections, for everything that
+//  changed since the last time through the event loop.
+static void service_dirty_connections(void)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < num_dirty_connections; i++) {  // this can grow as we go, if dropping one connection writes to others.
+        Connection *conn = dirty_connections[i];
+        if (conn->output_overflow && (conn->state == CONNSTATE_READY)) {
+            loginfo("Socket %d isn't reading its output, dropping.", conn->sock);
+            drop_connection(conn);
+            conn->state = CONNSTATE_CLOSING;  // don't bother flushing a megabyte to someone who isn't listening.
+        }
+
+        if (conn->handoff_to) {
+            if (conn->state != CONNSTATE_READY) {
+                conn->handoff_to = NULL;  // it dropped before it could move, just finish it here.
+            } else {
+                if (detach_connection(conn)) {
+                    conn->dirty = 0;
+                    give_connection_to_worker(conn);  // the other worker sends whatever output is queued.
+                } else {
+                    dirty_connections[kept++] = conn;  // try again next time.
+                }
+                continue;
+            }
         }
 
-        if (pollrc == -1) {
-            if (errno != EINTR) {  /* ignore EINTR and just run the loop. */
-                panic("poll() reported an error! (%s). Giving up.", strerror(errno));
+        send_to_connection(conn);  // conn->dirty is still set, so this doesn't add it again.
+        if (conn->state == CONNSTATE_CLOSING) {
+            if (!close_connection(conn)) {
+                dirty_connections[kept++] = conn;  // try again next time.
             }
+            continue;
         }
+        conn->dirty = 0;
+    }
+    num_dirty_connections = kept;
+}
 
-        GNow = time(NULL);
+// per-worker setup, on the worker's own thread.
+static void init_worker(Worker *worker)
+{
+    GWorker = worker;
+    GNow = time(NULL);
 
-        for (size_t i = 0; i <= num_connections; i++) {
-            const short revents = pollfds[i].revents;
-            if (revents == 0) { continue; }  // nothing happening here.
-            if (pollfds[i].fd < 0) { continue; }   // not a socket in use.
+    db_init();
 
-            //loginfo("New activity on socket %d", pollfds[i].fd);
+    #if MULTIZORKD_EPOLL
+    GEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (GEpollFd == -1) {
+        panic("Failed to create epoll instance! (%s)", strerror(errno));
+    }
 
-            if (i == 0) {  // new connection.
-                assert(pollfds[0].fd == listensock);
-                if (revents & POLLERR) {
-                    panic("Listen socket had an error! Giving up!");
-                }
-                assert(revents & POLLIN);
-                const int sock = accept_new_connection(listensock);
-                if (sock != -1) {
-                    void *ptr = realloc(pollfds, sizeof (struct pollfd) * (num_connections + 1));
-                    if (ptr == NULL) {
-                        close(sock);  // just drop them, oh well.
-                        num_connections--;
-                        loginfo("Uhoh, out of memory reallocating pollfds!");
-                    } else {
-                        pollfds = (struct pollfd *) ptr;
-                        pollfds[num_connections].fd = sock;
-                        pollfds[num_connections].events = POLLIN;
-                        pollfds[num_connections].revents = 0;
-                    }
-                }
-            } else {
-                Connection *conn = connections[i-1];
-                if (revents & POLLIN) {
-                    recv_from_connection(conn);
-                }
-                if (revents & POLLOUT) {
-                    send_to_connection(conn);
-                }
+    // every worker waits on the same listen socket, and the kernel gives each new connection to one of them.
+    struct epoll_event listenevent;
+    listenevent.events = EPOLLIN;  // level-triggered, unlike the connections.
+    #ifdef EPOLLEXCLUSIVE
+    listenevent.events |= EPOLLEXCLUSIVE;  // don't wake up every worker for each new connection.
+    #endif
+    listenevent.data.ptr = NULL;  // NULL means the listen socket.
+    if (epoll_ctl(GEpollFd, EPOLL_CTL_ADD, GListenSock, &listenevent) == -1) {
+        panic("Failed to add listen socket to epoll! (%s)", strerror(errno));
+    }
+
+    struct epoll_event wakeevent;
+    wakeevent.events = EPOLLIN;
+    wakeevent.data.ptr = worker;  // the worker means the wake pipe.
+    if (epoll_ctl(GEpollFd, EPOLL_CTL_ADD, worker->wakefds[0], &wakeevent) == -1) {
+        panic("Failed to add wake pipe to epoll! (%s)", strerror(errno));
+    }
+    #elif MULTIZORKD_IO_URING
+    init_uring(GListenSock);
+    #endif
+}
+
+static void run_worker(void)
+{
+    #if !MULTIZORKD_EPOLL && !MULTIZORKD_IO_URING
+    struct pollfd *pollfds = NULL;
+    size_t pollfds_allocated = 0;
+    #endif
+
+    while (GStopServer < 3) {
+        #if MULTIZORKD_EPOLL || MULTIZORKD_IO_URING
+        wait_for_events(GListenSock);
+        #else
+        wait_for_events(GListenSock, &pollfds, &pollfds_allocated);
+        #endif
+
+        if (GShutdownRequested && !GStopServer) {
+            if (GWorker->num == 0) {
+                loginfo("PROCESS RECEIVED SIGNAL %d, SHUTTING DOWN!", (int) GShutdownRequested);
             }
+            GStopServer = 1;
         }
 
-        // cleanup any done sockets.
+        #if 0  // !!! FIXME: maybe add this?
         for (size_t i = 0; i < num_connections; i++) {
             Connection *conn = connections[i];
-
-            #if 0  // !!! FIXME: maybe add this?
             if ((conn->state == CONNSTATE_READY) && ((GNow - conn->last_activity) > IDLE_KICK_TIMEOUT))
                 write_to_connection(conn, "Dropping you because you seem to be AFK.");
                 drop_connection(conn);
             }
-            #endif
-
-            if (conn->state == CONNSTATE_CLOSING) {
-                const int rc = (conn->sock < 0) ? 0 : close(conn->sock);
-                // closed, or failed for a reason other than still trying to flush final writes, dump it.
-                if ((rc == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
-                    loginfo("Closed socket %d, removing connection object. %d current connections.", conn->sock, num_connections-1);
-                    free(conn->outputbuf);
-                    if (i != (num_connections-1)) {
-                        memmove(connections + i, connections + i + 1, sizeof (*connections) * ((num_connections - i) - 1));
-                    }
-                    i--;
-                    num_connections--;
-                }
-            }
         }
+        #endif
+
+        #if MOJOZORK_PROFILING
+        if (GProfileReportsDone != GProfileReportRequested) {
+            GProfileReportsDone = GProfileReportRequested;
+            flockfile(stdout);
+            printf("multizorkd: profile for worker %d:\n", GWorker->num);
+            profileReport(stdout);
+            funlockfile(stdout);
+        }
+        #endif
 
         if (GStopServer == 1) {
             GStopServer = 2;
+            #if MULTIZORKD_EPOLL
+            epoll_ctl(GEpollFd, EPOLL_CTL_DEL, GListenSock, NULL);  // no more new connections.
+            #elif MULTIZORKD_IO_URING
+            struct io_uring_sqe *sqe = get_uring_sqe();  // no more new connections.
+            io_uring_prep_cancel64(sqe, uring_tag(NULL, URING_OP_ACCEPT), 0);
+            io_uring_sqe_set_data64(sqe, uring_tag(NULL, URING_OP_IGNORE));
+            #endif
             for (size_t i = 0; i < num_connections; i++) {
                 Connection *conn = connections[i];
                 Instance *inst = conn->instance;
@@ -2752,27 +4069,255 @@ int main(int argc, char **argv)
                 GStopServer = 3;
             }
         }
+
+        // send pending output and cleanup any done sockets. This goes last, so
+        //  everything queued above gets out before we block in the next wait.
+        service_dirty_connections();
     }
 
-    // shutdown!
+    #if !MULTIZORKD_EPOLL && !MULTIZORKD_IO_URING
+    free(pollfds);
+    #endif
+}
 
-    loginfo("Final shutdown happening...");
+static void quit_worker(void)
+{
+    loginfo("Worker %d is done.", GWorker->num);
 
-    close(listensock);
+    #if MOJOZORK_PROFILING
+    flockfile(stdout);
+    printf("multizorkd: profile for worker %d:\n", GWorker->num);
+    profileReport(stdout);
+    funlockfile(stdout);
+    #endif
+
+    #if MULTIZORKD_IO_URING
+    quit_uring();  // do this first, so the kernel lets go of everything.
+    #endif
 
     for (size_t i = 0; i < num_connections; i++) {
         if (connections[i]->sock >= 0) {
             close(connections[i]->sock);
         }
-        free(connections[i]->outputbuf);
-        free(connections[i]);
+        free_connection(connections[i]);
     }
 
     free(connections);
-    free(pollfds);
-    free(GOriginalStory);
+    connections = NULL;
+    num_connections = 0;
+    free(dirty_connections);
+    dirty_connections = NULL;
+    num_dirty_connections = dirty_connections_allocated = 0;
+    free_spare_output_chunks();
+
+    #if MULTIZORKD_EPOLL
+    close(GEpollFd);
+    GEpollFd = -1;
+    #endif
+
+    #if MOJOZORK_DECODE_CACHE
+    releaseDecodeCache(GSharedDecodeCache);
+    GSharedDecodeCache = NULL;
+    #endif
+    releaseDictionaryIndex(GSharedDictionaryIndex);
+    GSharedDictionaryIndex = NULL;
+    #if MOJOZORK_STRING_CACHE
+    releaseStringCache(GSharedStringCache);
+    GSharedStringCache = NULL;
+    #endif
 
     db_quit();
+}
+
+static pthread_mutex_t GStartupMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t GStartupCond = PTHREAD_COND_INITIALIZER;
+static int GWorkersReady = 0;
+static int GWorkersReleased = 0;
+
+static void *worker_thread(void *arg)
+{
+    init_worker((Worker *) arg);
+
+    pthread_mutex_lock(&GStartupMutex);
+    GWorkersReady++;
+    pthread_cond_broadcast(&GStartupCond);
+    while (!GWorkersReleased) {  // wait for the main thread to drop privileges.
+        pthread_cond_wait(&GStartupCond, &GStartupMutex);
+    }
+    pthread_mutex_unlock(&GStartupMutex);
+
+    run_worker();
+    quit_worker();
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *storyfname = NULL;
+    int port = MULTIZORKD_DEFAULT_PORT;
+    int backlog = MULTIZORKD_DEFAULT_BACKLOG;
+    gid_t egid = MULTIZORKD_DEFAULT_EGID;
+    uid_t euid = MULTIZORKD_DEFAULT_EUID;
+    int num_workers = MULTIZORKD_DEFAULT_WORKERS;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);  // make sure output is line-buffered.
+    setvbuf(stderr, NULL, _IOLBF, 0);  // make sure output is line-buffered.
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--gid") == 0) {
+            i++;
+            egid = (gid_t) (argv[i] ? atoi(argv[i]) : 0);
+        } else if (strcmp(arg, "--uid") == 0) {
+            i++;
+            euid = (uid_t) (argv[i] ? atoi(argv[i]) : 0);
+        } else if (strcmp(arg, "--port") == 0) {
+            i++;
+            port = argv[i] ? atoi(argv[i]) : 0;
+        } else if (strcmp(arg, "--backlog") == 0) {
+            i++;
+            backlog = argv[i] ? atoi(argv[i]) : 0;
+        } else if (strcmp(arg, "--workers") == 0) {
+            i++;
+            num_workers = argv[i] ? atoi(argv[i]) : 0;
+        } else {
+            if (storyfname != NULL) {
+                panic("Tried to choose two story files! '%s' and '%s'", storyfname, arg);
+            }
+            storyfname = arg;
+        }
+    }
+
+    if (!storyfname) {
+        storyfname = "zork1.dat";
+    }
+
+    GNow = time(NULL);
+    srandom((unsigned long) GNow);
+
+    loginfo("multizork daemon " MULTIZORKD_VERSION " (built " __DATE__ " " __TIME__ ") starting up...");
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, signal_handler_shutdown);
+    signal(SIGTERM, signal_handler_shutdown);
+    signal(SIGQUIT, signal_handler_shutdown);
+    #if MOJOZORK_PROFILING
+    signal(SIGUSR1, signal_handler_profile);
+    #endif
+
+    loadInitialStory(storyfname);
+
+    if (sqlite3_initialize() != SQLITE_OK) {
+        panic("sqlite3_initialize failed!");
+    }
+
+    if (num_workers <= 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = (cpus > 0) ? (int) cpus : 1;
+    }
+
+    if ((num_workers > 1) && !sqlite3_threadsafe()) {
+        loginfo("This SQLite wasn't built to be thread-safe, so we're only using one worker thread.");
+        num_workers = 1;
+    }
+
+    GListenSock = prep_listen_socket(port, backlog);
+    if (GListenSock == -1) {
+        panic("Can't go on without a listen socket!");
+    }
+
+    GWorkers = (Worker *) calloc(num_workers, sizeof (Worker));
+    if (!GWorkers) {
+        panic("Uhoh, out of memory allocating workers!");
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        Worker *worker = &GWorkers[i];
+        worker->num = i;
+        if (pipe(worker->wakefds) == -1) {
+            panic("Failed to create wake pipe for worker %d! (%s)", i, strerror(errno));
+        }
+        for (int j = 0; j < 2; j++) {
+            fcntl(worker->wakefds[j], F_SETFL, fcntl(worker->wakefds[j], F_GETFL, 0) | O_NONBLOCK);
+            fcntl(worker->wakefds[j], F_SETFD, FD_CLOEXEC);
+        }
+        pthread_mutex_init(&worker->handoff_mutex, NULL);
+    }
+    GNumWorkers = num_workers;  // now signal handlers can wake them.
+
+    // this thread is worker 0. The others set themselves up (opening the
+    //  database, etc) before we drop privileges, then wait for us to let them go.
+    init_worker(&GWorkers[0]);
+
+    sigset_t allsignals, oldsignals;
+    sigfillset(&allsignals);
+    pthread_sigmask(SIG_BLOCK, &allsignals, &oldsignals);  // other threads inherit this, so signals only land here.
+    for (int i = 1; i < num_workers; i++) {
+        const int rc = pthread_create(&GWorkers[i].thread, NULL, worker_thread, &GWorkers[i]);
+        if (rc != 0) {
+            panic("Failed to start worker thread %d! (%s)", i, strerror(rc));
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldsignals, NULL);
+
+    pthread_mutex_lock(&GStartupMutex);
+    while (GWorkersReady < (num_workers - 1)) {
+        pthread_cond_wait(&GStartupCond, &GStartupMutex);
+    }
+    pthread_mutex_unlock(&GStartupMutex);
+
+    drop_privileges(egid, euid);
+
+    pthread_mutex_lock(&GStartupMutex);
+    GWorkersReleased = 1;
+    pthread_cond_broadcast(&GStartupCond);
+    pthread_mutex_unlock(&GStartupMutex);
+
+    loginfo("Running with story '%s'", storyfname);
+    loginfo("Now accepting connections on port %d (socket %d) with %d worker threads.", port, GListenSock, num_workers);
+
+    run_worker();
+    quit_worker();
+
+    for (int i = 1; i < num_workers; i++) {
+        pthread_join(GWorkers[i].thread, NULL);
+    }
+
+    // shutdown!
+
+    loginfo("Final shutdown happening...");
+
+    close(GListenSock);
+
+    for (int i = 0; i < num_workers; i++) {
+        Worker *worker = &GWorkers[i];
+        for (size_t j = 0; j < worker->num_handoffs; j++) {  // handed to a worker that had already quit.
+            close(worker->handoffs[j]->sock);
+            free_connection(worker->handoffs[j]);
+        }
+        free(worker->handoffs);
+        close(worker->wakefds[0]);
+        close(worker->wakefds[1]);
+        pthread_mutex_destroy(&worker->handoff_mutex);
+    }
+    GNumWorkers = 0;
+    free(GWorkers);
+    GWorkers = NULL;
+    free(GInstanceDirectory);
+
+    #if MOJOZORK_MMAP
+    if (GOriginalStoryMapped) {
+        munmap(GOriginalStory, (size_t) GOriginalStoryLen);
+    } else
+    #endif
+    {
+        free(GOriginalStory);
+    }
+    if (GStoryImageFd != -1) {
+        close(GStoryImageFd);
+    }
+
+    sqlite3_shutdown();
 
     loginfo("Your score is 350 (total of 350 points), in 371 moves.");
     loginfo("This gives you the rank of Master Adventurer.");